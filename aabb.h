@@ -2,71 +2,75 @@
 
 #include "rtweekend.h"
 
-class aabb
+// Axis aligned box of the scalar type T. The renderer uses aabb, i.e. aabb_t<real>.
+template <typename T>
+class aabb_t
 {
 	public:
-		aabb() {}
+		aabb_t() {}
 
 		// AABB can just be defined by min and max vector.
-		aabb(const vec3& a, const vec3& b) { _min = a; _max = b; }
+		aabb_t(const vec3_t<T>& a, const vec3_t<T>& b) { _min = a; _max = b; }
 
-		vec3 min() const { return _min; }
-		vec3 max() const { return _max; }
+		vec3_t<T> min() const { return _min; }
+		vec3_t<T> max() const { return _max; }
 
 		// tmin and tmax are the min / max allowed values of rays from the ray equation
 		// Implementation of ray-slab intersection
-		bool hit(const ray& r, double tmin, double tmax) const
+		bool hit(const ray_t<T>& r, T tmin, T tmax) const
 		{
-			// iterate over the three axes
+			/*
+			The ray enters the slab of axis a through the plane on the side its direction comes from,
+			which the sign of the direction selects, so no swap is needed. The loop has no branches.
+			Overlap function of intervals (f,F),(d,D) and (e,E):
+				f = max(d, e)
+				F = min(D, E)
+				return (f < F)
+
+			A ray parallel to a slab has an infinite reciprocal direction. If its origin lies in one of
+			the planes of the slab, (plane - origin) * inv_dir is 0 * inf = NaN. Comparisons with NaN are
+			false, so the ternaries keep the running tmin / tmax: the slab does not restrict the ray.
+			*/
 			for (int a = 0; a < 3; ++a)
 			{
-				/*
-				Compute the intervals while taking care of division by zero / NaNs etc.
-				Below is a more efficient version of:
-				auto t0 = ffmin((_min[a] - r.origin()[a]) / r.direction()[a],
-                                (_max[a] - r.origin()[a]) / r.direction()[a]);
-                auto t1 = ffmax((_min[a] - r.origin()[a]) / r.direction()[a],
-                                (_max[a] - r.origin()[a]) / r.direction()[a]);
-                tmin = ffmax(t0, tmin);
-                tmax = ffmin(t1, tmax);
-				
-				*/
-				auto invD = 1.0f / r.direction()[a];
-				auto t0 = (_min[a] - r.origin()[a]) * invD;
-				auto t1 = (_max[a] - r.origin()[a]) * invD;
-				if (invD < 0.0f)
-					std::swap(t0, t1);
-				
-				/* Overlap function of intervals (f,F),(d,D) and (e,E).
-					bool overlap(d, D, e, E, f, F)
-						f = max(d, e)
-						F = min(D, E)
-						return (f < F)
-				*/
+				const T near_plane = r.sign[a] ? _max[a] : _min[a];
+				const T far_plane = r.sign[a] ? _min[a] : _max[a];
+				const T t0 = (near_plane - r.orig[a]) * r.inv_dir[a];
+				const T t1 = (far_plane - r.orig[a]) * r.inv_dir[a];
+
 				tmin = t0 > tmin ? t0 : tmin;
 				tmax = t1 < tmax ? t1 : tmax;
-
-				if (tmax <= tmin)
-					return false;
 			}
-			return true;
+			return tmin < tmax;
 		}
 
-		vec3 _min;
-		vec3 _max;
+		vec3_t<T> _min;
+		vec3_t<T> _max;
 };
 
+using aabb = aabb_t<real>;
+
 // Compute the surrounding box of two aabbs: Just take the min value of x,y,z and
 // max value of x,y,z and construct the aabb out of that.
-aabb surrounding_box(const aabb& box0, const aabb& box1)
+template <typename T>
+aabb_t<T> surrounding_box(const aabb_t<T>& box0, const aabb_t<T>& box1)
 {
-	vec3 small 
+	vec3_t<T> small 
 		(min(box0.min().x(), box1.min().x()),
 		 min(box0.min().y(), box1.min().y()),
 		 min(box0.min().z(), box1.min().z()));
-	vec3 big   
+	vec3_t<T> big   
 		(max(box0.max().x(), box1.max().x()),
 		 max(box0.max().y(), box1.max().y()),
 		 max(box0.max().z(), box1.max().z()));
-	return aabb(small, big);
+	return aabb_t<T>(small, big);
+}
+
+
+// Surface area of the box, the probability of a random ray hitting it is proportional to it.
+template <typename T>
+double surface_area(const aabb_t<T>& box)
+{
+	vec3_t<T> d = box.max() - box.min();
+	return 2.0 * (d.x() * d.y() + d.y() * d.z() + d.z() * d.x());
 }
@@ -9,11 +9,11 @@ class xy_rect : public hittable
 	public:
 		xy_rect() {}
 
-		xy_rect(double _x0, double _x1, double _y0, double _y1, double _k, shared_ptr<material> mat)
+		xy_rect(real _x0, real _x1, real _y0, real _y1, real _k, shared_ptr<material> mat)
 			: x0(_x0), x1(_x1), y0(_y0), y1(_y1), k(_k), mat_ptr(mat)
 		{}
 
-		virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const;
+		virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const;
 
 		virtual bool bounding_box(double time0, double time1, aabb& output_box) const
 		{
@@ -21,14 +21,16 @@ class xy_rect : public hittable
 			return true;
 		}
 
-	
+		// Reports back faces as front faces, like wrapping the rect in flip_face. Set by compile_scene.
+		bool flipped = false;
+
 	private:
 		shared_ptr<material> mat_ptr;
-		double x0;
-		double x1;
-		double y0;
-		double y1;
-		double k;
+		real x0;
+		real x1;
+		real y0;
+		real y1;
+		real k;
 };
 
 
@@ -37,11 +39,11 @@ class xz_rect : public hittable
 public:
 	xz_rect() {}
 
-	xz_rect(double _x0, double _x1, double _z0, double _z1, double _k, shared_ptr<material> mat)
+	xz_rect(real _x0, real _x1, real _z0, real _z1, real _k, shared_ptr<material> mat)
 		: x0(_x0), x1(_x1), z0(_z0), z1(_z1), k(_k), mat_ptr(mat)
 	{}
 
-	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const;
+	virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const;
 
 	virtual bool bounding_box(double time0, double time1, aabb& output_box) const
 	{
@@ -49,14 +51,16 @@ public:
 		return true;
 	}
 
+	// Reports back faces as front faces, like wrapping the rect in flip_face. Set by compile_scene.
+	bool flipped = false;
 
 private:
 	shared_ptr<material> mat_ptr;
-	double x0;
-	double x1;
-	double z0;
-	double z1;
-	double k;
+	real x0;
+	real x1;
+	real z0;
+	real z1;
+	real k;
 };
 
 
@@ -65,11 +69,11 @@ class yz_rect : public hittable
 public:
 	yz_rect() {}
 
-	yz_rect(double _y0, double _y1, double _z0, double _z1, double _k, shared_ptr<material> mat)
+	yz_rect(real _y0, real _y1, real _z0, real _z1, real _k, shared_ptr<material> mat)
 		: y0(_y0), y1(_y1), z0(_z0), z1(_z1), k(_k), mat_ptr(mat)
 	{}
 
-	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const;
+	virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const;
 
 	virtual bool bounding_box(double time0, double time1, aabb& output_box) const
 	{
@@ -77,19 +81,23 @@ public:
 		return true;
 	}
 
+	// Reports back faces as front faces, like wrapping the rect in flip_face. Set by compile_scene.
+	bool flipped = false;
 
 private:
 	shared_ptr<material> mat_ptr;
-	double y0;
-	double y1;
-	double z0;
-	double z1;
-	double k;
+	real y0;
+	real y1;
+	real z0;
+	real z1;
+	real k;
 };
 
 
-bool xy_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+bool xy_rect::hit(const ray& r, real t_min, real t_max, hit_record& rec) const
 {
+	RTW_COUNT_HIT();
+
 	// Determine ray / rectangle hitpoint z(t) = a_z + t * b_z with z = k => t = (k - a) / b
 	auto t = (k - r.origin().z()) / r.direction().z();
 	
@@ -106,16 +114,20 @@ bool xy_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) con
 
 	rec.u = (x - x0) / (x1 - x0);
 	rec.v = (y - y0) / (y1 - y0);
+	rec.uv_scale = 1 / std::sqrt((x1 - x0) * (y1 - y0));
 	rec.t = t;
 	vec3 outward_normal = vec3(0, 0, 1);
 	rec.set_face_normal(r, outward_normal);
-	rec.mat_ptr = mat_ptr;
+	rec.front_face = rec.front_face != flipped;
+	rec.mat_ptr = mat_ptr.get();
 	rec.p = r.at(t);
 	return true;
 }
 
-bool xz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+bool xz_rect::hit(const ray& r, real t_min, real t_max, hit_record& rec) const
 {
+	RTW_COUNT_HIT();
+
 	// Determine ray / rectangle hitpoint z(t) = a_z + t * b_z with z = k => t = (k - a) / b
 	auto t = (k - r.origin().y()) / r.direction().y();
 
@@ -132,16 +144,20 @@ bool xz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) con
 
 	rec.u = (x - x0) / (x1 - x0);
 	rec.v = (z - z0) / (z1 - z0);
+	rec.uv_scale = 1 / std::sqrt((x1 - x0) * (z1 - z0));
 	rec.t = t;
 	vec3 outward_normal = vec3(0, 1, 0);
 	rec.set_face_normal(r, outward_normal);
-	rec.mat_ptr = mat_ptr;
+	rec.front_face = rec.front_face != flipped;
+	rec.mat_ptr = mat_ptr.get();
 	rec.p = r.at(t);
 	return true;
 }
 
-bool yz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+bool yz_rect::hit(const ray& r, real t_min, real t_max, hit_record& rec) const
 {
+	RTW_COUNT_HIT();
+
 	// Determine ray / rectangle hitpoint z(t) = a_z + t * b_z with z = k => t = (k - a) / b
 	auto t = (k - r.origin().x()) / r.direction().x();
 
@@ -158,10 +174,12 @@ bool yz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) con
 
 	rec.u = (y - y0) / (y1 - y0);
 	rec.v = (z - z0) / (z1 - z0);
+	rec.uv_scale = 1 / std::sqrt((y1 - y0) * (z1 - z0));
 	rec.t = t;
 	vec3 outward_normal = vec3(1, 0, 0);
 	rec.set_face_normal(r, outward_normal);
-	rec.mat_ptr = mat_ptr;
+	rec.front_face = rec.front_face != flipped;
+	rec.mat_ptr = mat_ptr.get();
 	rec.p = r.at(t);
 	return true;
 }
@@ -0,0 +1,159 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+
+/* Monotonic allocator for scene objects. Objects are packed back to back in large blocks in the
+   order the scene is built, instead of being scattered over the heap by one malloc each.
+   Individual deallocations are free; all blocks are released at once when the arena is destroyed.
+   Not thread safe: scenes are built on one thread. */
+class scene_arena
+{
+    public:
+        static const size_t cache_line = 64;
+        static const size_t huge_page = size_t(2) << 20;
+
+        // With huge_pages, blocks are 2 MiB aligned and the kernel is asked to back them with huge pages (Linux only).
+        explicit scene_arena(size_t block_size = size_t(1) << 20, bool huge_pages = false)
+            : block_size(huge_pages ? round_up(block_size, huge_page) : block_size), use_huge_pages(huge_pages)
+        {}
+
+        scene_arena(const scene_arena&) = delete;
+        scene_arena& operator=(const scene_arena&) = delete;
+
+        ~scene_arena()
+        {
+            for (const auto& b : blocks)
+                release(b);
+        }
+
+        void* allocate(size_t bytes, size_t alignment)
+        {
+            auto p = reinterpret_cast<uintptr_t>(cursor);
+            auto aligned = (p + alignment - 1) & ~(uintptr_t(alignment) - 1);
+            if (cursor == nullptr || aligned + bytes > reinterpret_cast<uintptr_t>(end))
+            {
+                add_block(bytes + alignment);
+                p = reinterpret_cast<uintptr_t>(cursor);
+                aligned = (p + alignment - 1) & ~(uintptr_t(alignment) - 1);
+            }
+            cursor = reinterpret_cast<char*>(aligned + bytes);
+            used += bytes;
+            return reinterpret_cast<void*>(aligned);
+        }
+
+        size_t bytes_used() const { return used; }
+        size_t bytes_reserved() const
+        {
+            size_t total = 0;
+            for (const auto& b : blocks)
+                total += b.size;
+            return total;
+        }
+
+    private:
+        struct block
+        {
+            char* data;
+            size_t size;
+            bool mapped;
+        };
+
+        static size_t round_up(size_t x, size_t to) { return (x + to - 1) / to * to; }
+
+        void add_block(size_t min_bytes)
+        {
+            block b{ nullptr, std::max(block_size, round_up(min_bytes, cache_line)), false };
+
+#if defined(__linux__)
+            if (use_huge_pages)
+            {
+                b.size = round_up(b.size, huge_page);
+                void* p = mmap(nullptr, b.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if (p != MAP_FAILED)
+                {
+                    madvise(p, b.size, MADV_HUGEPAGE);
+                    b.data = static_cast<char*>(p);
+                    b.mapped = true;
+                }
+            }
+#endif
+            // Blocks start on a cache line, so objects never straddle one more than their size requires.
+            if (b.data == nullptr)
+                b.data = static_cast<char*>(::operator new(b.size, std::align_val_t(cache_line)));
+
+            blocks.push_back(b);
+            cursor = b.data;
+            end = b.data + b.size;
+        }
+
+        static void release(const block& b)
+        {
+#if defined(__linux__)
+            if (b.mapped)
+            {
+                munmap(b.data, b.size);
+                return;
+            }
+#endif
+            ::operator delete(b.data, std::align_val_t(cache_line));
+        }
+
+        size_t block_size;
+        bool use_huge_pages;
+        std::vector<block> blocks;
+        char* cursor = nullptr;
+        char* end = nullptr;
+        size_t used = 0;
+};
+
+// Standard allocator interface on top of scene_arena, used with std::allocate_shared.
+template <typename T>
+struct arena_allocator
+{
+    using value_type = T;
+
+    scene_arena* arena;
+
+    explicit arena_allocator(scene_arena* a) : arena(a) {}
+
+    template <typename U>
+    arena_allocator(const arena_allocator<U>& other) : arena(other.arena) {}
+
+    T* allocate(size_t n)
+    {
+        return static_cast<T*>(arena->allocate(n * sizeof(T), alignof(T)));
+    }
+
+    // Memory is given back when the arena goes away.
+    void deallocate(T*, size_t) {}
+
+    template <typename U>
+    bool operator==(const arena_allocator<U>& other) const { return arena == other.arena; }
+
+    template <typename U>
+    bool operator!=(const arena_allocator<U>& other) const { return arena != other.arena; }
+};
+
+// Arena that scene_make allocates from. nullptr means the ordinary heap.
+inline scene_arena* current_scene_arena = nullptr;
+
+// make_shared for scene objects: object and reference counts go into the current arena, if there is one.
+// The arena must outlive every shared_ptr created this way.
+template <typename T, typename... Args>
+std::shared_ptr<T> scene_make(Args&&... args)
+{
+    if (current_scene_arena != nullptr)
+        return std::allocate_shared<T>(arena_allocator<T>(current_scene_arena), std::forward<Args>(args)...);
+    return std::make_shared<T>(std::forward<Args>(args)...);
+}
@@ -0,0 +1,1003 @@
+#pragma once
+
+#include "rtweekend.h"
+#include "aarect.h"
+#include "box.h"
+#include "bvh.h"
+#include "camera.h"
+#include "flat_bvh.h"
+#include "hittable_list.h"
+#include "image_cache.h"
+#include "image_output.h"
+#include "instance.h"
+#include "scene_compile.h"
+#include "ray_packet.h"
+#include "renderer.h"
+#include "sphere.h"
+#include "texel_image.h"
+#include "wide_bvh.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#if defined(_WIN32)
+// Before windows.h, or its min and max macros break every std::min and std::max included after it.
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#include <psapi.h>
+#elif defined(__linux__)
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
+
+// Micro benchmarks. Started with --bench <name> instead of rendering an image.
+
+// Runs f(thread_id) on the given number of threads and returns the wall-clock time in seconds.
+template <typename F>
+double time_threads(int thread_count, F f)
+{
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (int id = 1; id < thread_count; ++id)
+        threads.emplace_back(f, id);
+    f(0);
+    for (auto& thread : threads)
+        thread.join();
+    std::chrono::duration<double> diff = std::chrono::steady_clock::now() - start;
+    return diff.count();
+}
+
+// Previous generator, kept only as a baseline for benchmark_rng.
+inline double std_rand_double()
+{
+    return std::rand() / (RAND_MAX + 1.0);
+}
+
+// Previous slab test, which divided and branched per axis; kept only as a baseline for benchmark_box.
+inline bool aabb_hit_reference(const aabb& box, const ray& r, real tmin, real tmax)
+{
+    for (int a = 0; a < 3; ++a)
+    {
+        auto invD = real(1) / r.direction()[a];
+        auto t0 = (box.min()[a] - r.origin()[a]) * invD;
+        auto t1 = (box.max()[a] - r.origin()[a]) * invD;
+        if (invD < 0)
+            std::swap(t0, t1);
+        tmin = t0 > tmin ? t0 : tmin;
+        tmax = t1 < tmax ? t1 : tmax;
+        if (tmax <= tmin)
+            return false;
+    }
+    return true;
+}
+
+// Random numbers per second of std::rand and of the counter-based streams, single and batched,
+// on one thread and on all threads.
+void benchmark_rng(int thread_count)
+{
+    const long long per_thread = 20000000;
+    std::vector<double> sinks(thread_count * 8);
+
+    auto report = [&](const char* name, int threads, double seconds)
+    {
+        double sum = 0;
+        for (double x : sinks) sum += x;
+        std::cout << "  " << name << ", " << threads << " thread(s): "
+                  << per_thread * threads / seconds * 1e-6 << " M numbers/s (checksum " << sum << ")\n";
+    };
+
+    std::cout << "Random number generation\n";
+    for (int threads : { 1, thread_count })
+    {
+        double t = time_threads(threads, [&](int id)
+        {
+            double sum = 0;
+            for (long long k = 0; k < per_thread; ++k)
+                sum += std_rand_double();
+            sinks[id * 8] = sum;
+        });
+        report("std::rand      ", threads, t);
+
+        t = time_threads(threads, [&](int id)
+        {
+            rng_seed(id, 0);
+            double sum = 0;
+            for (long long k = 0; k < per_thread; ++k)
+                sum += random_double();
+            sinks[id * 8] = sum;
+        });
+        report("counter, scalar", threads, t);
+
+        t = time_threads(threads, [&](int id)
+        {
+            rng_seed(id, 0);
+            double sum = 0;
+            double lanes[4];
+            for (long long k = 0; k < per_thread; k += 4)
+            {
+                random_doubles(lanes);
+                sum += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+            }
+            sinks[id * 8] = sum;
+        });
+        report("counter, 4 lane", threads, t);
+
+        t = time_threads(threads, [&](int id)
+        {
+            rng_seed(id, 0);
+            double sum = 0;
+            double lanes[8];
+            for (long long k = 0; k < per_thread; k += 8)
+            {
+                random_doubles(lanes);
+                for (double x : lanes) sum += x;
+            }
+            sinks[id * 8] = sum;
+        });
+        report("counter, 8 lane", threads, t);
+
+        if (thread_count == 1)
+            break;
+    }
+}
+
+
+// Primary camera rays through a jittered grid plus one diffuse bounce ray from every primary hit.
+std::vector<ray> benchmark_rays(const hittable& world, const camera& cam, int resolution)
+{
+    std::vector<ray> rays;
+    for (int j = 0; j < resolution; ++j)
+    {
+        for (int i = 0; i < resolution; ++i)
+        {
+            rng_seed(static_cast<uint64_t>(j) * resolution + i, 0);
+            rays.push_back(cam.get_ray((i + random_double()) / resolution, (j + random_double()) / resolution));
+        }
+    }
+
+    const size_t primary = rays.size();
+    hit_record rec;
+    for (size_t k = 0; k < primary; ++k)
+    {
+        if (world.hit(rays[k], ray_epsilon(rays[k]), infinity, rec))
+            rays.push_back(ray(rec.p, rec.normal + random_unit_vector(), rays[k].time()));
+    }
+    return rays;
+}
+
+// Traces all rays through world and returns millions of rays per second. hits counts the rays that hit something.
+double trace_rays(const hittable& world, const std::vector<ray>& rays, long long& hits)
+{
+    hit_record rec;
+    hits = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (const auto& r : rays)
+    {
+        if (world.hit(r, ray_epsilon(r), infinity, rec))
+            ++hits;
+    }
+    std::chrono::duration<double> diff = std::chrono::steady_clock::now() - start;
+    return rays.size() / diff.count() * 1e-6;
+}
+
+// Number of bvh_node objects below (and including) object.
+size_t count_bvh_nodes(const hittable* object)
+{
+    auto node = dynamic_cast<const bvh_node*>(object);
+    if (node == nullptr)
+        return 0;
+    size_t count = 1 + count_bvh_nodes(node->left.get());
+    if (node->right != node->left)
+        count += count_bvh_nodes(node->right.get());
+    return count;
+}
+
+// Memory use, SAH cost and traversal speed of the shared_ptr bvh_node tree, its flattened copy
+// and the 4-wide and 8-wide collapsed BVHs.
+void benchmark_bvh(const char* name, hittable_list world, const camera& cam, bvh_split split)
+{
+    auto tree = scene_make<bvh_node>(world, 0.0, 1.0, split);
+    flat_bvh flat(tree);
+    wide_bvh<4> bvh4(tree);
+    wide_bvh<8> bvh8(tree);
+
+    const auto rays = benchmark_rays(*tree, cam, 512);
+
+    std::cout << name << ", " << (split == bvh_split::sah ? "binned SAH" : "random axis median")
+              << " build (" << rays.size() << " rays), SAH cost " << bvh_sah_cost(*tree) << "\n";
+
+    auto report = [&](const char* label, const hittable& accel, size_t nodes, size_t bytes)
+    {
+        long long hits = 0;
+        const double speed = trace_rays(accel, rays, hits);
+        std::cout << "  " << label << nodes << " nodes, " << bytes / 1024.0 << " KiB, "
+                  << speed << " Mrays/s, " << hits << " hits\n";
+    };
+
+    // make_shared puts the control block (two counters and a vtable pointer) next to every node.
+    const size_t tree_nodes = count_bvh_nodes(tree.get());
+    report("bvh_node tree: ", *tree, tree_nodes, tree_nodes * (sizeof(bvh_node) + 2 * sizeof(long) + sizeof(void*)));
+    report("flat_bvh:      ", flat, flat.nodes.size(), flat.memory_bytes());
+    report("wide_bvh<4>:   ", bvh4, bvh4.nodes.size(), bvh4.memory_bytes());
+    report("wide_bvh<8>:   ", bvh8, bvh8.nodes.size(), bvh8.memory_bytes());
+}
+
+// Primary rays only: traced one by one through a flat_bvh and in packets of N neighbouring pixels.
+template <int N>
+void benchmark_packet_size(const flat_bvh& bvh, const camera& cam, int resolution, long long single_hits)
+{
+    std::vector<ray_packet<N>> packets;
+    for (int j = 0; j < resolution; ++j)
+    {
+        for (int i0 = 0; i0 < resolution; i0 += N)
+        {
+            ray_packet<N> packet;
+            for (int k = 0; k < N && i0 + k < resolution; ++k)
+            {
+                rng_seed(static_cast<uint64_t>(j) * resolution + i0 + k, 0);
+                packet.rays[k] = cam.get_ray((i0 + k + random_double()) / resolution, (j + random_double()) / resolution);
+                packet.rng[k] = rng_current;
+                packet.active |= 1 << k;
+            }
+            packets.push_back(packet);
+        }
+    }
+
+    long long hits = 0;
+    hit_record rec[N];
+    auto start = std::chrono::steady_clock::now();
+    for (auto& packet : packets)
+    {
+        int mask = packet_hit(bvh, packet, infinity, rec);
+        for (; mask != 0; mask &= mask - 1)
+            ++hits;
+    }
+    std::chrono::duration<double> diff = std::chrono::steady_clock::now() - start;
+
+    std::cout << "  packets of " << N << ": " << double(resolution) * resolution / diff.count() * 1e-6
+              << " Mrays/s, " << hits << " hits" << (hits == single_hits ? "" : " (differs from single rays)") << "\n";
+}
+
+void benchmark_packets(const char* name, hittable_list world, const camera& cam)
+{
+    const int resolution = 512;
+    flat_bvh bvh(world, 0.0, 1.0);
+
+    std::vector<ray> rays;
+    for (int j = 0; j < resolution; ++j)
+    {
+        for (int i = 0; i < resolution; ++i)
+        {
+            rng_seed(static_cast<uint64_t>(j) * resolution + i, 0);
+            rays.push_back(cam.get_ray((i + random_double()) / resolution, (j + random_double()) / resolution));
+        }
+    }
+
+    long long hits = 0;
+    const double speed = trace_rays(bvh, rays, hits);
+    std::cout << name << " primary rays\n"
+              << "  single rays:   " << speed << " Mrays/s, " << hits << " hits\n";
+
+    benchmark_packet_size<4>(bvh, cam, resolution, hits);
+    benchmark_packet_size<8>(bvh, cam, resolution, hits);
+    benchmark_packet_size<16>(bvh, cam, resolution, hits);
+}
+
+// Camera samples per second when the whole image is rendered by kernel on 1, 8 and 64 threads.
+// Thread counts above the number of cores only time-slice them, so they say nothing about contention.
+template <typename Kernel>
+void benchmark_threads(int width, int height, int tile_size, Kernel kernel)
+{
+    const unsigned cores = std::thread::hardware_concurrency();
+    std::cout << cores << " core(s)\n";
+    for (int threads : { 1, 8, 64 })
+    {
+        tile_renderer renderer(width, height, tile_size, threads);
+        renderer.run(kernel);
+
+        long long samples = 0;
+        for (const auto& s : renderer.stats)
+            samples += s.samples;
+        std::cout << threads << " thread(s): " << samples / renderer.wall_seconds * 1e-6 << " M samples/s"
+                  << (cores != 0 && static_cast<unsigned>(threads) > cores ? " (more threads than cores)" : "") << "\n";
+    }
+}
+
+// Resident set size of the process in bytes, 0 where it can't be queried.
+size_t current_rss_bytes()
+{
+#if defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS counters;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+        return counters.WorkingSetSize;
+    return 0;
+#elif defined(__linux__)
+    long pages = 0;
+    std::FILE* statm = std::fopen("/proc/self/statm", "r");
+    if (statm == nullptr)
+        return 0;
+    if (std::fscanf(statm, "%*s %ld", &pages) != 1)
+        pages = 0;
+    std::fclose(statm);
+    return static_cast<size_t>(pages) * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+#else
+    return 0;
+#endif
+}
+
+// Highest resident set size so far in bytes, 0 where it can't be queried.
+size_t peak_rss_bytes()
+{
+#if defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS counters;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+        return counters.PeakWorkingSetSize;
+    return 0;
+#elif defined(__linux__)
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return static_cast<size_t>(usage.ru_maxrss) * 1024;
+#else
+    return 0;
+#endif
+}
+
+// Scene construction with every object on the heap, in a scene_arena and in an arena backed by huge pages:
+// build time (scene and 4-wide BVH), memory, trace speed and the time it takes to tear everything down.
+// build() creates the scene through scene_make and returns it.
+template <typename Build>
+void benchmark_arena(const char* name, const camera& cam, Build build)
+{
+    using clock = std::chrono::steady_clock;
+    scene_arena* const saved = current_scene_arena;
+
+    std::cout << name << " construction\n";
+    for (int mode = 0; mode < 3; ++mode)
+    {
+        std::unique_ptr<scene_arena> arena;
+        if (mode > 0)
+            arena.reset(new scene_arena(size_t(1) << 20, mode == 2));
+        current_scene_arena = arena.get();
+
+        const size_t rss_before = current_rss_bytes();
+        auto start = clock::now();
+        auto world = std::make_shared<hittable_list>(build());
+        auto accel = scene_make<wide_bvh<4>>(*world, 0.0, 1.0);
+        std::chrono::duration<double> build_time = clock::now() - start;
+        const size_t rss_after = current_rss_bytes();
+        current_scene_arena = saved;
+
+        const auto rays = benchmark_rays(*accel, cam, 512);
+        long long hits = 0;
+        const double speed = trace_rays(*accel, rays, hits);
+
+        start = clock::now();
+        accel.reset();
+        world.reset();
+        arena.reset();
+        std::chrono::duration<double> teardown_time = clock::now() - start;
+
+        const char* label = mode == 0 ? "heap:             " : mode == 1 ? "arena:            " : "arena, huge pages:";
+        std::cout << "  " << label << " build " << build_time.count() * 1e3 << " ms"
+                  << ", RSS +" << (rss_after - std::min(rss_after, rss_before)) / 1024.0 << " KiB"
+                  << ", " << speed << " Mrays/s (" << hits << " hits)"
+                  << ", teardown " << teardown_time.count() * 1e3 << " ms\n";
+    }
+    std::cout << "  peak RSS " << peak_rss_bytes() / 1024.0 << " KiB\n";
+}
+
+// Scalar type and the sizes it determines, printed with every render so runs of the double and
+// the RTW_FLOAT32 build (and of the scalar and the RTW_SIMD_VEC3 vec3) can be told apart.
+void print_precision(std::ostream& out, size_t scene_bytes)
+{
+    out << "Precision: " << (sizeof(real) == sizeof(float) ? "float" : "double")
+        << (vec3::simd ? ", SIMD vec3" : ", scalar vec3")
+        << " (vec3 " << sizeof(vec3) << " B, ray " << sizeof(ray) << " B, aabb " << sizeof(aabb)
+        << " B, hit_record " << sizeof(hit_record) << " B)";
+    if (scene_bytes > 0)
+        out << ", scene " << scene_bytes / 1024.0 << " KiB";
+    out << "\n";
+}
+
+// Reads an 8-bit ASCII (P3) or binary (P6) PPM. Returns false if the file can't be read.
+bool read_ppm(const std::string& path, int& width, int& height, std::vector<int>& values)
+{
+    std::ifstream in(path, std::ios::binary);
+    std::string magic;
+    int max_value = 0;
+    if (!(in >> magic >> width >> height >> max_value) || (magic != "P3" && magic != "P6") || max_value > 255)
+        return false;
+
+    values.resize(static_cast<size_t>(width) * height * 3);
+    if (magic == "P6")
+    {
+        in.get(); // the single whitespace after the header
+        std::vector<uint8_t> bytes(values.size());
+        if (!in.read(reinterpret_cast<char*>(bytes.data()), static_cast<std::streamsize>(bytes.size())))
+            return false;
+        std::copy(bytes.begin(), bytes.end(), values.begin());
+        return true;
+    }
+
+    for (int& v : values)
+    {
+        if (!(in >> v))
+            return false;
+    }
+    return true;
+}
+
+// Error of an image against a reference of the same size (e.g. the float render against the double
+// one), on the 8-bit output values: RMSE, largest difference and share of differing values.
+void print_image_error(std::ostream& out, const std::string& image, const std::string& reference)
+{
+    int w0, h0, w1, h1;
+    std::vector<int> a, b;
+    if (!read_ppm(image, w0, h0, a) || !read_ppm(reference, w1, h1, b) || w0 != w1 || h0 != h1)
+    {
+        out << "Can't compare " << image << " with " << reference << "\n";
+        return;
+    }
+
+    double squares = 0.0;
+    int largest = 0;
+    size_t differing = 0;
+    for (size_t k = 0; k < a.size(); ++k)
+    {
+        const int d = std::abs(a[k] - b[k]);
+        squares += double(d) * d;
+        largest = std::max(largest, d);
+        differing += d != 0;
+    }
+    out << "Error against " << reference << ": RMSE " << std::sqrt(squares / a.size())
+        << ", max " << largest << ", " << 100.0 * differing / a.size() << "% of the values differ\n";
+}
+
+// Throughput of the vec3 operations on the hot path, to compare the scalar vec3 with the SIMD one
+// (build with and without RTW_SIMD_VEC3). Every loop feeds its result into a checksum.
+void benchmark_vec3()
+{
+    const int count = 4096;
+    const int rounds = 2000;
+    using clock = std::chrono::steady_clock;
+
+    rng_seed(1, 0);
+    std::vector<vec3> a(count), b(count);
+    std::vector<ray> rays(count);
+    for (int k = 0; k < count; ++k)
+    {
+        a[k] = vec3::random(-1, 1);
+        b[k] = vec3::random(-1, 1);
+        rays[k] = ray(vec3::random(-4, 4), random_unit_vector());
+    }
+    const aabb box(vec3(-1, -1, -1), vec3(1, 1, 1));
+    const sphere ball(vec3(0, 0, 0), 1, nullptr);
+
+    std::cout << "vec3 operations, " << (vec3::simd ? "SIMD" : "scalar") << " vec3 of "
+              << (sizeof(real) == sizeof(float) ? "float" : "double") << "\n";
+
+    auto report = [&](const char* name, auto op)
+    {
+        double checksum = 0.0;
+        auto start = clock::now();
+        for (int round = 0; round < rounds; ++round)
+        {
+            for (int k = 0; k < count; ++k)
+                checksum += op(k);
+        }
+        std::chrono::duration<double> diff = clock::now() - start;
+        std::cout << "  " << name << double(count) * rounds / diff.count() * 1e-6 << " M/s (checksum " << checksum << ")\n";
+    };
+
+    report("dot:          ", [&](int k) { return dot(a[k], b[k]); });
+    report("cross:        ", [&](int k) { return cross(a[k], b[k]).x(); });
+    report("unit_vector:  ", [&](int k) { return unit_vector(a[k] + b[k]).y(); });
+    report("a + t * b:    ", [&](int k) { return (a[k] + 0.5 * b[k]).z(); });
+    report("aabb::hit:    ", [&](int k) { return box.hit(rays[k], 0.001, infinity) ? 1.0 : 0.0; });
+    report("sphere::hit:  ", [&](int k)
+    {
+        hit_record rec;
+        return ball.hit(rays[k], 0.001, infinity, rec) ? double(rec.t) : 0.0;
+    });
+}
+
+// Ray/box tests per second of the previous slab test and of aabb::hit with the precomputed reciprocal
+// direction. A quarter of the rays run parallel to an axis, half of those start in a box plane.
+void benchmark_box()
+{
+    const int box_count = 1024;
+    const int ray_count = 1024;
+    const int rounds = 20;
+    using clock = std::chrono::steady_clock;
+
+    rng_seed(2, 0);
+    std::vector<aabb> boxes;
+    for (int k = 0; k < box_count; ++k)
+    {
+        const vec3 lo = vec3::random(-4, 4);
+        boxes.push_back(aabb(lo, lo + vec3::random(0.1, 2)));
+    }
+
+    std::vector<ray> rays;
+    for (int k = 0; k < ray_count; ++k)
+    {
+        vec3 origin = vec3::random(-6, 6);
+        vec3 direction = random_unit_vector();
+        if (k % 4 == 0)
+        {
+            const int axis = k / 4 % 3;
+            direction[axis] = 0;
+            if (k % 8 == 0)
+                origin[axis] = boxes[k % box_count].min()[axis];
+        }
+        rays.push_back(ray(origin, direction));
+    }
+
+    std::cout << "Ray/box tests (" << box_count << " boxes x " << ray_count << " rays)\n";
+
+    auto run = [&](const char* name, auto test)
+    {
+        long long hits = 0;
+        auto start = clock::now();
+        for (int round = 0; round < rounds; ++round)
+        {
+            for (const auto& r : rays)
+            {
+                for (const auto& box : boxes)
+                    hits += test(box, r);
+            }
+        }
+        std::chrono::duration<double> diff = clock::now() - start;
+        std::cout << "  " << name << double(box_count) * ray_count * rounds / diff.count() * 1e-6
+                  << " M tests/s, " << hits / rounds << " hits\n";
+    };
+
+    run("divide and branch: ", [](const aabb& box, const ray& r) { return aabb_hit_reference(box, r, epsilon, infinity); });
+    run("aabb::hit:         ", [](const aabb& box, const ray& r) { return box.hit(r, epsilon, infinity); });
+}
+
+/* Writes a width x height frame of random radiance sums the old way (vec3::write_color, ASCII P3) and in
+   every format of the output stage, on thread_count encoding threads. The files go to the working directory. */
+void benchmark_output(int width, int height, int thread_count)
+{
+    using clock = std::chrono::steady_clock;
+
+    const int samples = 16;
+    framebuffer fb(width, height);
+    rng_seed(5, 0);
+    for (size_t k = 0; k < fb.size(); ++k)
+        fb.add(k, vec3::random(0, 20), vec3(), samples);
+    const tonemap_settings settings;
+
+    std::cout << "Output of a " << width << " x " << height << " frame, " << thread_count << " encoding threads\n";
+
+    auto report = [&](const char* label, const std::string& path, auto write)
+    {
+        const auto start = clock::now();
+        write();
+        const std::chrono::duration<double> diff = clock::now() - start;
+        std::error_code error;
+        const auto bytes = std::filesystem::file_size(path, error);
+        std::cout << "  " << label << diff.count() * 1000 << " ms, " << (error ? 0 : bytes) / (1024.0 * 1024.0) << " MiB\n";
+        std::filesystem::remove(path, error);
+    };
+
+    report("P3 write_color: ", "bench_output_p3.ppm", [&]
+    {
+        std::ofstream out("bench_output_p3.ppm");
+        out << "P3\n" << width << " " << height << "\n255\n";
+        for (int j = height - 1; j >= 0; --j)
+        {
+            for (int i = 0; i < width; ++i)
+            {
+                vec3 pixel = fb.sums[fb.index(i, j)];
+                pixel.write_color(out, samples);
+            }
+        }
+    });
+    report("P6:             ", "bench_output.ppm", [&] { write_image(fb, "bench_output.ppm", image_format::ppm, settings, thread_count); });
+    report("PNG:            ", "bench_output.png", [&] { write_image(fb, "bench_output.png", image_format::png, settings, thread_count); });
+    report("PFM:            ", "bench_output.pfm", [&] { write_image(fb, "bench_output.pfm", image_format::pfm, settings, thread_count); });
+    report("HDR:            ", "bench_output.hdr", [&] { write_image(fb, "bench_output.hdr", image_format::hdr, settings, thread_count); });
+    report("P6, reinhard:   ", "bench_output.ppm", [&]
+    {
+        tonemap_settings reinhard;
+        reinhard.op = tone_operator::reinhard;
+        write_image(fb, "bench_output.ppm", image_format::ppm, reinhard, thread_count);
+    });
+    report("P6, 1 thread:   ", "bench_output.ppm", [&] { write_image(fb, "bench_output.ppm", image_format::ppm, settings, 1); });
+}
+
+/* count textures of the same image file, created the old way (one stbi_load each, as every scene
+   function used to do) and through an image_cache: how long creating them blocks, when the first texel
+   can be read, and how many decoded copies are held. */
+void benchmark_images(const std::string& path, int count)
+{
+    using clock = std::chrono::steady_clock;
+    auto ms = [](clock::duration d) { return std::chrono::duration<double, std::milli>(d).count(); };
+
+    std::cout << count << " textures of " << path << "\n";
+
+    {
+        const auto start = clock::now();
+        std::vector<unsigned char*> copies;
+        size_t bytes = 0;
+        for (int k = 0; k < count; ++k)
+        {
+            int nx = 0, ny = 0, nn = 0;
+            copies.push_back(stbi_load(path.c_str(), &nx, &ny, &nn, 3));
+            bytes += static_cast<size_t>(nx) * ny * 3;
+        }
+        std::cout << "  stbi_load each: " << ms(clock::now() - start) << " ms blocked, "
+                  << bytes / (1024.0 * 1024.0) << " MiB decoded\n";
+        for (auto p : copies)
+            stbi_image_free(p);
+    }
+
+    {
+        image_cache cache(2);
+        const auto start = clock::now();
+        std::vector<std::shared_ptr<const cached_image>> textures;
+        for (int k = 0; k < count; ++k)
+            textures.push_back(cache.load(path));
+        const auto created = clock::now();
+        const texel_image& image = textures[0]->get();
+        const auto first_texel = clock::now();
+        std::cout << "  image_cache:    " << ms(created - start) << " ms blocked, first texel after "
+                  << ms(first_texel - start) << " ms, " << cache.file_count() << " decode, "
+                  << image.memory_bytes() / (1024.0 * 1024.0) << " MiB of texels\n";
+    }
+}
+
+// Previous image_texture lookup, straight from the 8-bit rows of the file; kept only as a baseline for benchmark_textures.
+inline vec3 texture_lookup_reference(const unsigned char* data, int nx, int ny, double u, double v)
+{
+    const int i = std::clamp(static_cast<int>(u * nx), 0, nx - 1);
+    const int j = std::clamp(static_cast<int>((1 - v) * ny - epsilon), 0, ny - 1);
+    const unsigned char* p = data + 3 * i + 3 * nx * j;
+    return vec3(p[0] / 255.0, p[1] / 255.0, p[2] / 255.0);
+}
+
+// The same lookup filtered bilinearly, as it would read the rows; a baseline for the tiled bilinear lookups.
+inline vec3 texture_bilinear_reference(const unsigned char* data, int nx, int ny, double u, double v)
+{
+    const double x = u * nx - 0.5;
+    const double y = (1 - v) * ny - 0.5;
+    const double x_floor = std::floor(x);
+    const double y_floor = std::floor(y);
+    const real fx = static_cast<real>(x - x_floor);
+    const real fy = static_cast<real>(y - y_floor);
+    const int x0 = std::clamp(static_cast<int>(x_floor), 0, nx - 1);
+    const int x1 = std::clamp(static_cast<int>(x_floor) + 1, 0, nx - 1);
+    const int y0 = std::clamp(static_cast<int>(y_floor), 0, ny - 1);
+    const int y1 = std::clamp(static_cast<int>(y_floor) + 1, 0, ny - 1);
+    auto texel = [&](int i, int j)
+    {
+        const unsigned char* p = data + 3 * i + 3 * nx * j;
+        return vec3(p[0] / 255.0, p[1] / 255.0, p[2] / 255.0);
+    };
+    return (1 - fy) * ((1 - fx) * texel(x0, y0) + fx * texel(x1, y0)) + fy * ((1 - fx) * texel(x0, y1) + fx * texel(x1, y1));
+}
+
+/* Texture lookups per second at the uv of every hit of the benchmark rays in world: from the 8-bit rows as
+   image_texture used to read them, from the tiled texels of every format, nearest and bilinear, and from
+   mipmapped texels at the footprint of the rays of a 512x512 image. Every format also reports its memory
+   and its error against the file (PSNR; r8 only keeps the red channel, so it is not compared). The hits are looked up in pixel order,
+   as neighbouring camera rays ask for them, and shuffled, as bounce rays spread over the scene do. */
+void benchmark_textures(const char* name, const hittable_list& world, camera cam, const std::string& path)
+{
+    const int rounds = 20;
+    using clock = std::chrono::steady_clock;
+
+    int nx = 0, ny = 0, nn = 0;
+    unsigned char* pixels = stbi_load(path.c_str(), &nx, &ny, &nn, 3);
+    if (pixels == nullptr)
+    {
+        std::cerr << "Could not load image " << path << "\n";
+        return;
+    }
+    const texel_image unorm8_texels(pixels, nx, ny, 3, texel_format::unorm8);
+    const texel_image float_texels(pixels, nx, ny, 3, texel_format::float32);
+    const texel_image half_texels(pixels, nx, ny, 3, texel_format::half);
+    const texel_image r8_texels(pixels, nx, ny, 3, texel_format::r8);
+    const texel_image bc1_texels(pixels, nx, ny, 3, texel_format::bc1);
+    const texel_image bc7_texels(pixels, nx, ny, 3, texel_format::bc7);
+    const texel_image mipmapped_texels(pixels, nx, ny, 3, texel_format::unorm8, true);
+    const texel_image mipmapped_bc1_texels(pixels, nx, ny, 3, texel_format::bc1, true);
+
+    struct lookup_point
+    {
+        double u, v;
+        real footprint;
+    };
+
+    cam.set_pixel_footprint(512, 1);
+    std::vector<lookup_point> ordered;
+    hit_record rec;
+    for (const auto& r : benchmark_rays(world, cam, 512))
+    {
+        if (world.hit(r, ray_epsilon(r), infinity, rec))
+            ordered.push_back({ rec.u, rec.v, rec.texture_footprint(r) });
+    }
+    auto shuffled = ordered;
+    rng_seed(5, 0);
+    for (size_t k = shuffled.size(); k > 1; --k)
+        std::swap(shuffled[k - 1], shuffled[static_cast<size_t>(random_double() * k)]);
+
+    std::cout << name << ": " << ordered.size() << " texture lookups into " << path << " (" << nx << "x" << ny << ", "
+              << static_cast<double>(nx) * ny * 3 / (1024.0 * 1024.0) << " MiB as 8-bit rows)\n";
+    auto report = [&](const char* label, const texel_image& texels, bool compare)
+    {
+        std::cout << "  " << label << texels.memory_bytes() / (1024.0 * 1024.0) << " MiB";
+        if (compare)
+        {
+            double squared_error = 0;
+            for (int y = 0; y < ny; ++y)
+            {
+                for (int x = 0; x < nx; ++x)
+                {
+                    const vec3 c = texels.texel(x, y);
+                    for (int k = 0; k < 3; ++k)
+                    {
+                        const double d = 255.0 * c[k] - pixels[3 * (static_cast<size_t>(y) * nx + x) + k];
+                        squared_error += d * d;
+                    }
+                }
+            }
+            const double mse = squared_error / (3.0 * nx * ny);
+            std::cout << ", PSNR " << (mse > 0 ? 10 * std::log10(255.0 * 255.0 / mse) : infinity) << " dB";
+        }
+        std::cout << "\n";
+    };
+    report("unorm8 texels: ", unorm8_texels, true);
+    report("half texels:   ", half_texels, true);
+    report("float texels:  ", float_texels, true);
+    report("r8 texels:     ", r8_texels, false);
+    report("bc1 blocks:    ", bc1_texels, true);
+    report("bc7 blocks:    ", bc7_texels, true);
+    report("unorm8 mips:   ", mipmapped_texels, false);
+    report("bc1 mips:      ", mipmapped_bc1_texels, false);
+
+    auto run = [&](const char* label, auto lookup)
+    {
+        std::cout << "  " << label;
+        for (const auto* uvs : { &ordered, &shuffled })
+        {
+            double checksum = 0.0;
+            auto start = clock::now();
+            for (int round = 0; round < rounds; ++round)
+            {
+                for (const auto& point : *uvs)
+                {
+                    const vec3 c = lookup(point);
+                    checksum += c.x() + c.y() + c.z();
+                }
+            }
+            std::chrono::duration<double> diff = clock::now() - start;
+            std::cout << double(uvs->size()) * rounds / diff.count() * 1e-6 << (uvs == &ordered ? " M/s in pixel order, " : " M/s shuffled");
+            if (uvs == &shuffled)
+                std::cout << " (checksum " << checksum / rounds << ")\n";
+        }
+    };
+
+    run("8-bit rows, nearest:    ", [&](const lookup_point& p) { return texture_lookup_reference(pixels, nx, ny, p.u, p.v); });
+    run("unorm8 tiles, nearest:  ", [&](const lookup_point& p) { return unorm8_texels.nearest(p.u, p.v); });
+    run("half tiles, nearest:    ", [&](const lookup_point& p) { return half_texels.nearest(p.u, p.v); });
+    run("float tiles, nearest:   ", [&](const lookup_point& p) { return float_texels.nearest(p.u, p.v); });
+    run("r8 tiles, nearest:      ", [&](const lookup_point& p) { return r8_texels.nearest(p.u, p.v); });
+    run("bc1 blocks, nearest:    ", [&](const lookup_point& p) { return bc1_texels.nearest(p.u, p.v); });
+    run("bc7 blocks, nearest:    ", [&](const lookup_point& p) { return bc7_texels.nearest(p.u, p.v); });
+    run("8-bit rows, bilinear:   ", [&](const lookup_point& p) { return texture_bilinear_reference(pixels, nx, ny, p.u, p.v); });
+    run("unorm8 tiles, bilinear: ", [&](const lookup_point& p) { return unorm8_texels.bilinear(p.u, p.v); });
+    run("half tiles, bilinear:   ", [&](const lookup_point& p) { return half_texels.bilinear(p.u, p.v); });
+    run("float tiles, bilinear:  ", [&](const lookup_point& p) { return float_texels.bilinear(p.u, p.v); });
+    run("r8 tiles, bilinear:     ", [&](const lookup_point& p) { return r8_texels.bilinear(p.u, p.v); });
+    run("bc1 blocks, bilinear:   ", [&](const lookup_point& p) { return bc1_texels.bilinear(p.u, p.v); });
+    run("bc7 blocks, bilinear:   ", [&](const lookup_point& p) { return bc7_texels.bilinear(p.u, p.v); });
+    run("unorm8 mip, nearest:    ", [&](const lookup_point& p) { return mipmapped_texels.sample_footprint(p.u, p.v, texture_filter::nearest, p.footprint); });
+    run("unorm8 mip, trilinear:  ", [&](const lookup_point& p) { return mipmapped_texels.sample_footprint(p.u, p.v, texture_filter::bilinear, p.footprint); });
+    run("bc1 mip, trilinear:     ", [&](const lookup_point& p) { return mipmapped_bc1_texels.sample_footprint(p.u, p.v, texture_filter::bilinear, p.footprint); });
+
+    stbi_image_free(pixels);
+}
+
+/* A city of count boxes on a grid, under wide_bvh<4>, with every box as six rects in a list (what box used
+   to be), as a box object and as box_runs of the batched slab test. Builds with RTW_COUNT_HITS also report
+   the hit() calls per ray. */
+void benchmark_boxes(int count)
+{
+    const bool saved_batching = box_batching;
+    const int per_side = static_cast<int>(std::ceil(std::sqrt(count)));
+
+    auto mat = std::make_shared<lambertian>(std::make_shared<constant_texture>(vec3(0.5, 0.5, 0.5)));
+    auto six_rects = [&](const vec3& p0, const vec3& p1)
+    {
+        auto sides = scene_make<hittable_list>();
+        sides->add(scene_make<xy_rect>(p0.x(), p1.x(), p0.y(), p1.y(), p1.z(), mat));
+        sides->add(scene_make<flip_face>(scene_make<xy_rect>(p0.x(), p1.x(), p0.y(), p1.y(), p0.z(), mat)));
+        sides->add(scene_make<xz_rect>(p0.x(), p1.x(), p0.z(), p1.z(), p1.y(), mat));
+        sides->add(scene_make<flip_face>(scene_make<xz_rect>(p0.x(), p1.x(), p0.z(), p1.z(), p0.y(), mat)));
+        sides->add(scene_make<yz_rect>(p0.y(), p1.y(), p0.z(), p1.z(), p1.x(), mat));
+        sides->add(scene_make<flip_face>(scene_make<yz_rect>(p0.y(), p1.y(), p0.z(), p1.z(), p0.x(), mat)));
+        return sides;
+    };
+
+    hittable_list rects, boxes;
+    rng_seed(4, 0);
+    for (int k = 0; k < count; ++k)
+    {
+        const vec3 p0(2.0 * (k % per_side), 0, 2.0 * (k / per_side));
+        const vec3 p1 = p0 + vec3(random_double(0.5, 1.9), random_double(0.5, 6), random_double(0.5, 1.9));
+        rects.add(six_rects(p0, p1));
+        boxes.add(scene_make<box>(p0, p1, mat));
+    }
+
+    camera cam(vec3(-10, 25, -10), vec3(per_side, 0, per_side), vec3(0, 1, 0), 40, 1.0, 0.0, 10.0, 0.0, 1.0);
+    std::cout << count << " boxes\n";
+
+    auto run = [&](const char* label, hittable_list& world, bool batching)
+    {
+        box_batching = batching;
+        wide_bvh<4> accel(world, 0.0, 1.0);
+        const auto rays = benchmark_rays(accel, cam, 512);
+
+        long long hits = 0;
+#ifdef RTW_COUNT_HITS
+        hit_call_count = 0;
+#endif
+        const double speed = trace_rays(accel, rays, hits);
+
+        std::cout << "  " << label << speed << " Mrays/s (" << hits << " hits)";
+#ifdef RTW_COUNT_HITS
+        std::cout << ", " << double(hit_call_count) / rays.size() << " hit() calls per ray";
+#endif
+        std::cout << "\n";
+    };
+
+    run("six rects: ", rects, false);
+    run("box:       ", boxes, false);
+    run("box_run:   ", boxes, true);
+
+    box_batching = saved_batching;
+}
+
+/* count copies of one 1000 sphere cluster, built twice: as duplicated spheres under one BVH and as
+   instances of the shared cluster BVH under a tlas. Reports build time, memory and trace speed, and what
+   it costs to move every copy: a rebuild of all the duplicated geometry versus refitting the tlas. */
+void benchmark_instances(int count)
+{
+    using clock = std::chrono::steady_clock;
+    scene_arena* const saved = current_scene_arena;
+    const int per_side = static_cast<int>(std::ceil(std::sqrt(count)));
+
+    rng_seed(3, 0);
+    std::vector<vec3> centers;
+    for (int k = 0; k < 1000; ++k)
+        centers.push_back(vec3::random(-4, 4));
+    auto mat = std::make_shared<lambertian>(std::make_shared<constant_texture>(vec3(0.5, 0.5, 0.5)));
+
+    auto placement = [&](int k, double angle)
+    {
+        const vec3 position(20.0 * (k % per_side), 0, 20.0 * (k / per_side));
+        return affine_transform::translation(position) * affine_transform::rotation(vec3(0, 1, 0), angle + 10 * k);
+    };
+
+    camera cam(vec3(-40, 60, -40), vec3(10.0 * per_side, 0, 10.0 * per_side), vec3(0, 1, 0), 40, 1.0, 0.0, 10.0, 0.0, 1.0);
+
+    std::cout << count << " copies of " << centers.size() << " spheres\n";
+
+    // Duplicated spheres: every move means building all of them again.
+    {
+        scene_arena arena;
+        current_scene_arena = &arena;
+        auto build = [&](double angle)
+        {
+            hittable_list copies;
+            for (int k = 0; k < count; ++k)
+            {
+                const affine_transform t = placement(k, angle);
+                for (const auto& c : centers)
+                    copies.add(scene_make<sphere>(t.point(c), 0.5, mat));
+            }
+            return scene_make<bvh_node>(copies, 0.0, 1.0);
+        };
+
+        auto start = clock::now();
+        auto world = build(0);
+        std::chrono::duration<double> build_time = clock::now() - start;
+        const size_t bytes = arena.bytes_used();
+
+        long long hits = 0;
+        const double speed = trace_rays(*world, benchmark_rays(*world, cam, 512), hits);
+
+        start = clock::now();
+        world = build(5);
+        std::chrono::duration<double> move_time = clock::now() - start;
+
+        std::cout << "  duplicated: build " << build_time.count() * 1e3 << " ms, " << bytes / 1024.0 << " KiB, "
+                  << speed << " Mrays/s (" << hits << " hits), move all " << move_time.count() * 1e3 << " ms\n";
+        current_scene_arena = saved;
+    }
+
+    // Instances: the cluster is built once, moving the copies refits the tlas.
+    {
+        scene_arena arena;
+        current_scene_arena = &arena;
+
+        auto start = clock::now();
+        hittable_list cluster;
+        for (const auto& c : centers)
+            cluster.add(scene_make<sphere>(c, 0.5, mat));
+        shared_ptr<hittable> blas = scene_make<bvh_node>(cluster, 0.0, 1.0);
+        const size_t blas_bytes = arena.bytes_used();
+
+        std::vector<shared_ptr<instance>> copies;
+        for (int k = 0; k < count; ++k)
+            copies.push_back(scene_make<instance>(blas, placement(k, 0)));
+        tlas top(copies);
+        std::chrono::duration<double> build_time = clock::now() - start;
+        const size_t bytes = arena.bytes_used() + top.memory_bytes() - top.instances.size() * sizeof(instance);
+
+        long long hits = 0;
+        const double speed = trace_rays(top, benchmark_rays(top, cam, 512), hits);
+
+        start = clock::now();
+        for (int k = 0; k < count; ++k)
+            top.instances[k]->set_transform(placement(k, 5));
+        top.refit();
+        std::chrono::duration<double> move_time = clock::now() - start;
+
+        std::cout << "  instanced:  build " << build_time.count() * 1e3 << " ms, " << bytes / 1024.0 << " KiB ("
+                  << blas_bytes / 1024.0 << " KiB shared, " << sizeof(instance) << " B per instance), "
+                  << speed << " Mrays/s (" << hits << " hits), move all " << move_time.count() * 1e3 << " ms\n";
+        current_scene_arena = saved;
+    }
+}
+
+void print_compile_stats(std::ostream& out, const scene_compile_stats& stats)
+{
+    out << "Compiled scene: " << stats.transforms_folded << " transforms folded into " << stats.transform_chains
+        << " instances, " << stats.flips_folded << " flip_faces folded\n";
+}
+
+/* Trace speed of a scene before and after compile_scene, both under the wide_bvh<4> that renders use.
+   Builds with RTW_COUNT_HITS also report the hit() calls per ray; those are virtual calls except for the
+   root one. */
+void benchmark_compile(const char* name, hittable_list world, const camera& cam)
+{
+    scene_compile_stats stats;
+    hittable_list compiled = compile_scene(world, stats);
+
+    std::cout << name << "\n  ";
+    print_compile_stats(std::cout, stats);
+
+    for (int pass = 0; pass < 2; ++pass)
+    {
+        wide_bvh<4> accel(pass == 0 ? world : compiled, 0.0, 1.0);
+        const auto rays = benchmark_rays(accel, cam, 512);
+
+        long long hits = 0;
+#ifdef RTW_COUNT_HITS
+        hit_call_count = 0;
+#endif
+        const double speed = trace_rays(accel, rays, hits);
+
+        std::cout << (pass == 0 ? "  original: " : "  compiled: ") << speed << " Mrays/s (" << hits << " hits)";
+#ifdef RTW_COUNT_HITS
+        std::cout << ", " << double(hit_call_count) / rays.size() << " hit() calls per ray";
+#endif
+        std::cout << "\n";
+    }
+}
@@ -0,0 +1,406 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+
+/* Block compression of 4x4 texels, in the layouts of the GPU formats so the blocks could be handed to a
+   graphics API unchanged:
+     BC1      8 bytes, 4 bits per texel: two RGB565 endpoints and a 2-bit index per texel choosing one of
+              four colours on the line between them.
+     BC7 (6)  16 bytes, 8 bits per texel: mode 6 of BC7, two RGBA endpoints of 7 bits plus a shared low
+              bit each, and a 4-bit index per texel choosing one of sixteen colours between them.
+   Texels are numbered row by row, 0 at the top left. Decoding one texel reads only its own block and
+   costs a few integer operations, so lookups decode as they read instead of expanding the image.
+   The encoders fit the endpoints along the principal axis of the block colours, pick the closest index
+   for every texel and refit the endpoints to those indices by least squares once, keeping the better
+   fit. That is far from the best a BC encoder can do, but good enough for textures of a ray tracer and
+   fast enough to run while an image is loaded. Only mode 6 of BC7 is written and read. */
+
+// Encoder input: the 16 texels of a block, RGBA in 0..255.
+using block_texels = float[16][4];
+
+
+// Spelled out so compilers turn it into a single load on little endian machines.
+inline uint64_t load_le64(const unsigned char* p)
+{
+    return static_cast<uint64_t>(p[0]) | static_cast<uint64_t>(p[1]) << 8 | static_cast<uint64_t>(p[2]) << 16
+        | static_cast<uint64_t>(p[3]) << 24 | static_cast<uint64_t>(p[4]) << 32 | static_cast<uint64_t>(p[5]) << 40
+        | static_cast<uint64_t>(p[6]) << 48 | static_cast<uint64_t>(p[7]) << 56;
+}
+
+inline void store_le64(unsigned char* p, uint64_t v)
+{
+    for (int k = 0; k < 8; ++k)
+        p[k] = static_cast<unsigned char>(v >> (8 * k));
+}
+
+// Mean of the texels and direction of their largest variance, by power iteration on the covariance.
+inline void block_principal_axis(const block_texels& texels, int channels, float mean[4], float axis[4])
+{
+    for (int c = 0; c < channels; ++c)
+    {
+        mean[c] = 0;
+        for (int i = 0; i < 16; ++i)
+            mean[c] += texels[i][c];
+        mean[c] /= 16;
+    }
+
+    float cov[4][4] = {};
+    for (int i = 0; i < 16; ++i)
+    {
+        for (int a = 0; a < channels; ++a)
+        {
+            for (int b = 0; b < channels; ++b)
+                cov[a][b] += (texels[i][a] - mean[a]) * (texels[i][b] - mean[b]);
+        }
+    }
+
+    // Starting from the diagonal of the bounding box keeps the sign of correlated channels.
+    for (int c = 0; c < channels; ++c)
+    {
+        float lo = texels[0][c], hi = texels[0][c];
+        for (int i = 1; i < 16; ++i)
+        {
+            lo = std::min(lo, texels[i][c]);
+            hi = std::max(hi, texels[i][c]);
+        }
+        axis[c] = hi - lo;
+    }
+    for (int iteration = 0; iteration < 8; ++iteration)
+    {
+        float next[4] = {};
+        float length = 0;
+        for (int a = 0; a < channels; ++a)
+        {
+            for (int b = 0; b < channels; ++b)
+                next[a] += cov[a][b] * axis[b];
+            length = std::max(length, std::fabs(next[a]));
+        }
+        if (!(length > 0))
+            break;
+        for (int c = 0; c < channels; ++c)
+            axis[c] = next[c] / length;
+    }
+}
+
+// Endpoints at the extremes of the texels along the principal axis.
+inline void block_initial_endpoints(const block_texels& texels, int channels, float e0[4], float e1[4])
+{
+    float mean[4], axis[4];
+    block_principal_axis(texels, channels, mean, axis);
+
+    float lo = 0, hi = 0;
+    for (int i = 0; i < 16; ++i)
+    {
+        float t = 0;
+        for (int c = 0; c < channels; ++c)
+            t += (texels[i][c] - mean[c]) * axis[c];
+        lo = std::min(lo, t);
+        hi = std::max(hi, t);
+    }
+
+    float norm = 0;
+    for (int c = 0; c < channels; ++c)
+        norm += axis[c] * axis[c];
+    const float inv = norm > 0 ? 1 / norm : 0;
+    for (int c = 0; c < channels; ++c)
+    {
+        e0[c] = std::clamp(mean[c] + lo * inv * axis[c], 0.0f, 255.0f);
+        e1[c] = std::clamp(mean[c] + hi * inv * axis[c], 0.0f, 255.0f);
+    }
+}
+
+// Least squares endpoints for texels i at weight[i] of the way from e0 to e1; false if the weights are all equal.
+inline bool block_refit_endpoints(const block_texels& texels, int channels, const float weight[16], float e0[4], float e1[4])
+{
+    float aa = 0, ab = 0, bb = 0;
+    float ax[4] = {}, bx[4] = {};
+    for (int i = 0; i < 16; ++i)
+    {
+        const float b = weight[i], a = 1 - b;
+        aa += a * a;
+        ab += a * b;
+        bb += b * b;
+        for (int c = 0; c < channels; ++c)
+        {
+            ax[c] += a * texels[i][c];
+            bx[c] += b * texels[i][c];
+        }
+    }
+
+    const float det = aa * bb - ab * ab;
+    if (!(det > 1e-6f))
+        return false;
+    for (int c = 0; c < channels; ++c)
+    {
+        e0[c] = std::clamp((bb * ax[c] - ab * bx[c]) / det, 0.0f, 255.0f);
+        e1[c] = std::clamp((aa * bx[c] - ab * ax[c]) / det, 0.0f, 255.0f);
+    }
+    return true;
+}
+
+
+// BC1 ------------------------------------------------------------------------------------------------
+
+inline void bc1_expand(unsigned c, int rgb[3])
+{
+    const int r = (c >> 11) & 31, g = (c >> 5) & 63, b = c & 31;
+    rgb[0] = r << 3 | r >> 2;
+    rgb[1] = g << 2 | g >> 4;
+    rgb[2] = b << 3 | b >> 2;
+}
+
+inline unsigned bc1_pack(const float rgb[3])
+{
+    const unsigned r = static_cast<unsigned>(std::clamp(rgb[0] * (31 / 255.0f) + 0.5f, 0.0f, 31.0f));
+    const unsigned g = static_cast<unsigned>(std::clamp(rgb[1] * (63 / 255.0f) + 0.5f, 0.0f, 63.0f));
+    const unsigned b = static_cast<unsigned>(std::clamp(rgb[2] * (31 / 255.0f) + 0.5f, 0.0f, 31.0f));
+    return r << 11 | g << 5 | b;
+}
+
+// Texel i of a BC1 block, 0..255 per channel. c0 > c1 selects four colours, otherwise three and black.
+inline void bc1_decode(const unsigned char* block, int i, int rgb[3])
+{
+    const uint64_t bits = load_le64(block);
+    const unsigned c0 = bits & 0xffff;
+    const unsigned c1 = (bits >> 16) & 0xffff;
+    const unsigned index = (bits >> (32 + 2 * i)) & 3;
+
+    int e0[3], e1[3];
+    bc1_expand(c0, e0);
+    bc1_expand(c1, e1);
+    if (c0 > c1)
+    {
+        // Index 0, 1, 2, 3 lies 0, 3, 1, 2 thirds of the way from c0 to c1.
+        const int w = (0x9c >> (2 * index)) & 3;
+        rgb[0] = ((3 - w) * e0[0] + w * e1[0]) / 3;
+        rgb[1] = ((3 - w) * e0[1] + w * e1[1]) / 3;
+        rgb[2] = ((3 - w) * e0[2] + w * e1[2]) / 3;
+    }
+    else
+    {
+        const int w = index == 1 ? 2 : index == 2 ? 1 : 0;
+        const int scale = index == 3 ? 0 : 1;
+        rgb[0] = scale * ((2 - w) * e0[0] + w * e1[0]) / 2;
+        rgb[1] = scale * ((2 - w) * e0[1] + w * e1[1]) / 2;
+        rgb[2] = scale * ((2 - w) * e0[2] + w * e1[2]) / 2;
+    }
+}
+
+// Indices for endpoints c0 > c1 (or all 0 if they are equal); returns the squared error.
+inline float bc1_choose_indices(const block_texels& texels, unsigned c0, unsigned c1, unsigned char index[16])
+{
+    int e0[3], e1[3];
+    bc1_expand(c0, e0);
+    bc1_expand(c1, e1);
+    int palette[4][3];
+    for (int c = 0; c < 3; ++c)
+    {
+        palette[0][c] = e0[c];
+        palette[1][c] = e1[c];
+        palette[2][c] = (2 * e0[c] + e1[c]) / 3;
+        palette[3][c] = (e0[c] + 2 * e1[c]) / 3;
+    }
+    const int entries = c0 == c1 ? 1 : 4;
+
+    float error = 0;
+    for (int i = 0; i < 16; ++i)
+    {
+        float best = 1e30f;
+        for (int k = 0; k < entries; ++k)
+        {
+            float d = 0;
+            for (int c = 0; c < 3; ++c)
+                d += (texels[i][c] - palette[k][c]) * (texels[i][c] - palette[k][c]);
+            if (d < best)
+            {
+                best = d;
+                index[i] = static_cast<unsigned char>(k);
+            }
+        }
+        error += best;
+    }
+    return error;
+}
+
+inline void bc1_encode(const block_texels& texels, unsigned char* block)
+{
+    float e0[4], e1[4];
+    block_initial_endpoints(texels, 3, e0, e1);
+
+    unsigned best_c0 = 0, best_c1 = 0;
+    unsigned char best_index[16] = {};
+    float best_error = 1e30f;
+    for (int fit = 0; fit < 2; ++fit)
+    {
+        unsigned c0 = bc1_pack(e1), c1 = bc1_pack(e0);
+        if (c0 < c1)
+            std::swap(c0, c1);
+        unsigned char index[16];
+        const float error = bc1_choose_indices(texels, c0, c1, index);
+        if (error < best_error)
+        {
+            best_error = error;
+            best_c0 = c0;
+            best_c1 = c1;
+            std::copy(index, index + 16, best_index);
+        }
+
+        static const float weights[4] = { 0, 1, 1 / 3.0f, 2 / 3.0f };
+        float weight[16];
+        for (int i = 0; i < 16; ++i)
+            weight[i] = weights[index[i]];
+        if (c0 == c1 || !block_refit_endpoints(texels, 3, weight, e1, e0))
+            break;
+    }
+
+    uint64_t bits = best_c0 | best_c1 << 16;
+    for (int i = 0; i < 16; ++i)
+        bits |= static_cast<uint64_t>(best_index[i]) << (32 + 2 * i);
+    store_le64(block, bits);
+}
+
+
+// BC7 mode 6 -----------------------------------------------------------------------------------------
+
+// Interpolation weights of 4-bit indices, in 64ths.
+static const int bc7_weights[16] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+
+/* Bit layout, from bit 0 of byte 0: mode (0000001), R0 R1 G0 G1 B0 B1 A0 A1 (7 bits each), P0 P1,
+   then the indices, 3 bits for texel 0 (whose top bit is implied 0) and 4 bits for each other texel.
+   In the two little endian halves, the endpoints and P0 fill the low one; P1 is bit 0 of the high one
+   and the index of texel i > 0 starts at bit 4 i. */
+inline void bc7_decode(const unsigned char* block, int i, int rgba[4])
+{
+    const uint64_t lo = load_le64(block);
+    const uint64_t hi = load_le64(block + 8);
+    const unsigned index = i == 0 ? (hi >> 1) & 7 : (hi >> (4 * i)) & 15;
+    const int w = bc7_weights[index];
+    const uint64_t p0 = lo >> 63, p1 = hi & 1;
+    auto channel = [&](int c)
+    {
+        const int e0 = static_cast<int>(((lo >> (7 + 14 * c)) & 0x7f) << 1 | p0);
+        const int e1 = static_cast<int>(((lo >> (14 + 14 * c)) & 0x7f) << 1 | p1);
+        return ((64 - w) * e0 + w * e1 + 32) >> 6;
+    };
+    rgba[0] = channel(0);
+    rgba[1] = channel(1);
+    rgba[2] = channel(2);
+    rgba[3] = channel(3);
+}
+
+// 7-bit endpoint and the low bit that together come closest to e.
+inline void bc7_quantize(const float e[4], unsigned q[4], unsigned& p)
+{
+    float best = 1e30f;
+    for (unsigned bit = 0; bit < 2; ++bit)
+    {
+        unsigned candidate[4];
+        float error = 0;
+        for (int c = 0; c < 4; ++c)
+        {
+            candidate[c] = static_cast<unsigned>(std::clamp((e[c] - bit) * 0.5f + 0.5f, 0.0f, 127.0f));
+            const float d = static_cast<float>(candidate[c] << 1 | bit) - e[c];
+            error += d * d;
+        }
+        if (error < best)
+        {
+            best = error;
+            p = bit;
+            std::copy(candidate, candidate + 4, q);
+        }
+    }
+}
+
+inline float bc7_choose_indices(const block_texels& texels, const int e0[4], const int e1[4], unsigned char index[16])
+{
+    int palette[16][4];
+    for (int k = 0; k < 16; ++k)
+    {
+        for (int c = 0; c < 4; ++c)
+            palette[k][c] = ((64 - bc7_weights[k]) * e0[c] + bc7_weights[k] * e1[c] + 32) >> 6;
+    }
+
+    float error = 0;
+    for (int i = 0; i < 16; ++i)
+    {
+        float best = 1e30f;
+        for (int k = 0; k < 16; ++k)
+        {
+            float d = 0;
+            for (int c = 0; c < 4; ++c)
+                d += (texels[i][c] - palette[k][c]) * (texels[i][c] - palette[k][c]);
+            if (d < best)
+            {
+                best = d;
+                index[i] = static_cast<unsigned char>(k);
+            }
+        }
+        error += best;
+    }
+    return error;
+}
+
+inline void bc7_encode(const block_texels& texels, unsigned char* block)
+{
+    float e0[4], e1[4];
+    block_initial_endpoints(texels, 4, e0, e1);
+
+    unsigned best_q[2][4] = {}, best_p[2] = {};
+    unsigned char best_index[16] = {};
+    float best_error = 1e30f;
+    for (int fit = 0; fit < 2; ++fit)
+    {
+        unsigned q[2][4] = {}, p[2] = {};
+        bc7_quantize(e0, q[0], p[0]);
+        bc7_quantize(e1, q[1], p[1]);
+        int ends[2][4];
+        for (int e = 0; e < 2; ++e)
+        {
+            for (int c = 0; c < 4; ++c)
+                ends[e][c] = static_cast<int>(q[e][c] << 1 | p[e]);
+        }
+
+        unsigned char index[16];
+        const float error = bc7_choose_indices(texels, ends[0], ends[1], index);
+        if (error < best_error)
+        {
+            best_error = error;
+            std::copy(&q[0][0], &q[0][0] + 8, &best_q[0][0]);
+            best_p[0] = p[0];
+            best_p[1] = p[1];
+            std::copy(index, index + 16, best_index);
+        }
+
+        float weight[16];
+        for (int i = 0; i < 16; ++i)
+            weight[i] = bc7_weights[index[i]] / 64.0f;
+        if (!block_refit_endpoints(texels, 4, weight, e0, e1))
+            break;
+    }
+
+    // The top bit of the index of texel 0 is not stored: swap the endpoints if it would be 1.
+    if (best_index[0] & 8)
+    {
+        for (int c = 0; c < 4; ++c)
+            std::swap(best_q[0][c], best_q[1][c]);
+        std::swap(best_p[0], best_p[1]);
+        for (int i = 0; i < 16; ++i)
+            best_index[i] = static_cast<unsigned char>(15 - best_index[i]);
+    }
+
+    uint64_t lo = 1u << 6;
+    for (int c = 0; c < 4; ++c)
+    {
+        lo |= static_cast<uint64_t>(best_q[0][c]) << (7 + 14 * c);
+        lo |= static_cast<uint64_t>(best_q[1][c]) << (14 + 14 * c);
+    }
+    lo |= static_cast<uint64_t>(best_p[0]) << 63;
+    uint64_t hi = best_p[1] | static_cast<uint64_t>(best_index[0]) << 1;
+    for (int i = 1; i < 16; ++i)
+        hi |= static_cast<uint64_t>(best_index[i]) << (4 * i);
+    store_le64(block, lo);
+    store_le64(block + 8, hi);
+}
@@ -2,15 +2,87 @@
 
 #include "rtweekend.h"
 #include "hittable.h"
-#include "hittable_list.h"
-#include "aarect.h"
 
+
+/* Where a ray crosses the surface of the box [lo, hi] in [t_min, t_max]: the entry point, or the exit point
+   for a ray that starts inside. One slab test gives both; the entry is the largest of the near plane
+   distances, the exit the smallest of the far ones, and the axis where that happens is the face that is
+   crossed. outward is the sign of the normal of that face. A parallel ray outside a slab gets +-inf for
+   both planes and misses; NaN (origin on the plane) is ignored by the comparisons, like in aabb::hit. */
+inline bool box_surface_hit(const ray& r, const vec3& lo, const vec3& hi, real t_min, real t_max, real& t, int& axis, real& outward)
+{
+	const vec3 origin = r.origin();
+	real t_enter = -infinity;
+	real t_exit = infinity;
+	int enter_axis = 0;
+	int exit_axis = 0;
+	for (int a = 0; a < 3; ++a)
+	{
+		const real near_plane = r.sign[a] ? hi[a] : lo[a];
+		const real far_plane = r.sign[a] ? lo[a] : hi[a];
+		const real tn = (near_plane - origin[a]) * r.inv_dir[a];
+		const real tf = (far_plane - origin[a]) * r.inv_dir[a];
+		if (tn > t_enter)
+		{
+			t_enter = tn;
+			enter_axis = a;
+		}
+		if (tf < t_exit)
+		{
+			t_exit = tf;
+			exit_axis = a;
+		}
+	}
+
+	if (!(t_enter <= t_exit))
+		return false;
+
+	// Entering through the near plane of an axis means crossing the face whose normal points against the ray.
+	if (t_enter >= t_min && t_enter <= t_max)
+	{
+		t = t_enter;
+		axis = enter_axis;
+		outward = r.sign[axis] ? 1 : -1;
+		return true;
+	}
+	if (t_exit >= t_min && t_exit <= t_max)
+	{
+		t = t_exit;
+		axis = exit_axis;
+		outward = r.sign[axis] ? -1 : 1;
+		return true;
+	}
+	return false;
+}
+
+/* Hit record of a hit at t on the face of [lo, hi] normal to axis. u and v are those of the rect that
+   forms the face in a box made of six rects: the lower of the two other axes is u, the higher v. */
+inline void box_face_record(const ray& r, const vec3& lo, const vec3& hi, real t, int axis, real outward, const material* mat, hit_record& rec)
+{
+	const int u_axis = axis == 0 ? 1 : 0;
+	const int v_axis = axis == 2 ? 1 : 2;
+
+	rec.t = t;
+	rec.p = r.at(t);
+	rec.u = (rec.p[u_axis] - lo[u_axis]) / (hi[u_axis] - lo[u_axis]);
+	rec.v = (rec.p[v_axis] - lo[v_axis]) / (hi[v_axis] - lo[v_axis]);
+	rec.uv_scale = 1 / std::sqrt((hi[u_axis] - lo[u_axis]) * (hi[v_axis] - lo[v_axis]));
+	vec3 outward_normal(0, 0, 0);
+	outward_normal[axis] = outward;
+	rec.set_face_normal(r, outward_normal);
+	rec.mat_ptr = mat;
+}
+
+
+// Axis aligned box, intersected analytically with one slab test instead of as six rects.
 class box : public hittable
 {
 	public:
-		box(const vec3& p0, const vec3& p1, shared_ptr<material> mat);
+		box(const vec3& p0, const vec3& p1, shared_ptr<material> mat)
+			: box_min(p0), box_max(p1), mat_ptr(mat)
+		{}
 
-		virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const;
+		virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const;
 
 		virtual bool bounding_box(double time0, double time1, aabb& output_box) const
 		{
@@ -18,28 +90,20 @@ class box : public hittable
 			return true;
 		}
 
-	private:
+	public:
 		vec3 box_min;
 		vec3 box_max;
-		hittable_list sides;
+		shared_ptr<material> mat_ptr;
 };
 
-box::box(const vec3& p0, const vec3& p1, shared_ptr<material> mat)
+bool box::hit(const ray& r, real t_min, real t_max, hit_record& rec) const
 {
-	box_min = p0;
-	box_max = p1;
+	RTW_COUNT_HIT();
+	real t, outward;
+	int axis;
+	if (!box_surface_hit(r, box_min, box_max, t_min, t_max, t, axis, outward))
+		return false;
 
-	sides.add(make_shared<xy_rect>(p0.x(), p1.x(), p0.y(), p1.y(), p1.z(), mat));
-	sides.add(make_shared<flip_face>(make_shared<xy_rect>(p0.x(), p1.x(), p0.y(), p1.y(), p0.z(), mat)));
-
-	sides.add(make_shared<xz_rect>(p0.x(), p1.x(), p0.z(), p1.z(), p1.y(), mat));
-	sides.add(make_shared<flip_face>(make_shared<xz_rect>(p0.x(), p1.x(), p0.z(), p1.z(), p0.y(), mat)));
-
-	sides.add(make_shared<yz_rect>(p0.y(), p1.y(), p0.z(), p1.z(), p1.x(), mat));
-	sides.add(make_shared<flip_face>(make_shared<yz_rect>(p0.y(), p1.y(), p0.z(), p1.z(), p0.x(), mat)));
-}
-
-bool box::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
-{
-	return sides.hit(r, t_min, t_max, rec);
+	box_face_record(r, box_min, box_max, t, axis, outward, mat_ptr.get(), rec);
+	return true;
 }
@@ -0,0 +1,252 @@
+#pragma once
+
+#include "rtweekend.h"
+#include "hittable.h"
+#include "box.h"
+#include "sphere_batch.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+
+// Whether bvh_node replaces the boxes of a build by box_runs (--box-batch 0|1). On by default with AVX2 only:
+// the scalar kernel is no faster than box::hit, and a run's box is larger than those of its boxes.
+#ifdef RTW_AVX2
+bool box_batching = true;
+#else
+bool box_batching = false;
+#endif
+
+/* Boxes stored as one array per bound and axis (SoA), so that the slab tests of several boxes run
+   in one instruction each. Runs start at multiples of lanes and are padded by repeating their last
+   box, which can never win against the lower index it copies. */
+class box_batch
+{
+    public:
+        // Boxes tested per kernel step: 4 doubles in an AVX2 register.
+        static const int lanes = 4;
+        // Largest run; one BVH leaf references a whole run.
+        static const int max_run = 4;
+
+        // Appends the boxes of one run and returns its first index.
+        size_t add_run(const std::vector<const box*>& boxes);
+
+        // Closest box of the run [begin, begin + count) hit in [t_min, t_max), or -1.
+        int closest(const ray& r, size_t begin, size_t count, double t_min, double t_max, double& t_hit) const;
+
+        vec3 lo(size_t k) const { return vec3(lo_x[k], lo_y[k], lo_z[k]); }
+        vec3 hi(size_t k) const { return vec3(hi_x[k], hi_y[k], hi_z[k]); }
+
+    public:
+        std::vector<double> lo_x, lo_y, lo_z;
+        std::vector<double> hi_x, hi_y, hi_z;
+        std::vector<uint32_t> material_id;
+
+        // Indexed by material_id. The batch keeps the materials alive.
+        std::vector<shared_ptr<material>> materials;
+        std::vector<const material*> material_ptrs;
+};
+
+size_t box_batch::add_run(const std::vector<const box*>& boxes)
+{
+    const size_t begin = lo_x.size();
+    const size_t padded = (boxes.size() + lanes - 1) / lanes * lanes;
+
+    for (size_t k = 0; k < padded; ++k)
+    {
+        const box* b = boxes[std::min(k, boxes.size() - 1)];
+        lo_x.push_back(b->box_min.x()); lo_y.push_back(b->box_min.y()); lo_z.push_back(b->box_min.z());
+        hi_x.push_back(b->box_max.x()); hi_y.push_back(b->box_max.y()); hi_z.push_back(b->box_max.z());
+
+        auto found = std::find(material_ptrs.begin(), material_ptrs.end(), b->mat_ptr.get());
+        if (found == material_ptrs.end())
+        {
+            materials.push_back(b->mat_ptr);
+            material_ptrs.push_back(b->mat_ptr.get());
+            found = material_ptrs.end() - 1;
+        }
+        material_id.push_back(static_cast<uint32_t>(found - material_ptrs.begin()));
+    }
+
+    return begin;
+}
+
+/* Per lane this is box_surface_hit: max and min of AVX keep the second operand for NaN, like the comparisons
+   there, so a batched box returns the same t as the box object. The smallest t over all lanes wins, ties go
+   to the lower index. */
+int box_batch::closest(const ray& r, size_t begin, size_t count, double t_min, double t_max, double& t_hit) const
+{
+    const double* near_x = r.sign[0] ? hi_x.data() : lo_x.data();
+    const double* far_x = r.sign[0] ? lo_x.data() : hi_x.data();
+    const double* near_y = r.sign[1] ? hi_y.data() : lo_y.data();
+    const double* far_y = r.sign[1] ? lo_y.data() : hi_y.data();
+    const double* near_z = r.sign[2] ? hi_z.data() : lo_z.data();
+    const double* far_z = r.sign[2] ? lo_z.data() : hi_z.data();
+    const double ox = r.origin().x(), oy = r.origin().y(), oz = r.origin().z();
+    const double ix = r.inv_dir.x(), iy = r.inv_dir.y(), iz = r.inv_dir.z();
+
+    int best = -1;
+    for (size_t k0 = begin; k0 < begin + count; k0 += lanes)
+    {
+        alignas(32) double t[lanes];
+
+#ifdef RTW_AVX2
+        const __m256d vox = _mm256_set1_pd(ox), voy = _mm256_set1_pd(oy), voz = _mm256_set1_pd(oz);
+        const __m256d vix = _mm256_set1_pd(ix), viy = _mm256_set1_pd(iy), viz = _mm256_set1_pd(iz);
+        __m256d t_enter = _mm256_set1_pd(-infinity);
+        __m256d t_exit = _mm256_set1_pd(infinity);
+        t_enter = _mm256_max_pd(_mm256_mul_pd(_mm256_sub_pd(_mm256_loadu_pd(near_x + k0), vox), vix), t_enter);
+        t_exit = _mm256_min_pd(_mm256_mul_pd(_mm256_sub_pd(_mm256_loadu_pd(far_x + k0), vox), vix), t_exit);
+        t_enter = _mm256_max_pd(_mm256_mul_pd(_mm256_sub_pd(_mm256_loadu_pd(near_y + k0), voy), viy), t_enter);
+        t_exit = _mm256_min_pd(_mm256_mul_pd(_mm256_sub_pd(_mm256_loadu_pd(far_y + k0), voy), viy), t_exit);
+        t_enter = _mm256_max_pd(_mm256_mul_pd(_mm256_sub_pd(_mm256_loadu_pd(near_z + k0), voz), viz), t_enter);
+        t_exit = _mm256_min_pd(_mm256_mul_pd(_mm256_sub_pd(_mm256_loadu_pd(far_z + k0), voz), viz), t_exit);
+
+        const __m256d hit = _mm256_cmp_pd(t_enter, t_exit, _CMP_LE_OQ);
+        // Most runs are missed by most rays.
+        if (_mm256_movemask_pd(hit) == 0)
+            continue;
+
+        const __m256d lo = _mm256_set1_pd(t_min), hi = _mm256_set1_pd(t_max);
+        auto inside = [&](__m256d x)
+        {
+            return _mm256_and_pd(_mm256_cmp_pd(x, lo, _CMP_GE_OQ), _mm256_cmp_pd(x, hi, _CMP_LE_OQ));
+        };
+        __m256d result = _mm256_blendv_pd(_mm256_set1_pd(infinity), t_exit, _mm256_and_pd(hit, inside(t_exit)));
+        result = _mm256_blendv_pd(result, t_enter, _mm256_and_pd(hit, inside(t_enter)));
+        _mm256_store_pd(t, result);
+#else
+        for (int i = 0; i < lanes; ++i)
+        {
+            const size_t k = k0 + i;
+            double t_enter = -infinity;
+            double t_exit = infinity;
+            const double tnx = (near_x[k] - ox) * ix, tfx = (far_x[k] - ox) * ix;
+            const double tny = (near_y[k] - oy) * iy, tfy = (far_y[k] - oy) * iy;
+            const double tnz = (near_z[k] - oz) * iz, tfz = (far_z[k] - oz) * iz;
+            t_enter = tnx > t_enter ? tnx : t_enter;
+            t_exit = tfx < t_exit ? tfx : t_exit;
+            t_enter = tny > t_enter ? tny : t_enter;
+            t_exit = tfy < t_exit ? tfy : t_exit;
+            t_enter = tnz > t_enter ? tnz : t_enter;
+            t_exit = tfz < t_exit ? tfz : t_exit;
+
+            t[i] = infinity;
+            if (t_enter <= t_exit)
+            {
+                if (t_enter >= t_min && t_enter <= t_max)
+                    t[i] = t_enter;
+                else if (t_exit >= t_min && t_exit <= t_max)
+                    t[i] = t_exit;
+            }
+        }
+#endif
+
+        for (int i = 0; i < lanes; ++i)
+        {
+            if (t[i] < t_max)
+            {
+                t_max = t[i];
+                best = static_cast<int>(k0 + i);
+            }
+        }
+    }
+
+    t_hit = t_max;
+    return best;
+}
+
+
+// BVH leaf that stands for a run of up to box_batch::max_run neighbouring boxes of a batch.
+class box_run : public hittable
+{
+    public:
+        box_run(shared_ptr<const box_batch> b, size_t first, size_t n, const aabb& bounds)
+            : batch(b), begin(first), count(n), box(bounds)
+        {}
+
+        virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const;
+
+        virtual bool bounding_box(double time0, double time1, aabb& output_box) const
+        {
+            output_box = box;
+            return true;
+        }
+
+    public:
+        shared_ptr<const box_batch> batch;
+        size_t begin;
+        size_t count;
+        aabb box;
+};
+
+// Only the winning box is tested again on its own, for the face that was crossed.
+bool box_run::hit(const ray& r, real t_min, real t_max, hit_record& rec) const
+{
+    RTW_COUNT_HIT();
+    double t_hit;
+    const int k = batch->closest(r, begin, count, t_min, t_max, t_hit);
+    if (k < 0)
+        return false;
+
+    const vec3 lo = batch->lo(k);
+    const vec3 hi = batch->hi(k);
+    real t, outward;
+    int axis;
+    if (!box_surface_hit(r, lo, hi, t_min, t_max, t, axis, outward))
+        return false;
+
+    box_face_record(r, lo, hi, t, axis, outward, batch->material_ptrs[batch->material_id[k]], rec);
+    return true;
+}
+
+/* Returns objects with the boxes replaced by box_runs over one shared batch, grouped like the spheres
+   of batch_spheres. With fewer than two boxes to batch the objects are returned unchanged. */
+std::vector<shared_ptr<hittable>> batch_boxes(const std::vector<shared_ptr<hittable>>& objects, double time0, double time1)
+{
+    struct entry
+    {
+        shared_ptr<hittable> object;
+        aabb box;
+        vec3 centroid;
+        size_t order;
+    };
+
+    std::vector<shared_ptr<hittable>> result;
+    std::vector<entry> boxes;
+    for (const auto& object : objects)
+    {
+        if (dynamic_cast<const box*>(object.get()) == nullptr)
+        {
+            result.push_back(object);
+            continue;
+        }
+        entry e{ object, aabb(), vec3(), boxes.size() };
+        object->bounding_box(time0, time1, e.box);
+        e.centroid = 0.5 * (e.box.min() + e.box.max());
+        boxes.push_back(e);
+    }
+
+    keep_large_entries(boxes, result);
+
+    if (boxes.size() < 2)
+        return objects;
+
+    auto batch = scene_make<box_batch>();
+
+    median_runs(boxes, 0, boxes.size(), box_batch::max_run, [&](size_t start, size_t end)
+    {
+        std::vector<const box*> members;
+        aabb bounds = boxes[start].box;
+        for (size_t i = start; i < end; ++i)
+        {
+            members.push_back(static_cast<const box*>(boxes[i].object.get()));
+            bounds = surrounding_box(bounds, boxes[i].box);
+        }
+        const size_t first = batch->add_run(members);
+        result.push_back(scene_make<box_run>(batch, first, members.size(), bounds));
+    });
+
+    return result;
+}
@@ -3,23 +3,45 @@
 #include "rtweekend.h"
 #include "hittable.h"
 #include "hittable_list.h"
+#include "sphere_batch.h"
+#include "box_batch.h"
 
 #include <algorithm>
 
+// How bvh_node splits a range of primitives into its two children.
+enum class bvh_split
+{
+	random_axis_median, // sort along a random axis and split at the median
+	sah                 // binned surface area heuristic
+};
+
+// Strategy used when a bvh_node is built without naming one, e.g. inside the scene functions.
+bvh_split bvh_default_split = bvh_split::random_axis_median;
+
+// Bounds and centroid of one primitive, computed once per build instead of on every comparison.
+struct bvh_primitive
+{
+	shared_ptr<hittable> object;
+	aabb box;
+	vec3 centroid;
+};
+
 class bvh_node : public hittable
 {
 	public:
 		bvh_node();
 
-		bvh_node(hittable_list& list, double time0, double time1)
-			: bvh_node(list.objects, 0, list.objects.size(), time0, time1)
+		bvh_node(hittable_list& list, double time0, double time1, bvh_split split = bvh_default_split)
+			: bvh_node(list.objects, 0, list.objects.size(), time0, time1, split)
 		{}
 
 		bvh_node(
 			std::vector<shared_ptr<hittable>>& objects,
-			size_t start, size_t end, double time0, double time1);
+			size_t start, size_t end, double time0, double time1, bvh_split split = bvh_default_split);
+
+		bvh_node(std::vector<bvh_primitive>& primitives, size_t start, size_t end, bvh_split split);
 
-		virtual bool hit(const ray& r, double tmin, double tmax, hit_record& rec) const;
+		virtual bool hit(const ray& r, real tmin, real tmax, hit_record& rec) const;
 		virtual bool bounding_box(double time0, double time1, aabb& output_box) const;
 
 	public:
@@ -27,45 +49,58 @@ class bvh_node : public hittable
 		shared_ptr<hittable> left;
 		shared_ptr<hittable> right;
 		aabb box;
+		int axis = 0; // axis the primitives were split along; left holds the smaller coordinates
+
+	private:
+		void split_median(std::vector<bvh_primitive>& primitives, size_t start, size_t end, int axis);
+		void split_sah(std::vector<bvh_primitive>& primitives, size_t start, size_t end);
 };
 
 // Returns true if min value of a's boxes is less than min value of b's boxes for given axis
-inline bool box_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b, int axis)
+inline bool box_compare(const bvh_primitive& a, const bvh_primitive& b, int axis)
 {
-	aabb box_a;
-	aabb box_b;
-
-	if (!a->bounding_box(0, 0, box_a) || !b->bounding_box(0, 0, box_b))
-		std::cerr << "No bounding box in bvh_node constructor.\n";
-
-	return box_a.min().e[axis] < box_b.min().e[axis];
+	return a.box.min().e[axis] < b.box.min().e[axis];
 }
 
-bool box_x_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b)
+bvh_node::bvh_node(std::vector<shared_ptr<hittable>>& objects, size_t start, size_t end, double time0, double time1, bvh_split split)
 {
-	return box_compare(a, b, 0);
-}
+	// Spheres and boxes are intersected in SIMD batches; the tree is built over runs of neighbouring ones.
+	std::vector<shared_ptr<hittable>> leaves(objects.begin() + start, objects.begin() + end);
+	if (sphere_batching)
+		leaves = batch_spheres(leaves, time0, time1);
+	if (box_batching)
+		leaves = batch_boxes(leaves, time0, time1);
 
-bool box_y_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b)
-{
-	return box_compare(a, b, 1);
-}
+	std::vector<bvh_primitive> primitives;
+	primitives.reserve(leaves.size());
 
-bool box_z_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b)
-{
-	return box_compare(a, b, 2);
+	for (const auto& object : leaves)
+	{
+		bvh_primitive primitive;
+		primitive.object = object;
+		if (!object->bounding_box(time0, time1, primitive.box))
+			std::cerr << "No bounding box in bvh_node constructor.\n";
+		primitive.centroid = 0.5 * (primitive.box.min() + primitive.box.max());
+		primitives.push_back(primitive);
+	}
+
+	// The random axes of the median build come from a stream of their own, so the build does not
+	// shift the random numbers of whatever is created after it (e.g. the rest of a scene).
+	const rng_stream saved = rng_current;
+	rng_seed(primitives.size(), 0);
+
+	*this = bvh_node(primitives, 0, primitives.size(), split);
+
+	rng_current = saved;
 }
 
 // Constructs BVH: start and end arguments are needed for recursion arguments
 // Goal: Division should be done well: Two children of a node should have smaller bounding boxes
 // than their parent's bounding box (only for speed, not needed for correctness!)
-bvh_node::bvh_node(std::vector<shared_ptr<hittable>>& objects, size_t start, size_t end, double time0, double time1)
+bvh_node::bvh_node(std::vector<bvh_primitive>& primitives, size_t start, size_t end, bvh_split split)
 {
-	// Randomly choose an axis and define comparator
-	int axis = random_int(0, 2);
-	auto comparator = (axis == 0) ? box_x_compare
-					: (axis == 1) ? box_y_compare
-								  : box_z_compare;
+	// Randomly choose an axis
+	axis = split == bvh_split::random_axis_median ? random_int(0, 2) : 0;
 
 	// How many objects are in objects
 	size_t object_span = end - start;
@@ -74,43 +109,149 @@ bvh_node::bvh_node(std::vector<shared_ptr<hittable>>& objects, size_t start, siz
 	// Can be optimized but this way there are always two children
 	if (object_span == 1)
 	{
-		left  = objects[start];
-		right = objects[start];
+		left  = primitives[start].object;
+		right = primitives[start].object;
+		box = primitives[start].box;
+		return;
 	}
 	// If two elements: Put one in each subtree and end recursion
 	else if (object_span == 2)
 	{
-		if (comparator(objects[start], objects[start + 1]))
+		if (box_compare(primitives[start], primitives[start + 1], axis))
 		{
-			left = objects[start];
-			right = objects[start + 1];
+			left = primitives[start].object;
+			right = primitives[start + 1].object;
 		}
 		else
 		{
-			left = objects[start + 1];
-			right = objects[start];
+			left = primitives[start + 1].object;
+			right = primitives[start].object;
 		}
+		box = surrounding_box(primitives[start].box, primitives[start + 1].box);
+		return;
 	}
-	// Sort the primitives and construct tree recursively
+
+	// The cached primitive boxes already cover the whole time interval of the build.
+	box = primitives[start].box;
+	for (size_t i = start + 1; i < end; ++i)
+		box = surrounding_box(box, primitives[i].box);
+
+	if (split == bvh_split::sah)
+		split_sah(primitives, start, end);
 	else
+		split_median(primitives, start, end, axis);
+}
+
+// Sort the primitives and construct tree recursively
+void bvh_node::split_median(std::vector<bvh_primitive>& primitives, size_t start, size_t end, int axis)
+{
+	std::sort(primitives.begin() + start, primitives.begin() + end,
+		[axis](const bvh_primitive& a, const bvh_primitive& b) { return box_compare(a, b, axis); });
+
+	auto mid = start + (end - start) / 2;
+	left = scene_make<bvh_node>(primitives, start, mid, bvh_split::random_axis_median);
+	right = scene_make<bvh_node>(primitives, mid, end, bvh_split::random_axis_median);
+}
+
+/* Binned SAH: the centroids are sorted into bins along each axis, and the split between two bins is
+   chosen that minimizes  area(left) * count(left) + area(right) * count(right).
+   Only the bin boundaries are evaluated, so the build is linear per level instead of a full sort. */
+void bvh_node::split_sah(std::vector<bvh_primitive>& primitives, size_t start, size_t end)
+{
+	const int bin_count = 16;
+
+	struct bin
 	{
-		std::sort(objects.begin() + start, objects.begin() + end, comparator);
+		aabb box;
+		size_t count = 0;
+	};
 
-		auto mid = start + object_span / 2;
-		left = make_shared<bvh_node>(objects, start, mid, time0, time1);
-		right = make_shared<bvh_node>(objects, mid, end, time0, time1);
+	vec3 cmin(infinity, infinity, infinity);
+	vec3 cmax(-infinity, -infinity, -infinity);
+	for (size_t i = start; i < end; ++i)
+	{
+		for (int a = 0; a < 3; ++a)
+		{
+			cmin[a] = std::min(cmin[a], primitives[i].centroid[a]);
+			cmax[a] = std::max(cmax[a], primitives[i].centroid[a]);
+		}
 	}
 
-	aabb box_left;
-	aabb box_right;
+	double best_cost = infinity;
+	int best_axis = -1;
+	int best_bin = 0;
+
+	for (int a = 0; a < 3; ++a)
+	{
+		const double extent = cmax[a] - cmin[a];
+		if (extent <= 0)
+			continue;
+
+		bin bins[bin_count];
+		const double scale = bin_count / extent;
+		for (size_t i = start; i < end; ++i)
+		{
+			int b = std::min(static_cast<int>((primitives[i].centroid[a] - cmin[a]) * scale), bin_count - 1);
+			bins[b].box = bins[b].count == 0 ? primitives[i].box : surrounding_box(bins[b].box, primitives[i].box);
+			++bins[b].count;
+		}
+
+		// Sweep from the right to get the area and count of everything right of each boundary,
+		// then from the left to evaluate the cost of splitting after bin b.
+		double right_area[bin_count];
+		size_t right_count[bin_count];
+		aabb acc;
+		size_t count = 0;
+		for (int b = bin_count - 1; b > 0; --b)
+		{
+			if (bins[b].count > 0)
+				acc = count == 0 ? bins[b].box : surrounding_box(acc, bins[b].box);
+			count += bins[b].count;
+			right_area[b] = count > 0 ? surface_area(acc) : 0.0;
+			right_count[b] = count;
+		}
+
+		count = 0;
+		for (int b = 0; b < bin_count - 1; ++b)
+		{
+			if (bins[b].count > 0)
+				acc = count == 0 ? bins[b].box : surrounding_box(acc, bins[b].box);
+			count += bins[b].count;
+			if (count == 0 || right_count[b + 1] == 0)
+				continue;
+
+			const double cost = surface_area(acc) * count + right_area[b + 1] * right_count[b + 1];
+			if (cost < best_cost)
+			{
+				best_cost = cost;
+				best_axis = a;
+				best_bin = b;
+			}
+		}
+	}
 
-	if (!left->bounding_box(time0, time1, box_left)
-		|| !right->bounding_box(time0, time1, box_right))
+	size_t mid = start + (end - start) / 2;
+	if (best_axis >= 0)
+	{
+		const double scale = bin_count / (cmax[best_axis] - cmin[best_axis]);
+		auto it = std::partition(primitives.begin() + start, primitives.begin() + end,
+			[&](const bvh_primitive& p)
+			{
+				int b = std::min(static_cast<int>((p.centroid[best_axis] - cmin[best_axis]) * scale), bin_count - 1);
+				return b <= best_bin;
+			});
+		mid = static_cast<size_t>(it - primitives.begin());
+		axis = best_axis;
+	}
+	else
 	{
-		std::cerr << "No bounding box in bvh_node constructor.\n";
+		// All centroids coincide, any split is as good as another.
+		std::nth_element(primitives.begin() + start, primitives.begin() + mid, primitives.begin() + end,
+			[](const bvh_primitive& a, const bvh_primitive& b) { return box_compare(a, b, 0); });
 	}
 
-	box = surrounding_box(box_left, box_right);
+	left = scene_make<bvh_node>(primitives, start, mid, bvh_split::sah);
+	right = scene_make<bvh_node>(primitives, mid, end, bvh_split::sah);
 }
 
 // Just return the box which is calculated during construction.
@@ -121,19 +262,26 @@ bool bvh_node::bounding_box(double time0, double time1, aabb& output_box) const
 }
 
 // Check whether the box for the node is hit, and if so, check the children and sort out any details
-bool bvh_node::hit(const ray& r, double tmin, double tmax, hit_record& rec) const
+bool bvh_node::hit(const ray& r, real tmin, real tmax, hit_record& rec) const
 {
+	RTW_COUNT_HIT();
 	if (!box.hit(r, tmin, tmax))
 		return false;
 
 	bool hit_left = left->hit(r, tmin, tmax, rec);
+
+	// Single element node: don't test the same object twice (a second test of a
+	// constant_medium would give it a second chance to scatter).
+	if (right == left)
+		return hit_left;
+
 	bool hit_right = right->hit(r, tmin, hit_left ? rec.t : tmax, rec);
 
 	return hit_left || hit_right;
 }
 
 // Alternative implementation, according to github issue should be faster. Could not verify...
-//bool bvh_node::hit(const ray& r, double tmin, double tmax, hit_record& rec) const
+//bool bvh_node::hit(const ray& r, real tmin, real tmax, hit_record& rec) const
 //{
 //	if (box.hit(r, tmin, tmax)) 
 //	{
@@ -149,3 +297,27 @@ bool bvh_node::hit(const ray& r, double tmin, double tmax, hit_record& rec) cons
 //	}
 //	return false;
 //}
+
+
+/* Expected cost of a ray query relative to the root box: every interior node and leaf contributes
+   its surface area divided by the root's, weighted by the cost of a box test resp. a primitive test. */
+double bvh_sah_cost(const hittable* object, double root_area, double node_cost = 1.0, double primitive_cost = 1.0)
+{
+	aabb bounds;
+	object->bounding_box(0, 1, bounds);
+	const double probability = surface_area(bounds) / root_area;
+
+	auto node = dynamic_cast<const bvh_node*>(object);
+	if (node == nullptr)
+		return primitive_cost * probability;
+
+	double cost = node_cost * probability + bvh_sah_cost(node->left.get(), root_area, node_cost, primitive_cost);
+	if (node->right != node->left)
+		cost += bvh_sah_cost(node->right.get(), root_area, node_cost, primitive_cost);
+	return cost;
+}
+
+double bvh_sah_cost(const bvh_node& root)
+{
+	return bvh_sah_cost(&root, surface_area(root.box));
+}
@@ -19,6 +19,7 @@ class camera
 
             double theta = degrees_to_radians(vfov);
             double half_height = tan(theta/2);
+            view_height = 2 * half_height;
             double half_width = aspect * half_height;
             
             w = unit_vector(lookfrom - lookat);
@@ -29,15 +30,26 @@ class camera
             vertical = 2*half_height*focus_dist*v;
         }
 
-        ray get_ray(double s, double t) 
+        // Rays get a cone as wide as one pixel of an image this many pixels high, for texture filtering.
+        // The samples of a pixel spread over it already, so with more samples the cone narrows, by
+        // 1 / sqrt(samples) down to an eighth of a pixel, and textures are not filtered twice.
+        // Without it rays carry no footprint and textures are read at full resolution.
+        void set_pixel_footprint(int image_height, int samples_per_pixel)
+        {
+            pixel_spread = view_height / image_height * std::max(0.125, 1 / std::sqrt(double(samples_per_pixel)));
+        }
+
+        ray get_ray(double s, double t) const
         {
             vec3 rd = lens_radius * random_in_unit_disc();
             vec3 offset = u * rd.x() + v * rd.y();
             // Randomly determine the ray between shutter open / close times
-            return ray(
+            ray r(
                 origin + offset, 
                 lower_left_corner + s*horizontal + t*vertical - origin - offset,
                 random_double(time0, time1));
+            r.cone_spread = pixel_spread;
+            return r;
         }
 
         vec3 origin;
@@ -49,4 +61,6 @@ class camera
         vec3 vertical;
         double lens_radius;
         double time0, time1; // shutter open/close times
+        double view_height;  // height of the view at unit distance
+        double pixel_spread = 0;
 };
@@ -0,0 +1,342 @@
+#pragma once
+
+#include "rtweekend.h"
+#include "framebuffer.h"
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+
+// A file mapped into memory for reading and writing.
+class mapped_file
+{
+    public:
+        mapped_file() {}
+        ~mapped_file() { close(); }
+
+        mapped_file(const mapped_file&) = delete;
+        mapped_file& operator=(const mapped_file&) = delete;
+
+        // Maps the first size bytes of path, creating the file or growing it with zeros as needed.
+        // With truncate an existing file is emptied first. Returns false on failure.
+        bool open(const std::string& path, size_t size, bool truncate);
+        void close();
+
+        // Blocks until [offset, offset + length) has been written to the file.
+        bool flush(size_t offset, size_t length);
+
+        uint8_t* data() const { return base; }
+        size_t size() const { return bytes; }
+
+    private:
+#if defined(_WIN32)
+        HANDLE file = INVALID_HANDLE_VALUE;
+        HANDLE mapping = nullptr;
+#else
+        int fd = -1;
+#endif
+        uint8_t* base = nullptr;
+        size_t bytes = 0;
+};
+
+#if defined(_WIN32)
+
+bool mapped_file::open(const std::string& path, size_t size, bool truncate)
+{
+    close();
+    file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr,
+        truncate ? CREATE_ALWAYS : OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+
+    const uint64_t size64 = size;
+    mapping = CreateFileMappingA(file, nullptr, PAGE_READWRITE, static_cast<DWORD>(size64 >> 32), static_cast<DWORD>(size64), nullptr);
+    if (mapping != nullptr)
+        base = static_cast<uint8_t*>(MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, size));
+    if (base == nullptr)
+    {
+        close();
+        return false;
+    }
+    bytes = size;
+    return true;
+}
+
+void mapped_file::close()
+{
+    if (base != nullptr)
+        UnmapViewOfFile(base);
+    if (mapping != nullptr)
+        CloseHandle(mapping);
+    if (file != INVALID_HANDLE_VALUE)
+        CloseHandle(file);
+    base = nullptr;
+    mapping = nullptr;
+    file = INVALID_HANDLE_VALUE;
+    bytes = 0;
+}
+
+bool mapped_file::flush(size_t offset, size_t length)
+{
+    return FlushViewOfFile(base + offset, length) && FlushFileBuffers(file);
+}
+
+#else
+
+bool mapped_file::open(const std::string& path, size_t size, bool truncate)
+{
+    close();
+    fd = ::open(path.c_str(), O_RDWR | O_CREAT | (truncate ? O_TRUNC : 0), 0644);
+    if (fd < 0)
+        return false;
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (static_cast<size_t>(info.st_size) < size && ftruncate(fd, static_cast<off_t>(size)) != 0))
+    {
+        close();
+        return false;
+    }
+
+    void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED)
+    {
+        close();
+        return false;
+    }
+    base = static_cast<uint8_t*>(p);
+    bytes = size;
+    return true;
+}
+
+void mapped_file::close()
+{
+    if (base != nullptr)
+        munmap(base, bytes);
+    if (fd >= 0)
+        ::close(fd);
+    base = nullptr;
+    fd = -1;
+    bytes = 0;
+}
+
+bool mapped_file::flush(size_t offset, size_t length)
+{
+    // msync wants a page aligned start.
+    const size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    const size_t start = offset / page * page;
+    return msync(base + start, offset + length - start, MS_SYNC) == 0;
+}
+
+#endif
+
+
+// What a checkpoint belongs to: every setting that changes the estimate of a pixel. A render only
+// resumes from a checkpoint of the same one.
+struct render_identity
+{
+    int32_t width;
+    int32_t height;
+    int32_t scene;
+    int32_t max_depth;
+    uint32_t moments;
+    int32_t samples_per_pixel; // also sets the ray cone spread of mipmapped textures
+    uint32_t integrator;       // 0 recursive, 1 iterative, 2 wavefront
+    int32_t rr_min_depth;
+    uint32_t compile;
+    uint32_t mipmaps;
+    uint32_t texel_format;
+    uint32_t texture_filter;
+};
+
+/* Checkpoint of a progressive render in a memory mapped file: a header and two slots, each holding
+   its samples per pixel and the sums, sample counts and (if tracked) squared sums of the framebuffer.
+   A checkpoint goes to the slot that is not active and is flushed to disk before the header switches
+   to it. That switch is the single store of active_slot, so the file holds a complete checkpoint,
+   with the sample count that belongs to it, whenever the process is killed.
+   The random numbers of a sample are a function of its pixel and sample index (rng_seed), so the
+   sample count of the checkpoint is all of the RNG state needed to go on with the next sample. The
+   header keeps a value of the generator to refuse a checkpoint made with a different one. */
+class render_checkpoint
+{
+    public:
+        // Starts a new, empty checkpoint file at path.
+        bool create(const std::string& path, const render_identity& id);
+
+        // Opens the checkpoint at path. False, with the reason printed, if there is none or it belongs
+        // to another render or build.
+        bool open(const std::string& path, const render_identity& id);
+
+        // Copies the last complete checkpoint into fb and returns its samples per pixel, 0 if there is none.
+        int restore(framebuffer& fb) const;
+
+        // Writes fb, which holds samples_done samples per pixel, as the new checkpoint.
+        bool save(const framebuffer& fb, int samples_done);
+
+    private:
+        struct header
+        {
+            char magic[8];
+            uint32_t version;
+            uint32_t vec3_bytes; // the slots hold vec3s as laid out in memory (precision and SIMD padding)
+            uint64_t rng_check;
+            render_identity id;
+            uint32_t active_slot; // slot of the last complete checkpoint, or no_slot
+        };
+
+        // Start of a slot; the framebuffer follows at slot_header_bytes.
+        struct slot_header
+        {
+            uint64_t sequence;    // checkpoints written up to and including this one
+            int64_t samples_done; // samples per pixel in this slot
+        };
+
+        static const uint32_t no_slot = 0xffffffffu;
+        static const uint32_t current_version = 3;
+        static const size_t slot_header_bytes = 64;
+
+        static uint64_t rng_check_value()
+        {
+            const rng_stream saved = rng_current;
+            rng_seed(1, 2);
+            const uint64_t value = rng_next();
+            rng_current = saved;
+            return value;
+        }
+
+        header make_header(const render_identity& id) const
+        {
+            header h{};
+            std::memcpy(h.magic, "RTWCKPT", 8);
+            h.version = current_version;
+            h.vec3_bytes = sizeof(vec3);
+            h.rng_check = rng_check_value();
+            h.id = id;
+            h.active_slot = no_slot;
+            return h;
+        }
+
+        size_t pixel_count() const { return static_cast<size_t>(identity.width) * identity.height; }
+        size_t slot_bytes() const
+        {
+            return slot_header_bytes + pixel_count() * ((identity.moments ? 2 : 1) * sizeof(vec3) + sizeof(uint32_t));
+        }
+        size_t slot_offset(uint32_t slot) const
+        {
+            // Slots start on 64 byte boundaries.
+            return (sizeof(header) + 63) / 64 * 64 + slot * ((slot_bytes() + 63) / 64 * 64);
+        }
+        header& file_header() const { return *reinterpret_cast<header*>(file.data()); }
+        slot_header& file_slot_header(uint32_t slot) const { return *reinterpret_cast<slot_header*>(file.data() + slot_offset(slot)); }
+
+        mapped_file file;
+        render_identity identity{};
+};
+
+bool render_checkpoint::create(const std::string& path, const render_identity& id)
+{
+    identity = id;
+    if (!file.open(path, slot_offset(2), true))
+    {
+        std::cerr << "Could not create checkpoint " << path << "\n";
+        return false;
+    }
+    file_header() = make_header(id);
+    return file.flush(0, sizeof(header));
+}
+
+bool render_checkpoint::open(const std::string& path, const render_identity& id)
+{
+    header stored{};
+    std::ifstream in(path, std::ios::binary);
+    if (!in.read(reinterpret_cast<char*>(&stored), sizeof(stored)))
+    {
+        std::cerr << "No checkpoint in " << path << "\n";
+        return false;
+    }
+
+    const header expected = make_header(id);
+    if (std::memcmp(stored.magic, expected.magic, sizeof(stored.magic)) != 0 || stored.version != expected.version)
+    {
+        std::cerr << path << " is not a checkpoint of this renderer\n";
+        return false;
+    }
+    if (stored.vec3_bytes != expected.vec3_bytes || stored.rng_check != expected.rng_check)
+    {
+        std::cerr << "Checkpoint " << path << " was written by a build with a different vec3 or random number generator\n";
+        return false;
+    }
+    if (std::memcmp(&stored.id, &expected.id, sizeof(render_identity)) != 0)
+    {
+        std::cerr << "Checkpoint " << path << " belongs to another render: scene " << stored.id.scene << ", "
+                  << stored.id.width << "x" << stored.id.height << ", " << stored.id.samples_per_pixel << " spp, max depth "
+                  << stored.id.max_depth << ", moments " << stored.id.moments << ", integrator " << stored.id.integrator
+                  << ", rr depth " << stored.id.rr_min_depth << ", compile " << stored.id.compile << ", mipmaps "
+                  << stored.id.mipmaps << ", texels " << stored.id.texel_format << ", texture filter " << stored.id.texture_filter << "\n";
+        return false;
+    }
+
+    in.close();
+    identity = id;
+    if (!file.open(path, slot_offset(2), false))
+    {
+        std::cerr << "Could not map checkpoint " << path << "\n";
+        return false;
+    }
+    return true;
+}
+
+int render_checkpoint::restore(framebuffer& fb) const
+{
+    const header& h = file_header();
+    if (h.active_slot == no_slot)
+        return 0;
+
+    const uint8_t* slot = file.data() + slot_offset(h.active_slot) + slot_header_bytes;
+    const size_t n = pixel_count();
+    std::memcpy(fb.sums.data(), slot, n * sizeof(vec3));
+    std::memcpy(fb.counts.data(), slot + n * sizeof(vec3), n * sizeof(uint32_t));
+    if (fb.has_moments())
+        std::memcpy(fb.squares.data(), slot + n * (sizeof(vec3) + sizeof(uint32_t)), n * sizeof(vec3));
+    return static_cast<int>(file_slot_header(h.active_slot).samples_done);
+}
+
+bool render_checkpoint::save(const framebuffer& fb, int samples_done)
+{
+    header& h = file_header();
+    const uint32_t slot = h.active_slot == 0 ? 1 : 0;
+    slot_header& sh = file_slot_header(slot);
+    sh.sequence = h.active_slot == no_slot ? 1 : file_slot_header(h.active_slot).sequence + 1;
+    sh.samples_done = samples_done;
+    uint8_t* data = file.data() + slot_offset(slot) + slot_header_bytes;
+    const size_t n = pixel_count();
+    std::memcpy(data, fb.sums.data(), n * sizeof(vec3));
+    std::memcpy(data + n * sizeof(vec3), fb.counts.data(), n * sizeof(uint32_t));
+    if (fb.has_moments())
+        std::memcpy(data + n * (sizeof(vec3) + sizeof(uint32_t)), fb.squares.data(), n * sizeof(vec3));
+    if (!file.flush(slot_offset(slot), slot_bytes()))
+        return false;
+
+    // The slot is complete on disk; switching to it is the commit point.
+    std::atomic_thread_fence(std::memory_order_release);
+    h.active_slot = slot;
+    return file.flush(0, sizeof(header));
+}
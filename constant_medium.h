@@ -11,24 +11,29 @@ class constant_medium : public hittable
 		constant_medium(shared_ptr<hittable> b, double d, shared_ptr<texture> a)
 			: boundary(b), neg_inv_density(-1 / d)
 		{
-			phase_function = make_shared<isotropic>(a);
+			phase_function = scene_make<isotropic>(a);
 		}
 
-		virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const;
+		virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const;
 
 		virtual bool bounding_box(double time0, double time1, aabb& output_box) const
 		{
 			return boundary->bounding_box(time0, time1, output_box);
 		}
 
+		const shared_ptr<hittable>& boundary_object() const { return boundary; }
+		void set_boundary(shared_ptr<hittable> b) { boundary = b; }
+
 	private:
 		shared_ptr<hittable> boundary;
 		shared_ptr<material> phase_function;
 		double neg_inv_density;
 };
 
-bool constant_medium::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+bool constant_medium::hit(const ray& r, real t_min, real t_max, hit_record& rec) const
 {
+	RTW_COUNT_HIT();
+
 	// Print occasional samples when debugging. To enable, set enableDebug true.
 	const bool enableDebug = false;
 	const bool debugging = enableDebug && random_double() < 0.00001;
@@ -78,7 +83,7 @@ bool constant_medium::hit(const ray& r, double t_min, double t_max, hit_record&
 
 	rec.normal = vec3(1, 0, 0); // arbitrary
 	rec.front_face = true;		// also arbitrary
-	rec.mat_ptr = phase_function;
+	rec.mat_ptr = phase_function.get();
 
 	return true;
 }
@@ -0,0 +1,239 @@
+#pragma once
+
+#include "rtweekend.h"
+#include "hittable.h"
+#include "bvh.h"
+
+#include <cstdint>
+#include <vector>
+
+
+/* One node of the flattened BVH, exactly 32 bytes so two nodes share a cache line.
+   Bounds are stored as floats, rounded outwards so they always contain the double precision box.
+   Interior node: the left child directly follows the node, `offset` is the index of the right child.
+   Leaf: `count` > 0 primitives starting at `offset` in the primitive array. */
+struct alignas(32) flat_bvh_node
+{
+    float bmin[3];
+    float bmax[3];
+    uint32_t offset;
+    uint16_t count;
+    uint16_t axis; // split axis of the bvh_node, used to visit the nearer child first
+};
+
+static_assert(sizeof(flat_bvh_node) == 32, "flat_bvh_node must be 32 bytes");
+
+// Float bounds that are guaranteed to contain the double precision ones.
+inline float float_round_down(double x)
+{
+    const float f = static_cast<float>(x);
+    return f > x ? std::nextafter(f, -std::numeric_limits<float>::infinity()) : f;
+}
+
+inline float float_round_up(double x)
+{
+    const float f = static_cast<float>(x);
+    return f < x ? std::nextafter(f, std::numeric_limits<float>::infinity()) : f;
+}
+
+
+// Contiguous, index based copy of a finished bvh_node hierarchy. Traversal is iterative with a
+// small fixed-size stack instead of recursing through virtual bvh_node::hit calls.
+class flat_bvh : public hittable
+{
+    public:
+        flat_bvh(shared_ptr<bvh_node> root);
+
+        flat_bvh(hittable_list& list, double time0, double time1, bvh_split split = bvh_default_split)
+            : flat_bvh(scene_make<bvh_node>(list, time0, time1, split))
+        {}
+
+        virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const;
+
+        virtual bool bounding_box(double time0, double time1, aabb& output_box) const
+        {
+            output_box = box;
+            return true;
+        }
+
+        size_t memory_bytes() const
+        {
+            return nodes.capacity() * sizeof(flat_bvh_node) + primitives.capacity() * sizeof(const hittable*);
+        }
+
+    public:
+        // Traversal stack kept on the call stack. Deeper trees (a degenerate SAH build, or bvh_nodes nested
+        // inside bvh_nodes) use a stack of depth entries on the heap instead.
+        static const int stack_size = 64;
+
+        std::vector<flat_bvh_node> nodes;
+        std::vector<const hittable*> primitives;
+        int depth = 0; // levels of the deepest leaf; a traversal never holds more stack entries
+
+    private:
+        void flatten(const hittable* object, int level);
+        void add_leaf(const hittable* a, const hittable* b, int level);
+        void set_bounds(uint32_t index, const aabb& bounds);
+
+        // The primitives are still owned by the original tree.
+        shared_ptr<bvh_node> source;
+        aabb box;
+};
+
+flat_bvh::flat_bvh(shared_ptr<bvh_node> root)
+    : source(root), box(root->box)
+{
+    flatten(root.get(), 1);
+}
+
+void flat_bvh::set_bounds(uint32_t index, const aabb& bounds)
+{
+    auto& node = nodes[index];
+    for (int a = 0; a < 3; ++a)
+    {
+        node.bmin[a] = float_round_down(bounds.min()[a]);
+        node.bmax[a] = float_round_up(bounds.max()[a]);
+    }
+}
+
+void flat_bvh::add_leaf(const hittable* a, const hittable* b, int level)
+{
+    depth = std::max(depth, level);
+
+    flat_bvh_node node{};
+    node.offset = static_cast<uint32_t>(primitives.size());
+    node.count = 1;
+    primitives.push_back(a);
+
+    aabb bounds;
+    a->bounding_box(0, 1, bounds);
+
+    if (b != nullptr && b != a)
+    {
+        aabb bounds_b;
+        b->bounding_box(0, 1, bounds_b);
+        bounds = surrounding_box(bounds, bounds_b);
+        primitives.push_back(b);
+        node.count = 2;
+    }
+
+    nodes.push_back(node);
+    set_bounds(static_cast<uint32_t>(nodes.size() - 1), bounds);
+}
+
+// Depth first, so the left child of every interior node is stored right after it.
+// Nested bvh_nodes (e.g. a scene that is a bvh_node of bvh_nodes) end up in the same array.
+void flat_bvh::flatten(const hittable* object, int level)
+{
+    auto node = dynamic_cast<const bvh_node*>(object);
+    if (node == nullptr)
+    {
+        add_leaf(object, nullptr, level);
+        return;
+    }
+
+    const hittable* left = node->left.get();
+    const hittable* right = node->right.get();
+    const bool left_inner = dynamic_cast<const bvh_node*>(left) != nullptr;
+    const bool right_inner = dynamic_cast<const bvh_node*>(right) != nullptr;
+
+    // Single element nodes duplicate their child, skip them.
+    if (left == right)
+    {
+        flatten(left, level);
+        return;
+    }
+
+    // Two primitives become one leaf instead of an interior node with two leaves.
+    if (!left_inner && !right_inner)
+    {
+        add_leaf(left, right, level);
+        return;
+    }
+
+    const auto index = static_cast<uint32_t>(nodes.size());
+    nodes.push_back(flat_bvh_node{});
+    set_bounds(index, node->box);
+    // The left child holds the smaller coordinates along the split axis.
+    nodes[index].axis = static_cast<uint16_t>(node->axis);
+
+    flatten(left, level + 1);
+    nodes[index].offset = static_cast<uint32_t>(nodes.size());
+    flatten(right, level + 1);
+}
+
+bool flat_bvh::hit(const ray& r, real t_min, real t_max, hit_record& rec) const
+{
+    RTW_COUNT_HIT();
+    const vec3 origin = r.origin();
+    const vec3& inv_dir = r.inv_dir;
+    const int* dir_neg = r.sign;
+
+    uint32_t local_stack[stack_size];
+    std::vector<uint32_t> deep_stack;
+    uint32_t* stack = local_stack;
+    if (depth > stack_size)
+    {
+        deep_stack.resize(depth);
+        stack = deep_stack.data();
+    }
+    int stack_top = 0;
+    uint32_t index = 0;
+
+    bool hit_anything = false;
+    double closest_so_far = t_max;
+
+    while (true)
+    {
+        const flat_bvh_node& node = nodes[index];
+
+        // Slab test against the node box, same as aabb::hit.
+        double t0 = t_min;
+        double t1 = closest_so_far;
+        for (int a = 0; a < 3; ++a)
+        {
+            double near = (node.bmin[a] - origin[a]) * inv_dir[a];
+            double far = (node.bmax[a] - origin[a]) * inv_dir[a];
+            if (dir_neg[a])
+                std::swap(near, far);
+            t0 = near > t0 ? near : t0;
+            t1 = far < t1 ? far : t1;
+        }
+
+        if (t0 <= t1)
+        {
+            if (node.count > 0)
+            {
+                for (uint32_t k = node.offset; k < node.offset + node.count; ++k)
+                {
+                    if (primitives[k]->hit(r, t_min, closest_so_far, rec))
+                    {
+                        hit_anything = true;
+                        closest_so_far = rec.t;
+                    }
+                }
+            }
+            else
+            {
+                // Descend into the child closer to the ray origin, remember the other one.
+                if (dir_neg[node.axis])
+                {
+                    stack[stack_top++] = index + 1;
+                    index = node.offset;
+                }
+                else
+                {
+                    stack[stack_top++] = node.offset;
+                    index = index + 1;
+                }
+                continue;
+            }
+        }
+
+        if (stack_top == 0)
+            break;
+        index = stack[--stack_top];
+    }
+
+    return hit_anything;
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+#include "rtweekend.h"
+#include "vec3.h"
+
+#include <cstdint>
+#include <vector>
+
+
+/* Linear HDR accumulation buffer. Per pixel it holds the sum of the radiance samples and their count,
+   and, if moments are tracked, the sum of their squares per channel, from which the variance of the
+   pixel estimate follows. Nothing is tone mapped or clamped here: the output stage resolves and tone
+   maps a copy, so an image can be refined further or exposed again without rendering it again.
+   Row 0 is the bottom row of the image. Tiles never overlap, so render threads add to their own
+   pixels without locking. */
+class framebuffer
+{
+    public:
+        framebuffer() {}
+
+        framebuffer(int w, int h, bool track_moments = false)
+            : width(w), height(h),
+              sums(static_cast<size_t>(w) * h), counts(static_cast<size_t>(w) * h, 0)
+        {
+            if (track_moments)
+                squares.resize(sums.size());
+        }
+
+        size_t index(int i, int j) const { return static_cast<size_t>(j) * width + i; }
+        size_t size() const { return sums.size(); }
+        bool has_moments() const { return !squares.empty(); }
+
+        // Adds the sum of count samples, and the sum of their squares if moments are tracked.
+        void add(size_t pixel, const vec3& sum, const vec3& sum_of_squares, uint32_t count)
+        {
+            sums[pixel] += sum;
+            counts[pixel] += count;
+            if (has_moments())
+                squares[pixel] += sum_of_squares;
+        }
+
+        void add_sample(size_t pixel, const vec3& radiance)
+        {
+            add(pixel, radiance, radiance * radiance, 1);
+        }
+
+        // Average radiance of a pixel, zero before its first sample.
+        vec3 mean(size_t pixel) const
+        {
+            return counts[pixel] > 0 ? sums[pixel] / counts[pixel] : vec3(0, 0, 0);
+        }
+
+        // Variance of the pixel mean per channel: the sample variance over the count. Needs moments.
+        vec3 variance_of_mean(size_t pixel) const
+        {
+            const double n = counts[pixel];
+            if (n < 2)
+                return vec3(infinity, infinity, infinity);
+            const vec3 m = sums[pixel] / n;
+            vec3 sample_variance = (squares[pixel] / n - m * m) * (n / (n - 1));
+            // E[x^2] - E[x]^2 of (nearly) constant samples can round to slightly below zero.
+            for (int c = 0; c < 3; ++c)
+                sample_variance[c] = std::max(sample_variance[c], real(0));
+            return sample_variance / n;
+        }
+
+        // Average over all pixels of the standard error of the pixel luminance relative to the luminance
+        // (pixels darker than 1e-3 count with their absolute error). Needs moments.
+        double mean_relative_error() const;
+
+        // Copies size, sums and counts of other, not the moments: what the output stage needs.
+        void copy_radiance(const framebuffer& other)
+        {
+            width = other.width;
+            height = other.height;
+            sums.assign(other.sums.begin(), other.sums.end());
+            counts.assign(other.counts.begin(), other.counts.end());
+        }
+
+        void clear()
+        {
+            std::fill(sums.begin(), sums.end(), vec3(0, 0, 0));
+            std::fill(counts.begin(), counts.end(), 0);
+            std::fill(squares.begin(), squares.end(), vec3(0, 0, 0));
+        }
+
+    public:
+        int width = 0;
+        int height = 0;
+        std::vector<vec3> sums;
+        std::vector<uint32_t> counts;
+        std::vector<vec3> squares; // empty unless moments are tracked
+};
+
+inline double luminance(const vec3& c)
+{
+    return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+}
+
+double framebuffer::mean_relative_error() const
+{
+    if (!has_moments() || sums.empty())
+        return 0.0;
+
+    double total = 0.0;
+    for (size_t k = 0; k < sums.size(); ++k)
+    {
+        // The luminance is a linear combination of the channels; their covariances are ignored.
+        const vec3 v = variance_of_mean(k);
+        const double error = std::sqrt(0.2126 * 0.2126 * v.x() + 0.7152 * 0.7152 * v.y() + 0.0722 * 0.0722 * v.z());
+        total += error / std::max(luminance(mean(k)), 1e-3);
+    }
+    return total / sums.size();
+}
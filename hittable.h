@@ -2,15 +2,25 @@
 
 #include "rtweekend.h"
 #include "aabb.h"
+#include "transform.h"
 
 
 class material;
 
+// Building with RTW_COUNT_HITS defined counts the hit() calls of every hittable on the calling thread,
+// for the calls per ray reported by --bench compile. Otherwise RTW_COUNT_HIT() compiles to nothing.
+#ifdef RTW_COUNT_HITS
+inline thread_local uint64_t hit_call_count = 0;
+#define RTW_COUNT_HIT() (++hit_call_count)
+#else
+#define RTW_COUNT_HIT() ((void)0)
+#endif
+
 /* Utility function to calculate uv coordinates for a sphere.
    Expects things on the unit sphere (divided by radius) centered at the origin (minus center).
    Spherical coordinates phi and theta can be calculated by spherical equations (see tutorial for derivations).
 */
-void get_sphere_uv(const vec3& p, double& u, double& v)
+void get_sphere_uv(const vec3& p, real& u, real& v)
 {
     auto phi = atan2(p.z(), p.x());
     auto theta = asin(p.y());
@@ -22,14 +32,56 @@ void get_sphere_uv(const vec3& p, double& u, double& v)
     v = (theta + pi / 2) / pi;
 }
 
+/* hit_record::uv_scale of a sphere of the given radius at p on the unit sphere. Along a circle of latitude
+   u changes by 1 / (2 pi r cos(latitude)) per unit length, along a meridian v by 1 / (pi r). */
+inline real sphere_uv_scale(const vec3& p, real radius)
+{
+    const real cos_latitude = std::sqrt(std::max(1 - p.y() * p.y(), real(1e-6)));
+    return 1 / (pi * std::fabs(radius) * std::sqrt(2 * cos_latitude));
+}
+
+/* Both roots t_near <= t_far of |oc + t * d| = radius, oc being the ray origin relative to the center.
+   Returns false if the ray misses. In double precision this is the textbook quadratic formula.
+   In float, half_b^2 - a*c cancels catastrophically for spheres that are far away compared to their
+   radius, and the hit point may end up below the surface. Then the discriminant is computed from the
+   distance of the center to the ray, and the roots with the formula that avoids the subtraction. */
+inline bool sphere_roots(const vec3& oc, const vec3& d, real radius, real& t_near, real& t_far)
+{
+    real a = d.length_squared();
+    real half_b = dot(oc, d);
+    real c = oc.length_squared() - radius*radius;
+#ifdef RTW_FLOAT32
+    vec3 l = oc - (half_b / a) * d;
+    real discriminant = a * (radius*radius - l.length_squared());
+    if (!(discriminant > 0))
+        return false;
+
+    real q = -half_b - std::copysign(std::sqrt(discriminant), half_b);
+    t_near = q / a;
+    t_far = c / q;
+    if (t_near > t_far)
+        std::swap(t_near, t_far);
+#else
+    real discriminant = half_b * half_b - a*c;
+    if (!(discriminant > 0))
+        return false;
+
+    real root = sqrt(discriminant);
+    t_near = (-half_b - root) / a;
+    t_far = (-half_b + root) / a;
+#endif
+    return true;
+}
+
 struct hit_record
 {
     vec3 p; // hit point
     vec3 normal; // hit point normal
-    shared_ptr<material> mat_ptr; // stored material pointer
-    double t; // the t from the ray equation
-    double u; // u texture coordinate
-    double v; // v texture coordinate
+    const material* mat_ptr; // material of the hit object, owned by the object (copying a hit_record touches no refcount)
+    real t; // the t from the ray equation
+    real u; // u texture coordinate
+    real v; // v texture coordinate
+    real uv_scale = 0; // change of u and v per unit length on the surface (geometric mean); 0 if unknown
     bool front_face; // front face or back face?
 
     inline void set_face_normal(const ray& r, const vec3& outward_normal)
@@ -37,13 +89,47 @@ struct hit_record
         front_face = dot(r.direction(), outward_normal) < 0;
         normal = front_face ? outward_normal : -outward_normal;
     }
+
+    // Width in uv units of the footprint of r's cone on the surface, for choosing a texture level of
+    // detail; 0 if r has no cone or the surface no uv_scale. A cone hitting at an angle covers an ellipse
+    // of 1 / cos times the area, which is the area of a circle 1 / sqrt(cos) times as wide.
+    real texture_footprint(const ray& r) const
+    {
+        if (uv_scale == 0 || r.cone_spread == 0)
+            return 0;
+        const real cosine = std::fabs(dot(r.direction(), normal)) / r.direction().length();
+        return r.cone_width_at(t) * uv_scale / std::sqrt(std::max(cosine, real(1e-4)));
+    }
+
+    // Passes r's cone on to the ray scattered at this hit: it starts as wide as r's cone is here and keeps
+    // spreading at the same angle. A mirror reflection off a curved surface or a diffuse bounce would
+    // widen it faster, so textures seen after a bounce are filtered too little rather than too much.
+    void continue_cone(const ray& r, ray& scattered) const
+    {
+        scattered.cone_width = r.cone_width_at(t);
+        scattered.cone_spread = r.cone_spread;
+    }
+
+    // Ray leaving the hit point in direction dir. In the float mode the origin is pushed off the
+    // surface, to the side dir points to, by more than the rounding error of p. A ray at a grazing
+    // angle would otherwise hit the surface it starts on again far beyond ray_epsilon.
+    ray spawn_ray(const vec3& dir, real time = 0) const
+    {
+#ifdef RTW_FLOAT32
+        const real extent = std::max({ std::fabs(p.x()), std::fabs(p.y()), std::fabs(p.z()), real(1) });
+        const real offset = extent * std::ldexp(real(1), -18);
+        return ray(p + (dot(dir, normal) > 0 ? offset : -offset) * normal, dir, time);
+#else
+        return ray(p, dir, time);
+#endif
+    }
 };
 
 class hittable
 {
     public:
         // Only hits in the interval [t_min, t_max] are considered. t being the t from ray equation p(t) = orig + t*direction
-        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const = 0;
+        virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const = 0;
 
         // Compute bounding box of object. Object may move in interval time0 und time1, so aabb is calculated to bound all possible locations.
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const = 0;
@@ -55,8 +141,9 @@ class flip_face : public hittable
         flip_face(shared_ptr<hittable> p)
             : ptr(p) {}
 
-        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+        virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const
         {
+            RTW_COUNT_HIT();
             if (!ptr->hit(r, t_min, t_max, rec))
                 return false;
 
@@ -68,6 +155,8 @@ class flip_face : public hittable
         {
             return ptr->bounding_box(t0, t1, output_box);
         }
+
+        const shared_ptr<hittable>& object() const { return ptr; }
         
     private:
         shared_ptr<hittable> ptr;
@@ -81,9 +170,11 @@ class translate : public hittable
             : ptr(p), offset(displacement)
         {}
 
-        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const;
+        virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const;
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const;
 
+        const shared_ptr<hittable>& object() const { return ptr; }
+        affine_transform transform() const { return affine_transform::translation(offset); }
 
     private:
         shared_ptr<hittable> ptr;
@@ -91,14 +182,15 @@ class translate : public hittable
 };
 
 // Translate/move ray in opposite direction instead of translating/moving real object
-bool translate::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+bool translate::hit(const ray& r, real t_min, real t_max, hit_record& rec) const
 {
+    RTW_COUNT_HIT();
     ray moved_r(r.origin() - offset, r.direction(), r.time());
     if (!ptr->hit(moved_r, t_min, t_max, rec))
         return false;
 
+    // The normal already faces the ray and the direction is unchanged, so the object's front_face stays.
     rec.p += offset;
-    rec.set_face_normal(moved_r, rec.normal);
 
     return true;
 }
@@ -119,17 +211,27 @@ class rotate_y : public hittable
     public:
         rotate_y(shared_ptr<hittable> p, double angle);
 
-        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const;
+        virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const;
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const
         {
             output_box = bbox;
             return hasBox;
         }
 
+        const shared_ptr<hittable>& object() const { return ptr; }
+
+        // Object to world rotation: x' = cos x + sin z, z' = -sin x + cos z.
+        affine_transform transform() const
+        {
+            return affine_transform(cos_theta, 0, sin_theta, 0,
+                                    0, 1, 0, 0,
+                                    -sin_theta, 0, cos_theta, 0);
+        }
+
     private:
         shared_ptr<hittable> ptr;
-        double sin_theta;
-        double cos_theta;
+        real sin_theta;
+        real cos_theta;
         bool hasBox;
         aabb bbox;
 };
@@ -172,8 +274,9 @@ rotate_y::rotate_y(shared_ptr<hittable> p, double angle)
     bbox = aabb(min, max);
 }
 
-bool rotate_y::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+bool rotate_y::hit(const ray& r, real t_min, real t_max, hit_record& rec) const
 {
+    RTW_COUNT_HIT();
     vec3 origin = r.origin();
     vec3 direction = r.direction();
 
@@ -197,8 +300,10 @@ bool rotate_y::hit(const ray& r, double t_min, double t_max, hit_record& rec) co
     normal[0] = cos_theta * rec.normal[0] + sin_theta * rec.normal[2];
     normal[2] = -sin_theta * rec.normal[0] + cos_theta * rec.normal[2];
 
+    // A rotation keeps the angle between ray and normal: the normal still faces the ray, and the
+    // object's front_face stays.
     rec.p = p;
-    rec.set_face_normal(rotated_r, normal);
+    rec.normal = normal;
 
     return true;
 }
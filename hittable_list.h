@@ -16,7 +16,7 @@ class hittable_list: public hittable
         void clear() { objects.clear(); }
         void add(shared_ptr<hittable> object) { objects.push_back(object); }
 
-        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const;
+        virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const;
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const;
         
 
@@ -24,19 +24,20 @@ class hittable_list: public hittable
 
 };
 
-bool hittable_list::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+// Objects only write rec when they report a hit closer than closest_so_far,
+// so the record can be filled in place instead of copying a temporary on every closer hit.
+bool hittable_list::hit(const ray& r, real t_min, real t_max, hit_record& rec) const
 {
-    hit_record temp_rec;
+    RTW_COUNT_HIT();
     bool hit_anything = false;
     double closest_so_far = t_max;
 
     for (const auto& object : objects)
     {
-        if (object->hit(r, t_min, closest_so_far, temp_rec))
+        if (object->hit(r, t_min, closest_so_far, rec))
         {
             hit_anything = true;
-            closest_so_far = temp_rec.t;
-            rec = temp_rec;
+            closest_so_far = rec.t;
         }
     }
     return hit_anything;
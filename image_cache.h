@@ -0,0 +1,183 @@
+#pragma once
+
+#include "rtw_stb_image.h"
+#include "texel_image.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+
+/* One image file, shared by every texture that refers to it and freed with the last of them.
+   The file is decoded once: by the background pool of the cache, or by the first texel access if
+   that comes first. Later accesses only load an atomic pointer. Decoding converts the pixels to a
+   texel_image in the given format, with mipmaps if asked for, and drops the decoded copy. */
+class cached_image
+{
+    public:
+        explicit cached_image(const std::string& file, texel_format texels = default_texel_format, bool mipmaps = default_mipmaps)
+            : path(file), format(texels), with_mipmaps(mipmaps) {}
+
+        cached_image(const cached_image&) = delete;
+        cached_image& operator=(const cached_image&) = delete;
+
+        // The decoded image, empty if the file could not be read; blocks while another thread decodes it.
+        const texel_image& get() const
+        {
+            const texel_image* ready = decoded.load(std::memory_order_acquire);
+            if (ready != nullptr)
+                return *ready;
+            std::call_once(once, [this] { decode(); });
+            return image;
+        }
+
+        bool is_decoded() const { return decoded.load(std::memory_order_acquire) != nullptr; }
+
+        const std::string path;
+
+    private:
+        // Images keep the channel count of the file: grey ones become r8 and high dynamic range ones half
+        // (see texel_format_for).
+        void decode() const
+        {
+            int width = 0, height = 0, channels = 0;
+            if (stbi_is_hdr(path.c_str()))
+            {
+                float* pixels = stbi_loadf(path.c_str(), &width, &height, &channels, 0);
+                if (pixels != nullptr)
+                {
+                    image = texel_image(pixels, width, height, channels, texel_format_for(format, channels, true), with_mipmaps);
+                    stbi_image_free(pixels);
+                }
+            }
+            else
+            {
+                unsigned char* pixels = stbi_load(path.c_str(), &width, &height, &channels, 0);
+                if (pixels != nullptr)
+                {
+                    image = texel_image(pixels, width, height, channels, texel_format_for(format, channels, false), with_mipmaps);
+                    stbi_image_free(pixels);
+                }
+            }
+            if (image.empty())
+                std::cerr << "Could not load image " << path << "\n";
+            decoded.store(&image, std::memory_order_release);
+        }
+
+        const texel_format format;
+        const bool with_mipmaps;
+        mutable texel_image image;
+        mutable std::once_flag once;
+        mutable std::atomic<const texel_image*> decoded{ nullptr };
+};
+
+
+// Fixed set of threads running queued jobs in order. The destructor waits for the jobs still queued.
+class job_pool
+{
+    public:
+        explicit job_pool(int thread_count)
+        {
+            for (int k = 0; k < std::max(thread_count, 1); ++k)
+                threads.emplace_back([this] { run(); });
+        }
+
+        ~job_pool()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stop = true;
+            }
+            changed.notify_all();
+            for (auto& thread : threads)
+                thread.join();
+        }
+
+        void submit(std::function<void()> job)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                jobs.push_back(std::move(job));
+            }
+            changed.notify_one();
+        }
+
+    private:
+        void run()
+        {
+            while (true)
+            {
+                std::function<void()> job;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    changed.wait(lock, [this] { return stop || !jobs.empty(); });
+                    if (jobs.empty())
+                        return;
+                    job = std::move(jobs.front());
+                    jobs.pop_front();
+                }
+                job();
+            }
+        }
+
+        std::mutex mutex;
+        std::condition_variable changed;
+        std::deque<std::function<void()>> jobs;
+        bool stop = false;
+        std::vector<std::thread> threads;
+};
+
+
+/* Process-wide cache of image files by path. Asking for a file that is already in use returns the
+   same cached_image, so a scene that references an image several times decodes and holds it once.
+   The cache only keeps weak references: an image is freed when no texture uses it any more.
+   A new image is queued on a pool of background threads right away, so building a scene does not
+   wait for the decoder; whatever reads the texels first waits for it or decodes it itself. */
+class image_cache
+{
+    public:
+        // The cache shared by all scenes.
+        static image_cache& global()
+        {
+            static image_cache cache(std::max(1, static_cast<int>(std::thread::hardware_concurrency()) / 2));
+            return cache;
+        }
+
+        explicit image_cache(int decode_threads) : pool(decode_threads) {}
+
+        std::shared_ptr<const cached_image> load(const std::string& path)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            ++requests;
+            auto& entry = images[path];
+            if (auto image = entry.lock())
+                return image;
+
+            auto image = std::make_shared<cached_image>(path);
+            entry = image;
+            ++files;
+            pool.submit([image] { image->get(); });
+            return image;
+        }
+
+        // Calls to load and files decoded for them since the start.
+        int request_count() const { std::lock_guard<std::mutex> lock(mutex); return requests; }
+        int file_count() const { std::lock_guard<std::mutex> lock(mutex); return files; }
+
+    private:
+        mutable std::mutex mutex;
+        std::unordered_map<std::string, std::weak_ptr<cached_image>> images;
+        int requests = 0;
+        int files = 0;
+
+        job_pool pool; // last: destroyed first, so no job outlives the cache
+};
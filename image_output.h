@@ -0,0 +1,328 @@
+#pragma once
+
+#include "rtweekend.h"
+#include "vec3.h"
+#include "framebuffer.h"
+#include "rtw_stb_image_write.h"
+
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+// File formats of the output stage, chosen by the extension of the output path.
+enum class image_format
+{
+    ppm, // binary P6, 8 bits per channel, gamma 2
+    png, // 8 bits per channel, gamma 2
+    pfm, // linear 32-bit float RGB, for compositing
+    hdr  // linear RGBE (Radiance)
+};
+
+// Format for the extension of path, compared case-insensitively. Returns false for any other extension.
+inline bool image_format_of(const std::string& path, image_format& format)
+{
+    const auto dot = path.rfind('.');
+    std::string extension = dot == std::string::npos ? "" : path.substr(dot + 1);
+    for (char& c : extension)
+        c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+    if (extension == "ppm")
+        format = image_format::ppm;
+    else if (extension == "png")
+        format = image_format::png;
+    else if (extension == "pfm")
+        format = image_format::pfm;
+    else if (extension == "hdr")
+        format = image_format::hdr;
+    else
+        return false;
+    return true;
+}
+
+// Curve applied to the exposed linear radiance before gamma correction and quantization to 8 bits.
+enum class tone_operator
+{
+    clamp,    // none, values above 1 clip
+    reinhard, // x / (1 + x)
+    aces      // Narkowicz' fit of the ACES filmic curve
+};
+
+struct tonemap_settings
+{
+    double exposure = 0.0; // in stops: radiance is scaled by 2^exposure
+    tone_operator op = tone_operator::clamp;
+};
+
+// Calls f(row_begin, row_end) for disjoint row ranges covering [0, rows) on up to thread_count threads.
+template <typename F>
+void parallel_rows(int rows, int thread_count, F f)
+{
+    const int count = std::max(1, std::min(thread_count, rows / 16));
+    std::vector<std::thread> threads;
+    for (int k = 1; k < count; ++k)
+        threads.emplace_back(f, rows * k / count, rows * (k + 1) / count);
+    f(0, rows / count);
+    for (auto& thread : threads)
+        thread.join();
+}
+
+/* Linear averages of one framebuffer row, scaled by the exposure, as n = 3 * width interleaved doubles.
+   NaNs become 0 and pixels without samples are black. */
+void resolve_row(const framebuffer& fb, int j, double exposure_scale, double* out)
+{
+    for (int i = 0; i < fb.width; ++i)
+    {
+        const size_t pixel = fb.index(i, j);
+        const double scale = fb.counts[pixel] > 0 ? 1.0 / fb.counts[pixel] : 0.0;
+        for (int c = 0; c < 3; ++c)
+        {
+            const double sum = fb.sums[pixel][c];
+            out[3 * i + c] = sum == sum ? scale * sum * exposure_scale : 0.0;
+        }
+    }
+}
+
+/* Tone curve, gamma 2 and quantization of n linear values, in place of vec3::write_color's per pixel
+   stream output. For the clamp operator this is 256 * clamp(sqrt(x), 0, 0.999) like write_color, four
+   values per AVX2 instruction: max returns its second operand 0 for a NaN. */
+void quantize_values(double* values, size_t n, tone_operator op, uint8_t* out)
+{
+    if (op == tone_operator::reinhard)
+    {
+        for (size_t k = 0; k < n; ++k)
+            values[k] = values[k] / (1.0 + values[k]);
+    }
+    else if (op == tone_operator::aces)
+    {
+        for (size_t k = 0; k < n; ++k)
+        {
+            const double x = values[k];
+            values[k] = (x * (2.51 * x + 0.03)) / (x * (2.43 * x + 0.59) + 0.14);
+        }
+    }
+
+    size_t k = 0;
+#ifdef RTW_AVX2
+    const __m256d zero = _mm256_setzero_pd();
+    const __m256d top = _mm256_set1_pd(0.999);
+    const __m256d levels = _mm256_set1_pd(256.0);
+    alignas(16) int32_t q[4];
+    for (; k + 4 <= n; k += 4)
+    {
+        __m256d v = _mm256_sqrt_pd(_mm256_loadu_pd(values + k));
+        v = _mm256_min_pd(_mm256_max_pd(v, zero), top);
+        _mm_store_si128(reinterpret_cast<__m128i*>(q), _mm256_cvttpd_epi32(_mm256_mul_pd(levels, v)));
+        for (int c = 0; c < 4; ++c)
+            out[k + c] = static_cast<uint8_t>(q[c]);
+    }
+#endif
+    for (; k < n; ++k)
+    {
+        const double v = std::sqrt(values[k]);
+        out[k] = static_cast<uint8_t>(256 * (v > 0.0 ? std::min(v, 0.999) : 0.0));
+    }
+}
+
+// Tone mapped, interleaved RGB bytes, top row first.
+void tonemap_bytes(const framebuffer& fb, const tonemap_settings& settings, std::vector<uint8_t>& bytes, int thread_count)
+{
+    bytes.resize(fb.size() * 3);
+    const double exposure_scale = std::exp2(settings.exposure);
+    parallel_rows(fb.height, thread_count, [&](int row_begin, int row_end)
+    {
+        std::vector<double> values(static_cast<size_t>(fb.width) * 3);
+        for (int row = row_begin; row < row_end; ++row)
+        {
+            resolve_row(fb, fb.height - 1 - row, exposure_scale, values.data());
+            quantize_values(values.data(), values.size(), settings.op, &bytes[static_cast<size_t>(row) * fb.width * 3]);
+        }
+    });
+}
+
+// Interleaved linear RGB averages scaled by the exposure, without tone curve. Top row first unless bottom_up.
+void linear_floats(const framebuffer& fb, double exposure, std::vector<float>& values, bool bottom_up, int thread_count)
+{
+    values.resize(fb.size() * 3);
+    const double exposure_scale = std::exp2(exposure);
+    parallel_rows(fb.height, thread_count, [&](int row_begin, int row_end)
+    {
+        std::vector<double> row_values(static_cast<size_t>(fb.width) * 3);
+        for (int row = row_begin; row < row_end; ++row)
+        {
+            resolve_row(fb, bottom_up ? row : fb.height - 1 - row, exposure_scale, row_values.data());
+            std::copy(row_values.begin(), row_values.end(), values.begin() + static_cast<size_t>(row) * fb.width * 3);
+        }
+    });
+}
+
+/* Writes the framebuffer to path in the given format; the float formats are exposed but not tone mapped.
+   The file is written under a temporary name and renamed when complete, so a viewer that watches path
+   never reads half an image. Returns false on failure. */
+bool write_image(const framebuffer& fb, const std::string& path, image_format format, const tonemap_settings& settings,
+    int thread_count)
+{
+    const std::string partial = path + ".partial";
+    bool written = false;
+
+    if (format == image_format::ppm || format == image_format::png)
+    {
+        std::vector<uint8_t> bytes;
+        tonemap_bytes(fb, settings, bytes, thread_count);
+        if (format == image_format::png)
+        {
+            written = stbi_write_png(partial.c_str(), fb.width, fb.height, 3, bytes.data(), fb.width * 3) != 0;
+        }
+        else
+        {
+            std::ofstream out(partial, std::ios::binary);
+            out << "P6\n" << fb.width << " " << fb.height << "\n255\n";
+            out.write(reinterpret_cast<const char*>(bytes.data()), static_cast<std::streamsize>(bytes.size()));
+            written = static_cast<bool>(out);
+        }
+    }
+    else
+    {
+        // PFM stores the bottom row first; a negative scale marks little endian data.
+        std::vector<float> values;
+        linear_floats(fb, settings.exposure, values, format == image_format::pfm, thread_count);
+        if (format == image_format::hdr)
+        {
+            written = stbi_write_hdr(partial.c_str(), fb.width, fb.height, 3, values.data()) != 0;
+        }
+        else
+        {
+            const uint16_t probe = 1;
+            const bool little_endian = *reinterpret_cast<const uint8_t*>(&probe) == 1;
+            std::ofstream out(partial, std::ios::binary);
+            out << "PF\n" << fb.width << " " << fb.height << "\n" << (little_endian ? "-1.0" : "1.0") << "\n";
+            out.write(reinterpret_cast<const char*>(values.data()), static_cast<std::streamsize>(values.size() * sizeof(float)));
+            written = static_cast<bool>(out);
+        }
+    }
+
+    std::error_code error;
+    if (written)
+        std::filesystem::rename(partial, path, error);
+    if (!written || error)
+    {
+        std::cerr << "Could not write " << path << "\n";
+        std::filesystem::remove(partial, error);
+        return false;
+    }
+    return true;
+}
+
+
+/* Output stage running on a thread of its own, double buffered: submit() copies the radiance of a
+   framebuffer into the back buffer and returns, while the writer thread encodes and writes the front buffer. Rendering goes on
+   during the encoding; only a submit that comes while the back buffer is still waiting for the writer
+   blocks, so at most two frames are held. */
+class image_writer
+{
+    public:
+        image_writer(int encode_threads, const tonemap_settings& tonemap)
+            : thread_count(std::max(1, encode_threads)), settings(tonemap), worker([this] { run(); })
+        {}
+
+        ~image_writer()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stop = true;
+            }
+            changed.notify_all();
+            worker.join();
+        }
+
+        // Queues the current state of fb for writing to path, in the format of its extension.
+        void submit(const framebuffer& fb, const std::string& path)
+        {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                changed.wait(lock, [this] { return !pending; });
+            }
+
+            // The writer leaves the back buffer alone while nothing is pending.
+            back.copy_radiance(fb);
+            back_path = path;
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                pending = true;
+            }
+            changed.notify_all();
+        }
+
+        // Blocks until every submitted frame is written.
+        void wait()
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            changed.wait(lock, [this] { return !pending && !busy; });
+        }
+
+        // Wall-clock time spent encoding and writing, and the number of images written.
+        double seconds() const { return write_seconds; }
+        int images() const { return images_written; }
+
+    private:
+        void run()
+        {
+            while (true)
+            {
+                std::string path;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    changed.wait(lock, [this] { return pending || stop; });
+                    if (!pending)
+                        return;
+                    std::swap(front, back);
+                    path.swap(back_path);
+                    pending = false;
+                    busy = true;
+                }
+                changed.notify_all();
+
+                const auto start = std::chrono::steady_clock::now();
+                image_format format;
+                bool written = false;
+                if (image_format_of(path, format))
+                    written = write_image(front, path, format, settings, thread_count);
+                else
+                    std::cerr << "Unknown image format " << path << "\n";
+                const std::chrono::duration<double> diff = std::chrono::steady_clock::now() - start;
+
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    write_seconds += diff.count();
+                    images_written += written;
+                    busy = false;
+                }
+                changed.notify_all();
+            }
+        }
+
+        const int thread_count;
+        const tonemap_settings settings;
+        framebuffer front;
+        framebuffer back;
+        std::string back_path;
+
+        std::mutex mutex;
+        std::condition_variable changed;
+        bool pending = false; // back holds a frame the writer has not taken yet
+        bool busy = false;    // the writer is writing front
+        bool stop = false;
+        double write_seconds = 0.0;
+        int images_written = 0;
+
+        std::thread worker; // last, so it starts after everything it uses
+};
@@ -0,0 +1,297 @@
+#pragma once
+
+#include "rtweekend.h"
+#include "hittable.h"
+#include "flat_bvh.h"
+#include "transform.h"
+
+#include <cstdint>
+#include <vector>
+
+
+/* Placement of a shared object (the bottom level: a bvh_node, a triangle_mesh, ...) in the world by an
+   affine transform. The ray is brought into object space with the cached inverse; its direction is not
+   normalized, so t is the same in both spaces. Normals go back with the inverse transpose, which
+   keeps the side they face, so front_face is taken over as the object reported it.
+   An instance costs two matrices and a box however large the object is. */
+class instance : public hittable
+{
+    public:
+        instance(shared_ptr<hittable> object, const affine_transform& object_to_world)
+            : ptr(object)
+        {
+            has_box = ptr->bounding_box(0, 1, object_box);
+            set_transform(object_to_world);
+        }
+
+        // Moves the instance. The object is not touched; a tlas holding the instance must be refit.
+        void set_transform(const affine_transform& object_to_world)
+        {
+            to_world = object_to_world;
+            to_object = object_to_world.inverse();
+            world_box = to_world.box(object_box);
+            rigid = to_world.is_rigid();
+            length_scale = static_cast<real>(std::cbrt(std::fabs(to_world.determinant())));
+        }
+
+        const affine_transform& transform() const { return to_world; }
+        const shared_ptr<hittable>& object() const { return ptr; }
+
+        virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const
+        {
+            RTW_COUNT_HIT();
+            const ray object_ray(to_object.point(r.origin()), to_object.vector(r.direction()), r.time());
+            if (!ptr->hit(object_ray, t_min, t_max, rec))
+                return false;
+
+            rec.p = to_world.point(rec.p);
+            // For a rotation the inverse transpose is the rotation itself, and it keeps the length.
+            rec.normal = rigid ? to_world.vector(rec.normal) : unit_vector(to_object.transpose_vector(rec.normal));
+            // Lengths grow by about the cube root of the volume scale, uv changes that much slower.
+            if (!rigid)
+                rec.uv_scale /= length_scale;
+            return true;
+        }
+
+        virtual bool bounding_box(double time0, double time1, aabb& output_box) const
+        {
+            output_box = world_box;
+            return has_box;
+        }
+
+    private:
+        shared_ptr<hittable> ptr;
+        affine_transform to_world;
+        affine_transform to_object;
+        aabb object_box;
+        aabb world_box;
+        bool has_box;
+        bool rigid;
+        real length_scale; // cube root of the volume scale of the transform
+};
+
+
+/* Top level acceleration structure: a BVH over instances, in the flat_bvh_node layout with one instance
+   per leaf. Moving instances only needs refit(), which recomputes the node boxes bottom up and keeps
+   the tree; the objects the instances refer to are not rebuilt. After large moves rebuild() gives a
+   better tree, still without touching the objects. */
+class tlas : public hittable
+{
+    public:
+        tlas() {}
+
+        explicit tlas(const std::vector<shared_ptr<instance>>& list)
+            : instances(list)
+        {
+            rebuild();
+        }
+
+        void add(shared_ptr<instance> inst) { instances.push_back(inst); }
+
+        void rebuild();
+        void refit();
+
+        virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const;
+
+        virtual bool bounding_box(double time0, double time1, aabb& output_box) const
+        {
+            if (instances.empty())
+                return false;
+            output_box = box;
+            return true;
+        }
+
+        size_t memory_bytes() const
+        {
+            return nodes.capacity() * sizeof(flat_bvh_node) + instances.capacity() * sizeof(shared_ptr<instance>)
+                + instances.size() * sizeof(instance);
+        }
+
+    public:
+        static const int stack_size = 64;
+
+        std::vector<shared_ptr<instance>> instances;
+        std::vector<flat_bvh_node> nodes;
+
+    private:
+        void build(std::vector<uint32_t>& order, const std::vector<aabb>& boxes, size_t start, size_t end, int level);
+        void set_bounds(uint32_t index, const aabb& bounds);
+
+        aabb box;
+};
+
+void tlas::set_bounds(uint32_t index, const aabb& bounds)
+{
+    for (int a = 0; a < 3; ++a)
+    {
+        nodes[index].bmin[a] = float_round_down(bounds.min()[a]);
+        nodes[index].bmax[a] = float_round_up(bounds.max()[a]);
+    }
+}
+
+void tlas::rebuild()
+{
+    nodes.clear();
+    if (instances.empty())
+        return;
+
+    std::vector<aabb> boxes(instances.size());
+    std::vector<uint32_t> order(instances.size());
+    for (uint32_t k = 0; k < instances.size(); ++k)
+    {
+        instances[k]->bounding_box(0, 1, boxes[k]);
+        order[k] = k;
+    }
+
+    nodes.reserve(2 * instances.size());
+    build(order, boxes, 0, order.size(), 1);
+
+    // Leaves refer to instances by position, so put them in leaf order.
+    std::vector<shared_ptr<instance>> sorted;
+    sorted.reserve(instances.size());
+    for (uint32_t k : order)
+        sorted.push_back(instances[k]);
+    instances.swap(sorted);
+
+    refit();
+}
+
+// Median split along the largest extent of the box centers. Node bounds are filled in by refit.
+void tlas::build(std::vector<uint32_t>& order, const std::vector<aabb>& boxes, size_t start, size_t end, int level)
+{
+    const auto index = static_cast<uint32_t>(nodes.size());
+    nodes.push_back(flat_bvh_node{});
+
+    if (end - start == 1 || level >= stack_size)
+    {
+        nodes[index].offset = static_cast<uint32_t>(start);
+        nodes[index].count = static_cast<uint16_t>(end - start);
+        return;
+    }
+
+    vec3 lo(infinity, infinity, infinity);
+    vec3 hi(-infinity, -infinity, -infinity);
+    for (size_t i = start; i < end; ++i)
+    {
+        const vec3 c = 0.5 * (boxes[order[i]].min() + boxes[order[i]].max());
+        for (int a = 0; a < 3; ++a)
+        {
+            lo[a] = std::min(lo[a], c[a]);
+            hi[a] = std::max(hi[a], c[a]);
+        }
+    }
+    int axis = 0;
+    for (int a = 1; a < 3; ++a)
+    {
+        if (hi[a] - lo[a] > hi[axis] - lo[axis])
+            axis = a;
+    }
+
+    const size_t mid = start + (end - start) / 2;
+    std::nth_element(order.begin() + start, order.begin() + mid, order.begin() + end,
+        [&](uint32_t a, uint32_t b) { return boxes[a].min()[axis] + boxes[a].max()[axis] < boxes[b].min()[axis] + boxes[b].max()[axis]; });
+
+    nodes[index].axis = static_cast<uint16_t>(axis);
+    build(order, boxes, start, mid, level + 1);
+    nodes[index].offset = static_cast<uint32_t>(nodes.size());
+    build(order, boxes, mid, end, level + 1);
+}
+
+// Children are stored after their parent, so one backwards pass sees every child before its parent.
+void tlas::refit()
+{
+    if (nodes.empty())
+        return;
+
+    std::vector<aabb> bounds(nodes.size());
+    for (size_t n = nodes.size(); n-- > 0;)
+    {
+        const flat_bvh_node& node = nodes[n];
+        if (node.count > 0)
+        {
+            instances[node.offset]->bounding_box(0, 1, bounds[n]);
+            for (uint32_t k = node.offset + 1; k < node.offset + node.count; ++k)
+            {
+                aabb b;
+                instances[k]->bounding_box(0, 1, b);
+                bounds[n] = surrounding_box(bounds[n], b);
+            }
+        }
+        else
+        {
+            bounds[n] = surrounding_box(bounds[n + 1], bounds[node.offset]);
+        }
+        set_bounds(static_cast<uint32_t>(n), bounds[n]);
+    }
+    box = bounds[0];
+}
+
+bool tlas::hit(const ray& r, real t_min, real t_max, hit_record& rec) const
+{
+    RTW_COUNT_HIT();
+    if (nodes.empty())
+        return false;
+
+    const vec3 origin = r.origin();
+    const vec3& inv_dir = r.inv_dir;
+    const int* dir_neg = r.sign;
+
+    uint32_t stack[stack_size];
+    int stack_top = 0;
+    uint32_t index = 0;
+
+    bool hit_anything = false;
+    real closest_so_far = t_max;
+
+    while (true)
+    {
+        const flat_bvh_node& node = nodes[index];
+
+        real t0 = t_min;
+        real t1 = closest_so_far;
+        for (int a = 0; a < 3; ++a)
+        {
+            const real near_plane = dir_neg[a] ? node.bmax[a] : node.bmin[a];
+            const real far_plane = dir_neg[a] ? node.bmin[a] : node.bmax[a];
+            const real tn = (near_plane - origin[a]) * inv_dir[a];
+            const real tf = (far_plane - origin[a]) * inv_dir[a];
+            t0 = tn > t0 ? tn : t0;
+            t1 = tf < t1 ? tf : t1;
+        }
+
+        if (t0 <= t1)
+        {
+            if (node.count > 0)
+            {
+                for (uint32_t k = node.offset; k < node.offset + node.count; ++k)
+                {
+                    if (instances[k]->hit(r, t_min, closest_so_far, rec))
+                    {
+                        hit_anything = true;
+                        closest_so_far = rec.t;
+                    }
+                }
+            }
+            else
+            {
+                if (dir_neg[node.axis])
+                {
+                    stack[stack_top++] = index + 1;
+                    index = node.offset;
+                }
+                else
+                {
+                    stack[stack_top++] = node.offset;
+                    index = index + 1;
+                }
+                continue;
+            }
+        }
+
+        if (stack_top == 0)
+            break;
+        index = stack[--stack_top];
+    }
+
+    return hit_anything;
+}
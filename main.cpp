@@ -1,6 +1,8 @@
 #include <fstream>
 #include <chrono>
-#include <ppl.h>
+#include <cstring>
+#include <string>
+#include <thread>
 
 #include "rtweekend.h"
 #include "bvh.h"
@@ -13,7 +15,35 @@
 #include "rtw_stb_image.h"
 #include "box.h"
 #include "constant_medium.h"
+#include "renderer.h"
+#include "benchmark.h"
+#include "flat_bvh.h"
+#include "wide_bvh.h"
+#include "ray_packet.h"
+#include "wavefront.h"
+#include "triangle_mesh.h"
+#include "obj_loader.h"
+#include "instance.h"
+#include "scene_compile.h"
+#include "image_output.h"
+#include "checkpoint.h"
+
+
+vec3 ray_color(const ray& r, const vec3& background, const hittable &world, int depth);
+
+// Light leaving the hit point rec in the direction of r's origin: emission plus scattered light.
+vec3 shade_hit(const ray& r, const hit_record& rec, const vec3& background, const hittable& world, int depth)
+{
+    ray scattered;
+    vec3 attenuation;
+    vec3 emitted = rec.mat_ptr->emitted(rec.u, rec.v, rec.p);
 
+    if (!rec.mat_ptr->scatter(r, rec, attenuation, scattered))
+        return emitted;
+    rec.continue_cone(r, scattered);
+
+    return emitted + attenuation * ray_color(scattered, background, world, depth - 1);
+}
 
 vec3 ray_color(const ray& r, const vec3& background, const hittable &world, int depth)
 {
@@ -23,18 +53,11 @@ vec3 ray_color(const ray& r, const vec3& background, const hittable &world, int
     if (depth <= 0)
         return Color::black;
 
-    // use 0.001 (epsilon) instead of 0 to avoid shadow acne (in this case leads to exception (don't know why))
-    if (!world.hit(r, epsilon, infinity, rec))
+    // use ray_epsilon (0.001 in double precision) instead of 0 to avoid shadow acne (in this case leads to exception (don't know why))
+    if (!world.hit(r, ray_epsilon(r), infinity, rec))
         return background;
 
-    ray scattered;
-    vec3 attenuation;
-    vec3 emitted = rec.mat_ptr->emitted(rec.u, rec.v, rec.p);
-
-    if (!rec.mat_ptr->scatter(r, rec, attenuation, scattered))
-        return emitted;
-
-    return emitted + attenuation * ray_color(scattered, background, world, depth - 1);
+    return shade_hit(r, rec, background, world, depth);
 
     //else
     //{
@@ -46,20 +69,65 @@ vec3 ray_color(const ray& r, const vec3& background, const hittable &world, int
 }
 
 
+/* Iterative version of ray_color that keeps the product of all attenuations so far (the throughput)
+   explicitly. After rr_min_depth bounces, Russian roulette ends the path with probability 1 - p,
+   p being the largest throughput component; surviving paths are divided by p, so the estimate stays
+   unbiased while paths that can hardly contribute anymore stop early. rays counts the traced rays. */
+vec3 ray_color_iterative(ray r, const vec3& background, const hittable& world, int max_depth, int rr_min_depth,
+    long long& rays)
+{
+    vec3 radiance = Color::black;
+    vec3 throughput(1, 1, 1);
+
+    for (int depth = 0; depth < max_depth; ++depth)
+    {
+        hit_record rec;
+        ++rays;
+
+        if (!world.hit(r, ray_epsilon(r), infinity, rec))
+            return radiance + throughput * background;
+
+        radiance += throughput * rec.mat_ptr->emitted(rec.u, rec.v, rec.p);
+
+        ray scattered;
+        vec3 attenuation;
+        if (!rec.mat_ptr->scatter(r, rec, attenuation, scattered))
+            return radiance;
+        rec.continue_cone(r, scattered);
+
+        throughput = throughput * attenuation;
+        r = scattered;
+
+        if (depth + 1 >= rr_min_depth)
+        {
+            const double p = std::max(throughput.x(), std::max(throughput.y(), throughput.z()));
+            if (p < 1.0)
+            {
+                if (random_double() >= p)
+                    return radiance;
+                throughput /= p;
+            }
+        }
+    }
+
+    return radiance;
+}
+
+
 hittable_list random_scene()
 {
     hittable_list world;
 
     // Lambertian big sphere as "world"
-    //world.add(make_shared<sphere>(vec3(0, -1000, 0), 1000, make_shared<lambertian>(make_shared<constant_texture>(vec3(0.5, 0.5, 0.5)))));
+    //world.add(scene_make<sphere>(vec3(0, -1000, 0), 1000, scene_make<lambertian>(scene_make<constant_texture>(vec3(0.5, 0.5, 0.5)))));
 
-    auto checker = make_shared<checker_texture>(
-        make_shared<constant_texture>(vec3(0.2, 0.3, 0.1)),
-        make_shared<constant_texture>(vec3(0.9, 0.9, 0.9))
+    auto checker = scene_make<checker_texture>(
+        scene_make<constant_texture>(vec3(0.2, 0.3, 0.1)),
+        scene_make<constant_texture>(vec3(0.9, 0.9, 0.9))
     );
 
     // Checker sphere as world
-    world.add(make_shared<sphere>(vec3(0, -1000, 0), 1000, make_shared<lambertian>(checker)));
+    world.add(scene_make<sphere>(vec3(0, -1000, 0), 1000, scene_make<lambertian>(checker)));
 
     int i = 1;
     for (int a = -12; a < 12; a++)
@@ -73,8 +141,8 @@ hittable_list random_scene()
                 // perlin marble
                 if (choose_mat < 0.3)
                 {
-                    auto pertext = make_shared<noise_texture>(4);
-                    world.add(make_shared<sphere>(center, 0.2, make_shared<lambertian>(pertext)));
+                    auto pertext = scene_make<noise_texture>(4);
+                    world.add(scene_make<sphere>(center, 0.2, scene_make<lambertian>(pertext)));
                 }
                 // diffuse
                 if (choose_mat < 0.8)
@@ -82,59 +150,53 @@ hittable_list random_scene()
                     auto albedo = vec3::random() * vec3::random();
                     auto rnd = random_double();
                     if (rnd < 0.5)
-                        world.add(make_shared<sphere>(center, 0.2, make_shared<lambertian>(make_shared<constant_texture>(albedo))));
+                        world.add(scene_make<sphere>(center, 0.2, scene_make<lambertian>(scene_make<constant_texture>(albedo))));
                     else
-                        world.add(make_shared<moving_sphere>(center, center + vec3(0, random_double(0, 0.5), 0), 0.0, 1.0, 0.2, make_shared<lambertian>(make_shared<constant_texture>(albedo))));
+                        world.add(scene_make<moving_sphere>(center, center + vec3(0, random_double(0, 0.5), 0), 0.0, 1.0, 0.2, scene_make<lambertian>(scene_make<constant_texture>(albedo))));
                 }
                 // metal
                 else if (choose_mat < 0.95)
                 {
                     auto albedo = vec3::random(0.5, 1);
                     auto fuzz = random_double(0, 0.5);
-                    world.add(make_shared<sphere>(center, 0.2, make_shared<metal>(albedo, fuzz)));
+                    world.add(scene_make<sphere>(center, 0.2, scene_make<metal>(albedo, fuzz)));
                 }
                 // glass
                 else
                 {
-                    world.add(make_shared<sphere>(center, 0.2, make_shared<dielectric>(1.5)));
+                    world.add(scene_make<sphere>(center, 0.2, scene_make<dielectric>(1.5)));
                 }
             }
         }
     }
 
-    int nx;
-    int ny;
-    int nn;
-    unsigned char* texture_data = stbi_load("earthmap.jpg", &nx, &ny, &nn, 0);
-
-    auto earth_surface =
-        make_shared<lambertian>(make_shared<image_texture>(texture_data, nx, ny));
-    world.add(make_shared<sphere>(vec3(3, 0.5, -1), 0.5, earth_surface));
+    auto earth_surface = scene_make<lambertian>(scene_make<image_texture>("earthmap.jpg"));
+    world.add(scene_make<sphere>(vec3(3, 0.5, -1), 0.5, earth_surface));
 
-    auto pertext = make_shared<noise_texture>(4);
-    world.add(make_shared<sphere>(vec3(0, 1, 2), 1.0, make_shared<lambertian>(pertext)));
+    auto pertext = scene_make<noise_texture>(4);
+    world.add(scene_make<sphere>(vec3(0, 1, 2), 1.0, scene_make<lambertian>(pertext)));
 
-    world.add(make_shared<sphere>(vec3(0, 1, 0), 1.0, make_shared<dielectric>(1.5)));
+    world.add(scene_make<sphere>(vec3(0, 1, 0), 1.0, scene_make<dielectric>(1.5)));
     
-    world.add(make_shared<sphere>(vec3(0, 1, -2), 1.0, make_shared<metal>(vec3(0.7, 0.6, 0.5), 0.0)));
-    world.add(make_shared<sphere>(vec3(0, 1, -4), 1.0, make_shared<lambertian>(make_shared<constant_texture>(vec3(0.1, 0.2, 0.5)))));
+    world.add(scene_make<sphere>(vec3(0, 1, -2), 1.0, scene_make<metal>(vec3(0.7, 0.6, 0.5), 0.0)));
+    world.add(scene_make<sphere>(vec3(0, 1, -4), 1.0, scene_make<lambertian>(scene_make<constant_texture>(vec3(0.1, 0.2, 0.5)))));
 
 
     //return world;
-    return hittable_list(make_shared<bvh_node>(world, 0.0, 1.0));
+    return hittable_list(scene_make<bvh_node>(world, 0.0, 1.0));
 }
 
 hittable_list two_spheres()
 {
     hittable_list objects;
 
-    auto checker = make_shared<checker_texture>(
-        make_shared<constant_texture>(vec3(0.2, 0.3, 0.1)),
-        make_shared<constant_texture>(vec3(0.9, 0.9, 0.9))
+    auto checker = scene_make<checker_texture>(
+        scene_make<constant_texture>(vec3(0.2, 0.3, 0.1)),
+        scene_make<constant_texture>(vec3(0.9, 0.9, 0.9))
     );
 
-    objects.add(make_shared<sphere>(vec3(0, -10, 0), 10, make_shared<lambertian>(checker)));
-    objects.add(make_shared<sphere>(vec3(0, 10, 0), 10, make_shared<lambertian>(checker)));
+    objects.add(scene_make<sphere>(vec3(0, -10, 0), 10, scene_make<lambertian>(checker)));
+    objects.add(scene_make<sphere>(vec3(0, 10, 0), 10, scene_make<lambertian>(checker)));
 
     return objects;
 }
@@ -143,23 +205,17 @@ hittable_list two_perlin_spheres()
 {
     hittable_list objects;
 
-    auto pertext = make_shared<noise_texture>(4);
-    objects.add(make_shared<sphere>(vec3(0, -1000, 0), 1000, make_shared<lambertian>(pertext)));
-    objects.add(make_shared<sphere>(vec3(0, 2, 0), 2, make_shared<lambertian>(pertext)));
+    auto pertext = scene_make<noise_texture>(4);
+    objects.add(scene_make<sphere>(vec3(0, -1000, 0), 1000, scene_make<lambertian>(pertext)));
+    objects.add(scene_make<sphere>(vec3(0, 2, 0), 2, scene_make<lambertian>(pertext)));
 
     return objects;
 }
 
 hittable_list earth()
 {
-    int nx;
-    int ny;
-    int nn;
-    unsigned char* texture_data = stbi_load("earthmap.jpg", &nx, &ny, &nn, 0);
-
-    auto earth_surface =
-        make_shared<lambertian>(make_shared<image_texture>(texture_data, nx, ny));
-    auto globe = make_shared<sphere>(vec3(0, 0, 0), 2, earth_surface);
+    auto earth_surface = scene_make<lambertian>(scene_make<image_texture>("earthmap.jpg"));
+    auto globe = scene_make<sphere>(vec3(0, 0, 0), 2, earth_surface);
 
     return hittable_list(globe);
 }
@@ -168,13 +224,13 @@ hittable_list simple_light()
 {
     hittable_list objects;
 
-    auto pertext = make_shared<noise_texture>(4);
-    objects.add(make_shared<sphere>(vec3(0, -1000, 0), 1000, make_shared<lambertian>(pertext)));
-    objects.add(make_shared<sphere>(vec3(0, 2, 0), 2, make_shared<lambertian>(pertext)));
+    auto pertext = scene_make<noise_texture>(4);
+    objects.add(scene_make<sphere>(vec3(0, -1000, 0), 1000, scene_make<lambertian>(pertext)));
+    objects.add(scene_make<sphere>(vec3(0, 2, 0), 2, scene_make<lambertian>(pertext)));
 
-    auto difflight = make_shared<diffuse_light>(make_shared<constant_texture>(vec3(4, 4, 4)));
-    objects.add(make_shared<sphere>(vec3(0, 7, 0), 2, difflight));
-    objects.add(make_shared<xy_rect>(3, 5, 1, 3, -2, difflight));
+    auto difflight = scene_make<diffuse_light>(scene_make<constant_texture>(vec3(4, 4, 4)));
+    objects.add(scene_make<sphere>(vec3(0, 7, 0), 2, difflight));
+    objects.add(scene_make<xy_rect>(3, 5, 1, 3, -2, difflight));
 
     return objects;
 }
@@ -183,26 +239,26 @@ hittable_list cornell_box()
 {
     hittable_list objects;
 
-    auto red = make_shared<lambertian>(make_shared<constant_texture>(vec3(0.65, 0.05, 0.05)));
-    auto white = make_shared<lambertian>(make_shared<constant_texture>(vec3(0.73, 0.73, 0.73)));
-    auto green = make_shared<lambertian>(make_shared<constant_texture>(vec3(0.12, 0.45, 0.15)));
-    auto light = make_shared<diffuse_light>(make_shared<constant_texture>(vec3(15, 15, 15)));
-
-    objects.add(make_shared<flip_face>(make_shared<yz_rect>(0, 555, 0, 555, 555, green))); // left
-    objects.add(make_shared<yz_rect>(0, 555, 0, 555, 0, red)); // right
-    objects.add(make_shared<xz_rect>(213, 343, 227, 332, 554, light)); // 213, 343, 227, 332, 554  // 120, 420, 120, 420, 554
-    objects.add(make_shared<flip_face>(make_shared<xz_rect>(0, 555, 0, 555, 555, white))); // top
-    objects.add(make_shared<xz_rect>(0, 555, 0, 555, 0, white)); // bottom
-    objects.add(make_shared<flip_face>(make_shared<xy_rect>(0, 555, 0, 555, 555, white))); // back
-
-    shared_ptr<hittable> box1 = make_shared<box>(vec3(0, 0, 0), vec3(165, 330, 165), white);
-    box1 = make_shared<rotate_y>(box1, 15);
-    box1 = make_shared<translate>(box1, vec3(265, 0, 295));
+    auto red = scene_make<lambertian>(scene_make<constant_texture>(vec3(0.65, 0.05, 0.05)));
+    auto white = scene_make<lambertian>(scene_make<constant_texture>(vec3(0.73, 0.73, 0.73)));
+    auto green = scene_make<lambertian>(scene_make<constant_texture>(vec3(0.12, 0.45, 0.15)));
+    auto light = scene_make<diffuse_light>(scene_make<constant_texture>(vec3(15, 15, 15)));
+
+    objects.add(scene_make<flip_face>(scene_make<yz_rect>(0, 555, 0, 555, 555, green))); // left
+    objects.add(scene_make<yz_rect>(0, 555, 0, 555, 0, red)); // right
+    objects.add(scene_make<xz_rect>(213, 343, 227, 332, 554, light)); // 213, 343, 227, 332, 554  // 120, 420, 120, 420, 554
+    objects.add(scene_make<flip_face>(scene_make<xz_rect>(0, 555, 0, 555, 555, white))); // top
+    objects.add(scene_make<xz_rect>(0, 555, 0, 555, 0, white)); // bottom
+    objects.add(scene_make<flip_face>(scene_make<xy_rect>(0, 555, 0, 555, 555, white))); // back
+
+    shared_ptr<hittable> box1 = scene_make<box>(vec3(0, 0, 0), vec3(165, 330, 165), white);
+    box1 = scene_make<rotate_y>(box1, 15);
+    box1 = scene_make<translate>(box1, vec3(265, 0, 295));
     objects.add(box1);
 
-    shared_ptr<hittable> box2 = make_shared<box>(vec3(0, 0, 0), vec3(165, 165, 165), white);
-    box2 = make_shared<rotate_y>(box2, -18);
-    box2 = make_shared<translate>(box2, vec3(130, 0, 65));
+    shared_ptr<hittable> box2 = scene_make<box>(vec3(0, 0, 0), vec3(165, 165, 165), white);
+    box2 = scene_make<rotate_y>(box2, -18);
+    box2 = scene_make<translate>(box2, vec3(130, 0, 65));
     objects.add(box2);
     
     return objects;
@@ -212,33 +268,33 @@ hittable_list cornell_balls()
 {
     hittable_list objects;
 
-    auto pertext = make_shared<noise_texture>(4);
-    auto perlin = make_shared<lambertian>(pertext);
+    auto pertext = scene_make<noise_texture>(4);
+    auto perlin = scene_make<lambertian>(pertext);
 
-    auto red = make_shared<lambertian>(make_shared<constant_texture>(vec3(0.65, 0.05, 0.05)));
-    auto white = make_shared<lambertian>(make_shared<constant_texture>(vec3(0.73, 0.73, 0.73)));
-    auto green = make_shared<lambertian>(make_shared<constant_texture>(vec3(0.12, 0.45, 0.15)));
-    auto light = make_shared<diffuse_light>(make_shared<constant_texture>(vec3(5, 5, 5)));
+    auto red = scene_make<lambertian>(scene_make<constant_texture>(vec3(0.65, 0.05, 0.05)));
+    auto white = scene_make<lambertian>(scene_make<constant_texture>(vec3(0.73, 0.73, 0.73)));
+    auto green = scene_make<lambertian>(scene_make<constant_texture>(vec3(0.12, 0.45, 0.15)));
+    auto light = scene_make<diffuse_light>(scene_make<constant_texture>(vec3(5, 5, 5)));
 
-    objects.add(make_shared<flip_face>(make_shared<yz_rect>(0, 555, 0, 555, 555, green)));
-    objects.add(make_shared<yz_rect>(0, 555, 0, 555, 0, red));
-    objects.add(make_shared<xz_rect>(113, 443, 127, 432, 554, light));
-    objects.add(make_shared<flip_face>(make_shared<xz_rect>(0, 555, 0, 555, 555, white)));
-    objects.add(make_shared<xz_rect>(0, 555, 0, 555, 0, white));
-    objects.add(make_shared<flip_face>(make_shared<xy_rect>(0, 555, 0, 555, 555, white)));
+    objects.add(scene_make<flip_face>(scene_make<yz_rect>(0, 555, 0, 555, 555, green)));
+    objects.add(scene_make<yz_rect>(0, 555, 0, 555, 0, red));
+    objects.add(scene_make<xz_rect>(113, 443, 127, 432, 554, light));
+    objects.add(scene_make<flip_face>(scene_make<xz_rect>(0, 555, 0, 555, 555, white)));
+    objects.add(scene_make<xz_rect>(0, 555, 0, 555, 0, white));
+    objects.add(scene_make<flip_face>(scene_make<xy_rect>(0, 555, 0, 555, 555, white)));
 
-    auto boundary = make_shared<sphere>(vec3(160, 100, 145), 100, make_shared<dielectric>(1.5));
+    auto boundary = scene_make<sphere>(vec3(160, 100, 145), 100, scene_make<dielectric>(1.5));
     objects.add(boundary);
-    objects.add(make_shared<constant_medium>(
-        boundary, 0.01, make_shared<constant_texture>(vec3(0.12, 0.12, 0.5))
+    objects.add(scene_make<constant_medium>(
+        boundary, 0.01, scene_make<constant_texture>(vec3(0.12, 0.12, 0.5))
         ));
 
-    auto boundary2 = make_shared<sphere>(vec3(380, 100, 50), 100, make_shared<dielectric>(1.5));
+    auto boundary2 = scene_make<sphere>(vec3(380, 100, 50), 100, scene_make<dielectric>(1.5));
     objects.add(boundary2);
 
-    shared_ptr<hittable> box1 = make_shared<box>(vec3(0, 0, 0), vec3(165, 330, 165), white);
-    box1 = make_shared<rotate_y>(box1, 15);
-    box1 = make_shared<translate>(box1, vec3(265, 0, 295));
+    shared_ptr<hittable> box1 = scene_make<box>(vec3(0, 0, 0), vec3(165, 330, 165), white);
+    box1 = scene_make<rotate_y>(box1, 15);
+    box1 = scene_make<translate>(box1, vec3(265, 0, 295));
     objects.add(box1);
 
     return objects;
@@ -248,28 +304,28 @@ hittable_list cornell_smoke()
 {
     hittable_list objects;
 
-    auto red = make_shared<lambertian>(make_shared<constant_texture>(vec3(0.65, 0.05, 0.05)));
-    auto white = make_shared<lambertian>(make_shared<constant_texture>(vec3(0.73, 0.73, 0.73)));
-    auto green = make_shared<lambertian>(make_shared<constant_texture>(vec3(0.12, 0.45, 0.15)));
-    auto light = make_shared<diffuse_light>(make_shared<constant_texture>(vec3(7, 7, 7)));
+    auto red = scene_make<lambertian>(scene_make<constant_texture>(vec3(0.65, 0.05, 0.05)));
+    auto white = scene_make<lambertian>(scene_make<constant_texture>(vec3(0.73, 0.73, 0.73)));
+    auto green = scene_make<lambertian>(scene_make<constant_texture>(vec3(0.12, 0.45, 0.15)));
+    auto light = scene_make<diffuse_light>(scene_make<constant_texture>(vec3(7, 7, 7)));
 
-    objects.add(make_shared<flip_face>(make_shared<yz_rect>(0, 555, 0, 555, 555, green))); // left
-    objects.add(make_shared<yz_rect>(0, 555, 0, 555, 0, red)); // right
-    objects.add(make_shared<xz_rect>(113, 443, 127, 432, 554, light));
-    objects.add(make_shared<flip_face>(make_shared<xz_rect>(0, 555, 0, 555, 555, white))); // top
-    objects.add(make_shared<xz_rect>(0, 555, 0, 555, 0, white)); // bottom
-    objects.add(make_shared<flip_face>(make_shared<xy_rect>(0, 555, 0, 555, 555, white))); // back
+    objects.add(scene_make<flip_face>(scene_make<yz_rect>(0, 555, 0, 555, 555, green))); // left
+    objects.add(scene_make<yz_rect>(0, 555, 0, 555, 0, red)); // right
+    objects.add(scene_make<xz_rect>(113, 443, 127, 432, 554, light));
+    objects.add(scene_make<flip_face>(scene_make<xz_rect>(0, 555, 0, 555, 555, white))); // top
+    objects.add(scene_make<xz_rect>(0, 555, 0, 555, 0, white)); // bottom
+    objects.add(scene_make<flip_face>(scene_make<xy_rect>(0, 555, 0, 555, 555, white))); // back
 
-    shared_ptr<hittable> box1 = make_shared<box>(vec3(0, 0, 0), vec3(165, 330, 165), white);
-    box1 = make_shared<rotate_y>(box1, 15);
-    box1 = make_shared<translate>(box1, vec3(265, 0, 295));
+    shared_ptr<hittable> box1 = scene_make<box>(vec3(0, 0, 0), vec3(165, 330, 165), white);
+    box1 = scene_make<rotate_y>(box1, 15);
+    box1 = scene_make<translate>(box1, vec3(265, 0, 295));
 
-    shared_ptr<hittable> box2 = make_shared<box>(vec3(0, 0, 0), vec3(165, 165, 165), white);
-    box2 = make_shared<rotate_y>(box2, -18);
-    box2 = make_shared<translate>(box2, vec3(130, 0, 65));
+    shared_ptr<hittable> box2 = scene_make<box>(vec3(0, 0, 0), vec3(165, 165, 165), white);
+    box2 = scene_make<rotate_y>(box2, -18);
+    box2 = scene_make<translate>(box2, vec3(130, 0, 65));
 
-    objects.add(make_shared<constant_medium>(box1, 0.01, make_shared<constant_texture>(vec3(0, 0, 0))));
-    objects.add(make_shared<constant_medium>(box2, 0.01, make_shared<constant_texture>(vec3(1, 1, 1))));
+    objects.add(scene_make<constant_medium>(box1, 0.01, scene_make<constant_texture>(vec3(0, 0, 0))));
+    objects.add(scene_make<constant_medium>(box2, 0.01, scene_make<constant_texture>(vec3(1, 1, 1))));
 
     return objects;
 }
@@ -278,34 +334,31 @@ hittable_list cornell_final()
 {
     hittable_list objects;
 
-    auto pertext = make_shared<noise_texture>(0.1);
-
-    int nx, ny, nn;
-    unsigned char* tex_data = stbi_load("earthmap.jpg", &nx, &ny, &nn, 0);
+    auto pertext = scene_make<noise_texture>(0.1);
 
-    auto mat = make_shared<lambertian>(make_shared<image_texture>(tex_data, nx, ny));
+    auto mat = scene_make<lambertian>(scene_make<image_texture>("earthmap.jpg"));
 
-    auto red = make_shared<lambertian>(make_shared<constant_texture>(vec3(0.65, 0.05, 0.05)));
-    auto white = make_shared<lambertian>(make_shared<constant_texture>(vec3(0.73, 0.73, 0.73)));
-    auto green = make_shared<lambertian>(make_shared<constant_texture>(vec3(0.12, 0.45, 0.15)));
-    auto light = make_shared<diffuse_light>(make_shared<constant_texture>(vec3(7, 7, 7)));
+    auto red = scene_make<lambertian>(scene_make<constant_texture>(vec3(0.65, 0.05, 0.05)));
+    auto white = scene_make<lambertian>(scene_make<constant_texture>(vec3(0.73, 0.73, 0.73)));
+    auto green = scene_make<lambertian>(scene_make<constant_texture>(vec3(0.12, 0.45, 0.15)));
+    auto light = scene_make<diffuse_light>(scene_make<constant_texture>(vec3(7, 7, 7)));
 
-    objects.add(make_shared<flip_face>(make_shared<yz_rect>(0, 555, 0, 555, 555, green)));
-    objects.add(make_shared<yz_rect>(0, 555, 0, 555, 0, red));
-    objects.add(make_shared<xz_rect>(123, 423, 147, 412, 554, light));
-    objects.add(make_shared<flip_face>(make_shared<xz_rect>(0, 555, 0, 555, 555, white)));
-    objects.add(make_shared<xz_rect>(0, 555, 0, 555, 0, white));
-    objects.add(make_shared<flip_face>(make_shared<xy_rect>(0, 555, 0, 555, 555, white)));
+    objects.add(scene_make<flip_face>(scene_make<yz_rect>(0, 555, 0, 555, 555, green)));
+    objects.add(scene_make<yz_rect>(0, 555, 0, 555, 0, red));
+    objects.add(scene_make<xz_rect>(123, 423, 147, 412, 554, light));
+    objects.add(scene_make<flip_face>(scene_make<xz_rect>(0, 555, 0, 555, 555, white)));
+    objects.add(scene_make<xz_rect>(0, 555, 0, 555, 0, white));
+    objects.add(scene_make<flip_face>(scene_make<xy_rect>(0, 555, 0, 555, 555, white)));
 
     shared_ptr<hittable> boundary2 =
-        make_shared<box>(vec3(0, 0, 0), vec3(165, 165, 165), make_shared<dielectric>(1.5));
-    boundary2 = make_shared<rotate_y>(boundary2, -18);
-    boundary2 = make_shared<translate>(boundary2, vec3(130, 0, 65));
+        scene_make<box>(vec3(0, 0, 0), vec3(165, 165, 165), scene_make<dielectric>(1.5));
+    boundary2 = scene_make<rotate_y>(boundary2, -18);
+    boundary2 = scene_make<translate>(boundary2, vec3(130, 0, 65));
 
-    auto tex = make_shared<constant_texture>(vec3(0.9, 0.9, 0.9));
+    auto tex = scene_make<constant_texture>(vec3(0.9, 0.9, 0.9));
 
     objects.add(boundary2);
-    objects.add(make_shared<constant_medium>(boundary2, 0.2, tex));
+    objects.add(scene_make<constant_medium>(boundary2, 0.2, tex));
 
     return objects;
 }
@@ -313,7 +366,7 @@ hittable_list cornell_final()
 hittable_list final_scene()
 {
     hittable_list boxes1;
-    auto ground = make_shared<lambertian>(make_shared<constant_texture>(vec3(0.48, 0.83, 0.53)));
+    auto ground = scene_make<lambertian>(scene_make<constant_texture>(vec3(0.48, 0.83, 0.53)));
 
     const int boxes_per_side = 20;
     for (int i = 0; i < boxes_per_side; ++i)
@@ -328,80 +381,190 @@ hittable_list final_scene()
             auto y1 = random_double(1, 101);
             auto z1 = z0 + w;
 
-            boxes1.add(make_shared<box>(vec3(x0, y0, z0), vec3(x1, y1, z1), ground));
+            boxes1.add(scene_make<box>(vec3(x0, y0, z0), vec3(x1, y1, z1), ground));
         }
     }
 
     hittable_list objects;
 
-    objects.add(make_shared<bvh_node>(boxes1, 0, 1));
+    objects.add(scene_make<bvh_node>(boxes1, 0, 1));
 
-    auto light = make_shared<diffuse_light>(make_shared<constant_texture>(vec3(7, 7, 7)));
-    objects.add(make_shared<xz_rect>(123, 423, 147, 412, 554, light));
+    auto light = scene_make<diffuse_light>(scene_make<constant_texture>(vec3(7, 7, 7)));
+    objects.add(scene_make<xz_rect>(123, 423, 147, 412, 554, light));
 
     auto center1 = vec3(400, 400, 200);
     auto center2 = center1 + vec3(30, 0, 0);
     auto moving_sphere_material =
-        make_shared<lambertian>(make_shared<constant_texture>(vec3(0.7, 0.3, 0.1)));
-    objects.add(make_shared<moving_sphere>(center1, center2, 0, 1, 50, moving_sphere_material));
+        scene_make<lambertian>(scene_make<constant_texture>(vec3(0.7, 0.3, 0.1)));
+    objects.add(scene_make<moving_sphere>(center1, center2, 0, 1, 50, moving_sphere_material));
 
-    objects.add(make_shared<sphere>(vec3(260, 150, 45), 50, make_shared<dielectric>(1.5)));
-    objects.add(make_shared<sphere>(vec3(0, 150, 145), 50, make_shared<metal>(vec3(0.8, 0.8, 0.9), 10.0)));
+    objects.add(scene_make<sphere>(vec3(260, 150, 45), 50, scene_make<dielectric>(1.5)));
+    objects.add(scene_make<sphere>(vec3(0, 150, 145), 50, scene_make<metal>(vec3(0.8, 0.8, 0.9), 10.0)));
 
-    auto boundary = make_shared<sphere>(vec3(360, 150, 145), 70, make_shared<dielectric>(1.5));
+    auto boundary = scene_make<sphere>(vec3(360, 150, 145), 70, scene_make<dielectric>(1.5));
     objects.add(boundary);
-    objects.add(make_shared<constant_medium>(boundary, 0.2, make_shared<constant_texture>(vec3(0.2, 0.4, 0.9))));
+    objects.add(scene_make<constant_medium>(boundary, 0.2, scene_make<constant_texture>(vec3(0.2, 0.4, 0.9))));
 
-    boundary = make_shared<sphere>(vec3(0, 0, 0), 5000, make_shared<dielectric>(1.5));
-    objects.add(make_shared<constant_medium>(boundary, 0.0001, make_shared<constant_texture>(vec3(1, 1, 1))));
+    boundary = scene_make<sphere>(vec3(0, 0, 0), 5000, scene_make<dielectric>(1.5));
+    objects.add(scene_make<constant_medium>(boundary, 0.0001, scene_make<constant_texture>(vec3(1, 1, 1))));
 
-    int nx;
-    int ny;
-    int nn;
-    auto tex_data = stbi_load("earthmap.jpg", &nx, &ny, &nn, 0);
-    auto emat = make_shared<lambertian>(make_shared<image_texture>(tex_data, nx, ny));
-    objects.add(make_shared<sphere>(vec3(400, 200, 400), 100, emat));
+    auto emat = scene_make<lambertian>(scene_make<image_texture>("earthmap.jpg"));
+    objects.add(scene_make<sphere>(vec3(400, 200, 400), 100, emat));
 
-    auto pertext = make_shared<noise_texture>(0.1);
-    objects.add(make_shared<sphere>(vec3(220, 280, 300), 80, make_shared<lambertian>(pertext)));
+    auto pertext = scene_make<noise_texture>(0.1);
+    objects.add(scene_make<sphere>(vec3(220, 280, 300), 80, scene_make<lambertian>(pertext)));
 
     hittable_list boxes2;
-    auto white = make_shared<lambertian>(make_shared<constant_texture>(vec3(0.73, 0.73, 0.73)));
+    auto white = scene_make<lambertian>(scene_make<constant_texture>(vec3(0.73, 0.73, 0.73)));
     int ns = 1000;
     for (int j = 0; j < ns; ++j)
     {
-        boxes2.add(make_shared<sphere>(vec3::random(0, 165), 10, white));
+        boxes2.add(scene_make<sphere>(vec3::random(0, 165), 10, white));
     }
 
-    objects.add(make_shared<translate>(make_shared<rotate_y>(make_shared<bvh_node>(boxes2, 0.0, 1.0), 15), vec3(-100, 270, 395)));
+    objects.add(scene_make<translate>(scene_make<rotate_y>(scene_make<bvh_node>(boxes2, 0.0, 1.0), 15), vec3(-100, 270, 395)));
 
     return objects;
 }
 
-int main()
+// Torus around the y axis with vertex normals and uvs, as indexed mesh data. Triangles are counter-clockwise seen from outside.
+shared_ptr<mesh_data> make_torus(real major_radius, real minor_radius, int rings, int sides)
 {
-    auto start = std::chrono::system_clock::now();
-    std::ofstream output;
-    output.open("picture.ppm");
+    auto mesh = scene_make<mesh_data>();
+    for (int i = 0; i <= rings; ++i)
+    {
+        const real phi = 2 * pi * i / rings;
+        for (int j = 0; j <= sides; ++j)
+        {
+            const real theta = 2 * pi * j / sides;
+            const vec3 normal(cos(theta) * cos(phi), sin(theta), cos(theta) * sin(phi));
+            const vec3 center(major_radius * cos(phi), 0, major_radius * sin(phi));
+            mesh->positions.push_back(center + minor_radius * normal);
+            mesh->normals.push_back(normal);
+            mesh->uvs.push_back(mesh_uv{ real(i) / rings, real(j) / sides });
+        }
+    }
 
-    const int image_width = 600;
-    const int image_height = 600;
-    const int samples_per_pixel = 100;
-    const int max_depth = 50;
+    for (int i = 0; i < rings; ++i)
+    {
+        for (int j = 0; j < sides; ++j)
+        {
+            const uint32_t a = i * (sides + 1) + j;
+            const uint32_t b = a + sides + 1;
+            mesh->position_indices.insert(mesh->position_indices.end(), { a, b + 1, b, a, a + 1, b + 1 });
+        }
+    }
+    mesh->normal_indices = mesh->position_indices;
+    mesh->uv_indices = mesh->position_indices;
+    return mesh;
+}
+
+// Scales and moves the mesh so that its largest extent is `size` and it stands centered on `base`.
+void fit_mesh(mesh_data& mesh, const vec3& base, real size)
+{
+    vec3 lo(infinity, infinity, infinity);
+    vec3 hi(-infinity, -infinity, -infinity);
+    for (const auto& p : mesh.positions)
+    {
+        for (int a = 0; a < 3; ++a)
+        {
+            lo[a] = std::min(lo[a], p[a]);
+            hi[a] = std::max(hi[a], p[a]);
+        }
+    }
 
-    const auto aspect_ratio = double(image_width) / double(image_height);  
+    const real extent = std::max({ hi.x() - lo.x(), hi.y() - lo.y(), hi.z() - lo.z() });
+    if (!(extent > 0))
+        return;
+    const vec3 bottom(0.5 * (lo.x() + hi.x()), lo.y(), 0.5 * (lo.z() + hi.z()));
+    for (auto& p : mesh.positions)
+        p = base + (size / extent) * (p - bottom);
+}
 
+// OBJ file shown by mesh_scene instead of the built-in torus, set with --obj.
+std::string mesh_scene_obj;
 
+hittable_list mesh_scene()
+{
+    hittable_list objects;
 
-    // hittable *list[5];
-    // list[0] = new sphere(vec3(0,0,-1), 0.5, new lambertian(vec3(0.1, 0.2, 0.5))); //(0.8, 0.3, 0.3
-    // list[1] = new sphere(vec3(0,-100.5,-1), 100, new lambertian(vec3(0.8, 0.8, 0.0)));
-    // list[2] = new sphere(vec3(1,0,-1), 0.5, new metal(vec3(0.8, 0.6, 0.2)));
-    // list[3] = new sphere(vec3(-1, 0, -1), 0.5, new dielectric(1.5));
-    // list[4] = new sphere(vec3(-1, 0, -1), -0.45, new dielectric(1.5));
-    // hittable *world = new hittable_list(list, 5);
+    auto red = scene_make<lambertian>(scene_make<constant_texture>(vec3(0.65, 0.05, 0.05)));
+    auto white = scene_make<lambertian>(scene_make<constant_texture>(vec3(0.73, 0.73, 0.73)));
+    auto green = scene_make<lambertian>(scene_make<constant_texture>(vec3(0.12, 0.45, 0.15)));
+    auto light = scene_make<diffuse_light>(scene_make<constant_texture>(vec3(15, 15, 15)));
+
+    objects.add(scene_make<flip_face>(scene_make<yz_rect>(0, 555, 0, 555, 555, green)));
+    objects.add(scene_make<yz_rect>(0, 555, 0, 555, 0, red));
+    objects.add(scene_make<xz_rect>(213, 343, 227, 332, 554, light));
+    objects.add(scene_make<flip_face>(scene_make<xz_rect>(0, 555, 0, 555, 555, white)));
+    objects.add(scene_make<xz_rect>(0, 555, 0, 555, 0, white));
+    objects.add(scene_make<flip_face>(scene_make<xy_rect>(0, 555, 0, 555, 555, white)));
+
+    shared_ptr<mesh_data> mesh;
+    if (!mesh_scene_obj.empty())
+        mesh = load_obj(mesh_scene_obj);
+    if (mesh == nullptr || mesh->triangle_count() == 0)
+        mesh = make_torus(2, 0.8, 192, 96);
+    fit_mesh(*mesh, vec3(278, 0, 278), 350);
+
+    std::cout << "Mesh: " << mesh->triangle_count() << " triangles, " << mesh->positions.size() << " vertices, "
+              << mesh->memory_bytes() / 1024.0 << " KiB\n";
+
+    objects.add(scene_make<triangle_mesh>(mesh, scene_make<metal>(vec3(0.8, 0.85, 0.88), 0.05)));
+    return objects;
+}
 
-    
+// A grid of copies of two shared objects, a cluster of spheres and a torus mesh, each copy an instance
+// under one tlas. Every copy is turned and scaled differently.
+hittable_list instanced_scene()
+{
+    hittable_list objects;
+
+    auto checker = scene_make<checker_texture>(
+        scene_make<constant_texture>(vec3(0.2, 0.3, 0.1)),
+        scene_make<constant_texture>(vec3(0.9, 0.9, 0.9)));
+    objects.add(scene_make<sphere>(vec3(0, -10000, 0), 10000, scene_make<lambertian>(checker)));
+
+    hittable_list spheres;
+    for (int k = 0; k < 1000; ++k)
+    {
+        auto albedo = vec3::random(0.1, 0.9);
+        shared_ptr<material> mat = random_double() < 0.3
+            ? shared_ptr<material>(scene_make<metal>(albedo, 0.2))
+            : shared_ptr<material>(scene_make<lambertian>(scene_make<constant_texture>(albedo)));
+        spheres.add(scene_make<sphere>(vec3::random(-1, 1) * 4 + vec3(0, 5, 0), 0.5, mat));
+    }
+    shared_ptr<hittable> cluster = scene_make<bvh_node>(spheres, 0.0, 1.0);
+
+    shared_ptr<hittable> torus = scene_make<triangle_mesh>(make_torus(4, 1.5, 96, 48),
+        scene_make<metal>(vec3(0.85, 0.7, 0.4), 0.1));
+
+    auto top = scene_make<tlas>();
+    const int per_side = 8;
+    for (int i = 0; i < per_side; ++i)
+    {
+        for (int j = 0; j < per_side; ++j)
+        {
+            const vec3 position(20.0 * (i - per_side / 2), 0, 20.0 * (j - per_side / 2));
+            const double scale = random_double(0.6, 1.2);
+            const auto placement = affine_transform::translation(position + vec3(0, (i + j) % 2 ? 1.5 * scale : 0, 0))
+                * affine_transform::rotation(vec3(0, 1, 0), random_double(0, 360))
+                * affine_transform::rotation(vec3(1, 0, 0), (i + j) % 2 ? 0.0 : 20.0)
+                * affine_transform::scaling(vec3(scale, scale, scale));
+            top->add(scene_make<instance>((i + j) % 2 ? torus : cluster, placement));
+        }
+    }
+    top->rebuild();
+    objects.add(top);
+
+    return objects;
+}
+
+// Builds scene number `scene` and the camera looking at it.
+hittable_list select_scene(int scene, double aspect_ratio, camera& cam, vec3& background)
+{
+    // Same random numbers for the scene content on every call.
+    rng_seed(0, 0);
 
     vec3 lookfrom(13, 2, 3);
     vec3 lookat(0, 0, 0);
@@ -409,10 +572,10 @@ int main()
     auto dist_to_focus = 10; //(lookfrom-lookat).length();
     auto aperture = 0.0;
     auto vfov = 20.0;
-    vec3 background(Color::black);
-    auto world = random_scene();
+    background = Color::black;
+    hittable_list world;
 
-    switch (10)
+    switch (scene)
     {
     case 1:
         world = random_scene();
@@ -487,42 +650,437 @@ int main()
         lookat = vec3(278, 278, 0);
         vfov = 40.0;
         break;
-    }
 
+    case 11:
+        world = mesh_scene();
+        lookfrom = vec3(278, 278, -800);
+        lookat = vec3(278, 278, 0);
+        vfov = 40.0;
+        break;
 
+    case 12:
+        world = instanced_scene();
+        lookfrom = vec3(60, 60, -110);
+        lookat = vec3(-10, 0, 0);
+        vfov = 40.0;
+        background = vec3(0.70, 0.80, 1.00);
+        break;
+    }
 
-    output << "P3\n" << image_width << " " << image_height << "\n255\n";
+    cam = camera(lookfrom, lookat, vup, vfov, aspect_ratio, aperture, dist_to_focus, 0.0, 1.0);
+    return world;
+}
 
-    camera cam(lookfrom, lookat, vup, vfov, aspect_ratio, aperture, dist_to_focus, 0.0, 1.0);
-    
-    int percent = image_height / 100;
-    
-    for (int j = image_height - 1; j >= 0; --j)
+// Renders one tile, tracing every camera sample on its own. radiance(r) returns the light arriving along r.
+template <typename Integrator>
+void render_tile(const tile& t, const render_settings& settings, const camera& cam, framebuffer& fb,
+    Integrator radiance)
+{
+    const bool moments = fb.has_moments();
+    for (int j = t.y0; j < t.y1; ++j)
     {
-        if (j % percent == 0)
-        {
-            int print_percent = std::abs((j - image_height) / percent);
-            std::cout << print_percent << "% done. \n";
-        }
-        for (int i = 0; i < image_width; ++i)
+        for (int i = t.x0; i < t.x1; ++i)
         {
             vec3 color;
+            vec3 squares;
 
             // Number of rays per pixel
-            concurrency::parallel_for(int(0), samples_per_pixel, [&](int s)
-            //for (int s = 0; s < samples_per_pixel; ++s)
+            for (int s = settings.first_sample; s < settings.first_sample + settings.samples_per_pixel; ++s)
             {
-                auto u = (i + random_double()) / image_width;
-                auto v = (j + random_double()) / image_height;
+                rng_seed(static_cast<uint64_t>(j) * settings.image_width + i, s);
+                auto u = (i + random_double()) / settings.image_width;
+                auto v = (j + random_double()) / settings.image_height;
                 ray r = cam.get_ray(u, v);
-                color += ray_color(r, background, world, max_depth);
-            }); 
+                const vec3 sample = radiance(r);
+                color += sample;
+                if (moments)
+                    squares += sample * sample;
+            }
+
+            fb.add(fb.index(i, j), color, squares, settings.samples_per_pixel);
+        }
+    }
+}
+
+// Renders one tile, tracing the camera samples of N horizontally neighbouring pixels as one packet.
+// After the first hit every lane continues on its own through ray_color.
+template <int N>
+void render_tile_packets(const tile& t, const render_settings& settings, const camera& cam, const flat_bvh& world,
+    const vec3& background, framebuffer& fb)
+{
+    const bool moments = fb.has_moments();
+    for (int j = t.y0; j < t.y1; ++j)
+    {
+        for (int i0 = t.x0; i0 < t.x1; i0 += N)
+        {
+            vec3 color[N];
+            vec3 squares[N];
+
+            for (int s = settings.first_sample; s < settings.first_sample + settings.samples_per_pixel; ++s)
+            {
+                ray_packet<N> packet;
+                for (int k = 0; k < N && i0 + k < t.x1; ++k)
+                {
+                    const int i = i0 + k;
+                    rng_seed(static_cast<uint64_t>(j) * settings.image_width + i, s);
+                    auto u = (i + random_double()) / settings.image_width;
+                    auto v = (j + random_double()) / settings.image_height;
+                    packet.rays[k] = cam.get_ray(u, v);
+                    packet.rng[k] = rng_current;
+                    packet.active |= 1 << k;
+                }
+
+                hit_record rec[N];
+                const int hit_mask = packet_hit(world, packet, infinity, rec);
+
+                for (int k = 0; k < N && i0 + k < t.x1; ++k)
+                {
+                    rng_current = packet.rng[k];
+                    const vec3 sample = ((hit_mask >> k) & 1)
+                        ? shade_hit(packet.rays[k], rec[k], background, world, settings.max_depth)
+                        : background;
+                    color[k] += sample;
+                    if (moments)
+                        squares[k] += sample * sample;
+                }
+            }
+
+            for (int k = 0; k < N && i0 + k < t.x1; ++k)
+                fb.add(fb.index(i0 + k, j), color[k], squares[k], settings.samples_per_pixel);
+        }
+    }
+}
+
+int main(int argc, char** argv)
+{
+    auto start = std::chrono::system_clock::now();
+
+    int image_width = 600;
+    int image_height = 600;
+    int samples_per_pixel = 100;
+    const int max_depth = 50;
+    int scene = 10;
+    int thread_count = static_cast<int>(std::thread::hardware_concurrency());
+    int tile_size = 16;
+    std::string bench;
+    std::string accel = "bvh4";
+    int packet_size = 0;
+    std::string integrator = "recursive";
+    int rr_min_depth = 3;
+    bool use_arena = true;
+    bool huge_pages = false;
+    bool compile = true;
+    std::string reference;
+    std::string output_path = "picture.ppm";
+    tonemap_settings tonemap;
+    bool moments = false;
+    int pass_samples = 0;
+    std::string checkpoint_path;
+    double checkpoint_interval = 0.0;
+    bool resume = false;
+
+    // Command line: --scene N --width N --height N --spp N --threads N --tile N --bvh median|sah
+    //               --accel tree|flat|bvh4|bvh8 --packet 0|4|8|16
+    //               --integrator recursive|iterative|wavefront --rr-depth N
+    //               --arena 0|1 --huge-pages 0|1 --sphere-batch 0|1 --box-batch 0|1
+    //               --reference FILE.ppm --obj FILE.obj (shown by scene 11) --compile 0|1
+    //               --output FILE.ppm|png|pfm|hdr --exposure STOPS --tonemap clamp|reinhard|aces
+    //               --moments 0|1 --pass-spp N (samples per progressive pass, default all; 4 with --checkpoint)
+    //               --checkpoint FILE --checkpoint-interval SECONDS --resume 0|1
+    //               --texels unorm8|bc1|bc7|half|float --texture-filter nearest|bilinear --mipmap 0|1
+    //               --bench rng|vec3|box|boxes|output|images|textures|arena|instances|compile|bvh|packet|threads
+    for (int a = 1; a + 1 < argc; a += 2)
+    {
+        const int value = std::atoi(argv[a + 1]);
+        if (std::strcmp(argv[a], "--bench") == 0) bench = argv[a + 1];
+        else if (std::strcmp(argv[a], "--scene") == 0) scene = value;
+        else if (std::strcmp(argv[a], "--width") == 0) image_width = value;
+        else if (std::strcmp(argv[a], "--height") == 0) image_height = value;
+        else if (std::strcmp(argv[a], "--spp") == 0) samples_per_pixel = value;
+        else if (std::strcmp(argv[a], "--threads") == 0) thread_count = value;
+        else if (std::strcmp(argv[a], "--tile") == 0) tile_size = value;
+        else if (std::strcmp(argv[a], "--accel") == 0) accel = argv[a + 1];
+        else if (std::strcmp(argv[a], "--packet") == 0) packet_size = value;
+        else if (std::strcmp(argv[a], "--integrator") == 0) integrator = argv[a + 1];
+        else if (std::strcmp(argv[a], "--rr-depth") == 0) rr_min_depth = value;
+        else if (std::strcmp(argv[a], "--arena") == 0) use_arena = value != 0;
+        else if (std::strcmp(argv[a], "--sphere-batch") == 0) sphere_batching = value != 0;
+        else if (std::strcmp(argv[a], "--box-batch") == 0) box_batching = value != 0;
+        else if (std::strcmp(argv[a], "--huge-pages") == 0) huge_pages = value != 0;
+        else if (std::strcmp(argv[a], "--reference") == 0) reference = argv[a + 1];
+        else if (std::strcmp(argv[a], "--output") == 0) output_path = argv[a + 1];
+        else if (std::strcmp(argv[a], "--exposure") == 0) tonemap.exposure = std::atof(argv[a + 1]);
+        else if (std::strcmp(argv[a], "--tonemap") == 0) tonemap.op = std::strcmp(argv[a + 1], "reinhard") == 0 ? tone_operator::reinhard
+            : std::strcmp(argv[a + 1], "aces") == 0 ? tone_operator::aces : tone_operator::clamp;
+        else if (std::strcmp(argv[a], "--moments") == 0) moments = value != 0;
+        else if (std::strcmp(argv[a], "--pass-spp") == 0) pass_samples = value;
+        else if (std::strcmp(argv[a], "--checkpoint") == 0) checkpoint_path = argv[a + 1];
+        else if (std::strcmp(argv[a], "--checkpoint-interval") == 0) checkpoint_interval = std::atof(argv[a + 1]);
+        else if (std::strcmp(argv[a], "--resume") == 0) resume = value != 0;
+        else if (std::strcmp(argv[a], "--texels") == 0) default_texel_format = std::strcmp(argv[a + 1], "half") == 0 ? texel_format::half
+            : std::strcmp(argv[a + 1], "float") == 0 ? texel_format::float32 : std::strcmp(argv[a + 1], "bc1") == 0 ? texel_format::bc1
+            : std::strcmp(argv[a + 1], "bc7") == 0 ? texel_format::bc7 : texel_format::unorm8;
+        else if (std::strcmp(argv[a], "--mipmap") == 0) default_mipmaps = value != 0;
+        else if (std::strcmp(argv[a], "--texture-filter") == 0) default_texture_filter = std::strcmp(argv[a + 1], "bilinear") == 0 ? texture_filter::bilinear : texture_filter::nearest;
+        else if (std::strcmp(argv[a], "--obj") == 0) mesh_scene_obj = argv[a + 1];
+        else if (std::strcmp(argv[a], "--compile") == 0) compile = value != 0;
+        else if (std::strcmp(argv[a], "--bvh") == 0) bvh_default_split = std::strcmp(argv[a + 1], "sah") == 0 ? bvh_split::sah : bvh_split::random_axis_median;
+        else std::cerr << "Unknown option " << argv[a] << "\n";
+    }
+    thread_count = std::max(thread_count, 1);
+
+    image_format output_format;
+    if (!image_format_of(output_path, output_format))
+    {
+        std::cerr << "Unknown image format " << output_path << ": use .ppm, .png, .pfm or .hdr\n";
+        return 1;
+    }
+
+    // Only the recursive integrator traces packets, and only in these sizes.
+    if (packet_size != 0 && packet_size != 4 && packet_size != 8 && packet_size != 16)
+    {
+        std::cerr << "Unsupported packet size " << packet_size << ": use 0, 4, 8 or 16\n";
+        return 1;
+    }
+    if (packet_size > 0 && integrator != "recursive")
+    {
+        std::cerr << "--packet " << packet_size << " needs --integrator recursive, not " << integrator << "\n";
+        return 1;
+    }
+
+    if (bench == "rng")
+    {
+        benchmark_rng(thread_count);
+        return 0;
+    }
+
+    if (bench == "vec3")
+    {
+        benchmark_vec3();
+        return 0;
+    }
+
+    if (bench == "box")
+    {
+        benchmark_box();
+        return 0;
+    }
+
+    const auto aspect_ratio = double(image_width) / double(image_height);
+
+    camera cam;
+    vec3 background;
+
+    if (bench == "boxes")
+    {
+        benchmark_boxes(10000);
+        return 0;
+    }
+
+    if (bench == "output")
+    {
+        benchmark_output(3840, 2160, thread_count);
+        return 0;
+    }
+
+    if (bench == "images")
+    {
+        benchmark_images("earthmap.jpg", 4);
+        return 0;
+    }
 
-            color.write_color(output, samples_per_pixel);
+    if (bench == "arena")
+    {
+        benchmark_arena("final_scene", cam, [&]() { return select_scene(10, aspect_ratio, cam, background); });
+        return 0;
+    }
+
+    // Scene objects and BVH nodes are allocated from one arena. It is declared before everything that
+    // points into it, so it is destroyed last and releases all of that memory at once.
+    scene_arena arena(size_t(1) << 20, huge_pages);
+    if (use_arena)
+        current_scene_arena = &arena;
+
+    if (bench == "instances")
+    {
+        benchmark_instances(64);
+        return 0;
+    }
+
+    if (bench == "bvh")
+    {
+        // Scenes are rebuilt per strategy so that their nested BVHs use it as well.
+        for (auto split : { bvh_split::random_axis_median, bvh_split::sah })
+        {
+            bvh_default_split = split;
+            auto scene_world = select_scene(1, aspect_ratio, cam, background);
+            benchmark_bvh("random_scene", scene_world, cam, split);
+            scene_world = select_scene(10, aspect_ratio, cam, background);
+            benchmark_bvh("final_scene", scene_world, cam, split);
+        }
+        return 0;
+    }
+
+    if (bench == "compile")
+    {
+        benchmark_compile("cornell_box", select_scene(6, aspect_ratio, cam, background), cam);
+        benchmark_compile("cornell_final", select_scene(9, aspect_ratio, cam, background), cam);
+        benchmark_compile("final_scene", select_scene(10, aspect_ratio, cam, background), cam);
+        return 0;
+    }
+
+    if (bench == "textures")
+    {
+        benchmark_textures("earth", select_scene(4, aspect_ratio, cam, background), cam, "earthmap.jpg");
+        return 0;
+    }
+
+    if (bench == "packet")
+    {
+        benchmark_packets("cornell_box", select_scene(6, aspect_ratio, cam, background), cam);
+        benchmark_packets("random_scene", select_scene(1, aspect_ratio, cam, background), cam);
+        return 0;
+    }
+
+    auto scene_world = select_scene(scene, aspect_ratio, cam, background);
+
+    // Camera rays carry the footprint of a sample, so textures are read at the level of detail it covers.
+    if (default_mipmaps)
+        cam.set_pixel_footprint(image_height, samples_per_pixel);
+
+    const image_cache& images = image_cache::global();
+    if (images.request_count() > 0)
+        std::cout << "Images: " << images.file_count() << " files for " << images.request_count() << " textures\n";
+
+    // Transform chains become single instances and flip_face wrappers flags, before the accelerator is built.
+    if (compile)
+    {
+        scene_compile_stats stats;
+        scene_world = compile_scene(scene_world, stats);
+        print_compile_stats(std::cout, stats);
+    }
+
+    // Packets traverse the flat BVH, the rays that continue on their own use the same one.
+    if (packet_size > 0)
+        accel = "flat";
+
+    // Everything is traced through one acceleration structure over the whole scene.
+    shared_ptr<hittable> accelerator;
+    if (accel == "tree")
+        accelerator = scene_make<bvh_node>(scene_world, 0.0, 1.0);
+    else if (accel == "flat")
+        accelerator = scene_make<flat_bvh>(scene_world, 0.0, 1.0);
+    else if (accel == "bvh8")
+        accelerator = scene_make<wide_bvh<8>>(scene_world, 0.0, 1.0);
+    else
+        accelerator = scene_make<wide_bvh<4>>(scene_world, 0.0, 1.0);
+    const hittable& world = *accelerator;
+    print_precision(std::cout, arena.bytes_used());
+
+
+    // Radiance sums of all samples, row 0 is the bottom row of the image.
+    framebuffer fb(image_width, image_height, moments);
+
+    // Set for each progressive pass.
+    render_settings settings{ image_width, image_height, samples_per_pixel, max_depth, rr_min_depth };
+    auto packet_world = dynamic_cast<const flat_bvh*>(accelerator.get());
+
+    auto kernel = [&](const tile& t, worker_stats& stats)
+    {
+        if (integrator == "wavefront")
+            render_tile_wavefront(t, settings, cam, world, background, fb);
+        else if (integrator == "iterative")
+            render_tile(t, settings, cam, fb, [&](const ray& r)
+            {
+                return ray_color_iterative(r, background, world, settings.max_depth, settings.rr_min_depth, stats.rays);
+            });
+        else if (packet_size == 4)
+            render_tile_packets<4>(t, settings, cam, *packet_world, background, fb);
+        else if (packet_size == 8)
+            render_tile_packets<8>(t, settings, cam, *packet_world, background, fb);
+        else if (packet_size == 16)
+            render_tile_packets<16>(t, settings, cam, *packet_world, background, fb);
+        else
+            render_tile(t, settings, cam, fb, [&](const ray& r) { return ray_color(r, background, world, settings.max_depth); });
+
+        stats.samples += static_cast<long long>(t.x1 - t.x0) * (t.y1 - t.y0) * settings.samples_per_pixel;
+    };
+
+    if (bench == "threads")
+    {
+        benchmark_threads(image_width, image_height, tile_size, kernel);
+        return 0;
+    }
+
+    // With a checkpoint the samples done so far are on disk after every pass (or every checkpoint_interval
+    // seconds), and --resume 1 goes on from there.
+    render_checkpoint checkpoint;
+    int samples_done = 0;
+    if (!checkpoint_path.empty())
+    {
+        const render_identity id{ image_width, image_height, scene, max_depth, moments ? 1u : 0u, samples_per_pixel,
+            integrator == "wavefront" ? 2u : integrator == "iterative" ? 1u : 0u, rr_min_depth, compile ? 1u : 0u,
+            default_mipmaps ? 1u : 0u, static_cast<uint32_t>(default_texel_format), static_cast<uint32_t>(default_texture_filter) };
+        if (resume && checkpoint.open(checkpoint_path, id))
+        {
+            samples_done = checkpoint.restore(fb);
+            std::cout << "Resuming " << checkpoint_path << " after " << samples_done << " samples per pixel\n";
+        }
+        else if (resume && std::ifstream(checkpoint_path).good())
+        {
+            // Not silently overwritten: it may be the checkpoint of another render.
+            return 1;
+        }
+        else if (!checkpoint.create(checkpoint_path, id))
+        {
+            return 1;
+        }
+        if (pass_samples <= 0)
+            pass_samples = 4;
+    }
+    if (pass_samples <= 0)
+        pass_samples = samples_per_pixel;
+
+    // Progressive passes. The image of every pass goes to the output stage, which writes it while the next
+    // pass renders.
+    tile_renderer renderer(image_width, image_height, tile_size, thread_count);
+    image_writer writer(thread_count, tonemap);
+    auto last_checkpoint = std::chrono::steady_clock::now();
+    bool submitted = false;
+    while (samples_done < samples_per_pixel)
+    {
+        settings.first_sample = samples_done;
+        settings.samples_per_pixel = std::min(pass_samples, samples_per_pixel - samples_done);
+        renderer.run(kernel);
+        samples_done += settings.samples_per_pixel;
+
+        const auto now = std::chrono::steady_clock::now();
+        const bool last = samples_done == samples_per_pixel;
+        if (!checkpoint_path.empty() && (last || std::chrono::duration<double>(now - last_checkpoint).count() >= checkpoint_interval))
+        {
+            if (!checkpoint.save(fb, samples_done))
+                std::cerr << "Could not write checkpoint " << checkpoint_path << "\n";
+            last_checkpoint = now;
         }
+
+        if (pass_samples < samples_per_pixel)
+            std::cout << "Pass done: " << samples_done << " of " << samples_per_pixel << " samples per pixel\n";
+        writer.submit(fb, output_path);
+        submitted = true;
     }
+    // A resumed render may have all its samples already.
+    if (!submitted)
+        writer.submit(fb, output_path);
+    renderer.print_stats(std::cout);
+
+    if (fb.has_moments())
+        std::cout << "Mean relative standard error of the pixel luminance: " << fb.mean_relative_error() << "\n";
+
+    writer.wait();
+    std::cout << "Output: " << writer.images() << " images written to " << output_path << " in " << writer.seconds() << " s\n";
 
-    output.close();
+    if (!reference.empty())
+        print_image_error(std::cout, output_path, reference);
     auto end = std::chrono::system_clock::now();
     std::chrono::duration<double> diff = end-start;
     std::cout << "Total time: " << diff.count() << " s\n";
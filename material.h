@@ -34,8 +34,8 @@ class lambertian : public material
         virtual bool scatter(const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered) const
         {
             vec3 target = rec.p + rec.normal + random_in_unit_sphere();
-            scattered = ray(rec.p, target-rec.p, r_in.time());
-            attenuation = albedo->value(rec.u, rec.v, rec.p);
+            scattered = rec.spawn_ray(target-rec.p, r_in.time());
+            attenuation = albedo->value(rec.u, rec.v, rec.p, rec.texture_footprint(r_in));
             return true;
         }
 
@@ -53,7 +53,7 @@ class metal : public material
         virtual bool scatter(const ray& r_in, const hit_record& rec, vec3& attenuation, ray& scattered) const
         {
             vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
-            scattered = ray(rec.p, reflected + fuzz*random_in_unit_sphere());
+            scattered = rec.spawn_ray(reflected + fuzz*random_in_unit_sphere());
             attenuation = albedo;
             // See definition of dot product: If dot product > 0 -> angle is sharp (spitzer Winkel)
             return (dot(scattered.direction(), rec.normal) > 0);
@@ -81,7 +81,7 @@ class dielectric : public material
             if (etai_over_etat * sin_theta > 1.0)
             {
                 vec3 reflected = reflect(unit_direction, rec.normal);
-                scattered = ray(rec.p, reflected);
+                scattered = rec.spawn_ray(reflected);
                 return true;
             }
 
@@ -89,12 +89,12 @@ class dielectric : public material
             if (random_double() < reflect_prob)
             {
                 vec3 reflected = reflect(unit_direction, rec.normal);
-                scattered = ray(rec.p, reflected);
+                scattered = rec.spawn_ray(reflected);
                 return true;
             }
 
             vec3 refracted = refract(unit_direction, rec.normal, etai_over_etat);
-            scattered = ray(rec.p, refracted);
+            scattered = rec.spawn_ray(refracted);
             return true;
         }
 
@@ -7,66 +7,64 @@ class moving_sphere : public hittable
 {
 	public:
 		moving_sphere() {}
-		moving_sphere(vec3 cen0, vec3 cen1, double t0, double t1, double r, shared_ptr<material> m)
+		moving_sphere(vec3 cen0, vec3 cen1, real t0, real t1, real r, shared_ptr<material> m)
 			: center0(cen0), center1(cen1), time0(t0), time1(t1), radius(r), mat_ptr(m)
 		{}
 
-		virtual bool hit(const ray& r, double tmin, double tmax, hit_record& rec) const;
+		virtual bool hit(const ray& r, real tmin, real tmax, hit_record& rec) const;
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const;
 
-		vec3 center(double time) const;
+		vec3 center(real time) const;
 
 
 	public:
 		vec3 center0; // center at time0
 		vec3 center1; // center at time1
-		double time0;
-		double time1;
-		double radius;
+		real time0;
+		real time1;
+		real radius;
 		shared_ptr<material> mat_ptr;
 };
 
 // Center moves linearly from center0 at time0 to center1 at time1
-vec3 moving_sphere::center(double time) const
+vec3 moving_sphere::center(real time) const
 {
 	return center0 + ((time - time0) / (time1 - time0)) * (center1 - center0);
 }
 
-bool moving_sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+bool moving_sphere::hit(const ray& r, real t_min, real t_max, hit_record& rec) const
 {
+    RTW_COUNT_HIT();
     vec3 oc = r.origin() - center(r.time());
-    double a = r.direction().length_squared();
-    double half_b = dot(oc, r.direction());
-    double c = oc.length_squared() - radius * radius;
-    double discriminant = half_b * half_b - a * c;
+    real t_near, t_far;
 
-    if (discriminant > 0)
+    if (sphere_roots(oc, r.direction(), radius, t_near, t_far))
     {
-        double root = sqrt(discriminant);
-
-        double temp = (-half_b - root) / a;
+        real temp = t_near;
         if (temp < t_max && temp > t_min)
         {
             rec.t = temp;
             rec.p = r.at(rec.t);
             vec3 outward_normal = (rec.p - center(r.time())) / radius;
             rec.set_face_normal(r, outward_normal);
-            rec.mat_ptr = mat_ptr;
+            rec.mat_ptr = mat_ptr.get();
 
             // get uv coordinates (expects things on the unit sphere (divided by radius) centered at the origin (minus center))
             get_sphere_uv((rec.p - center(r.time())) / radius, rec.u, rec.v);
+            rec.uv_scale = sphere_uv_scale(outward_normal, radius);
             return true;
         }
 
-        temp = (-half_b + root) / a;
+        temp = t_far;
         if (temp < t_max && temp > t_min)
         {
             rec.t = temp;
             rec.p = r.at(rec.t);
             vec3 outward_normal = (rec.p - center(r.time())) / radius;
             rec.set_face_normal(r, outward_normal);
-            rec.mat_ptr = mat_ptr;
+            rec.mat_ptr = mat_ptr.get();
             get_sphere_uv((rec.p - center(r.time())) / radius, rec.u, rec.v);
+            rec.uv_scale = sphere_uv_scale(outward_normal, radius);
             return true;
         }
     }
@@ -0,0 +1,187 @@
+#pragma once
+
+#include "rtweekend.h"
+#include "triangle_mesh.h"
+
+#include <cctype>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+
+// One corner of an OBJ face: indices into the position, uv and normal lists, no_index where absent.
+struct obj_corner
+{
+    uint32_t position;
+    uint32_t uv;
+    uint32_t normal;
+};
+
+// Resolves a 1-based (or, if negative, relative to the end) OBJ index against a list of size count.
+inline uint32_t obj_resolve_index(long index, size_t count)
+{
+    const long resolved = index > 0 ? index - 1 : static_cast<long>(count) + index;
+    if (index == 0 || resolved < 0 || resolved >= static_cast<long>(count))
+        return mesh_data::no_index;
+    return static_cast<uint32_t>(resolved);
+}
+
+/* Parses one face corner, "v", "v/vt", "v//vn" or "v/vt/vn", at s. Advances s past it.
+   Returns false if the position index is missing or out of range. */
+inline bool obj_parse_corner(const char*& s, const mesh_data& mesh, obj_corner& corner)
+{
+    char* end;
+    corner.position = obj_resolve_index(std::strtol(s, &end, 10), mesh.positions.size());
+    if (end == s || corner.position == mesh_data::no_index)
+        return false;
+    s = end;
+
+    corner.uv = mesh_data::no_index;
+    corner.normal = mesh_data::no_index;
+    if (*s == '/')
+    {
+        ++s;
+        if (*s != '/')
+        {
+            corner.uv = obj_resolve_index(std::strtol(s, &end, 10), mesh.uvs.size());
+            s = end;
+        }
+        if (*s == '/')
+        {
+            ++s;
+            corner.normal = obj_resolve_index(std::strtol(s, &end, 10), mesh.normals.size());
+            s = end;
+        }
+    }
+
+    // Skip whatever else belongs to this corner, e.g. a malformed index.
+    while (*s != '\0' && !std::isspace(static_cast<unsigned char>(*s)))
+        ++s;
+    return true;
+}
+
+/* Appends triangle a b c to mesh. A triangle without normals or uvs in a mesh that has them elsewhere
+   gets no_index; the index buffer of an attribute is created when the first triangle uses it. */
+inline void obj_add_triangle(mesh_data& mesh, const obj_corner& a, const obj_corner& b, const obj_corner& c)
+{
+    const size_t before = mesh.position_indices.size();
+    mesh.position_indices.insert(mesh.position_indices.end(), { a.position, b.position, c.position });
+
+    const bool has_normals = a.normal != mesh_data::no_index && b.normal != mesh_data::no_index && c.normal != mesh_data::no_index;
+    if (has_normals && mesh.normal_indices.empty())
+        mesh.normal_indices.resize(before, mesh_data::no_index);
+    if (!mesh.normal_indices.empty())
+    {
+        if (has_normals)
+            mesh.normal_indices.insert(mesh.normal_indices.end(), { a.normal, b.normal, c.normal });
+        else
+            mesh.normal_indices.resize(before + 3, mesh_data::no_index);
+    }
+
+    const bool has_uvs = a.uv != mesh_data::no_index && b.uv != mesh_data::no_index && c.uv != mesh_data::no_index;
+    if (has_uvs && mesh.uv_indices.empty())
+        mesh.uv_indices.resize(before, mesh_data::no_index);
+    if (!mesh.uv_indices.empty())
+    {
+        if (has_uvs)
+            mesh.uv_indices.insert(mesh.uv_indices.end(), { a.uv, b.uv, c.uv });
+        else
+            mesh.uv_indices.resize(before + 3, mesh_data::no_index);
+    }
+}
+
+/* Streaming Wavefront OBJ loader: the file is read line by line into one reused buffer, and vertices
+   and faces go straight into the buffers of a mesh_data. Polygons are split into triangle fans.
+   Only v, vt, vn and f are read; groups, materials and smoothing groups are ignored.
+   Faces that refer to a vertex that does not exist are skipped with a warning.
+   Returns nullptr if the file can't be opened. */
+shared_ptr<mesh_data> load_obj(const std::string& path)
+{
+    std::ifstream in(path);
+    if (!in)
+    {
+        std::cerr << "Could not open OBJ file '" << path << "'.\n";
+        return nullptr;
+    }
+
+    auto mesh = scene_make<mesh_data>();
+    std::string line;
+    size_t line_number = 0;
+    size_t skipped_faces = 0;
+
+    while (std::getline(in, line))
+    {
+        ++line_number;
+        const char* s = line.c_str();
+        while (*s == ' ' || *s == '\t')
+            ++s;
+
+        char* end;
+        if (s[0] == 'v' && std::isspace(static_cast<unsigned char>(s[1])))
+        {
+            const real x = static_cast<real>(std::strtod(s + 1, &end));
+            const real y = static_cast<real>(std::strtod(end, &end));
+            const real z = static_cast<real>(std::strtod(end, &end));
+            mesh->positions.push_back(vec3(x, y, z));
+        }
+        else if (s[0] == 'v' && s[1] == 'n' && std::isspace(static_cast<unsigned char>(s[2])))
+        {
+            const real x = static_cast<real>(std::strtod(s + 2, &end));
+            const real y = static_cast<real>(std::strtod(end, &end));
+            const real z = static_cast<real>(std::strtod(end, &end));
+            mesh->normals.push_back(vec3(x, y, z));
+        }
+        else if (s[0] == 'v' && s[1] == 't' && std::isspace(static_cast<unsigned char>(s[2])))
+        {
+            const real u = static_cast<real>(std::strtod(s + 2, &end));
+            const real v = static_cast<real>(std::strtod(end, &end));
+            mesh->uvs.push_back(mesh_uv{ u, v });
+        }
+        else if (s[0] == 'f' && std::isspace(static_cast<unsigned char>(s[1])))
+        {
+            // Fan around the first corner: (0, 1, 2), (0, 2, 3), ...
+            obj_corner first, previous, corner;
+            const size_t face_start = mesh->position_indices.size();
+            int corners = 0;
+            bool valid = true;
+            ++s;
+            while (true)
+            {
+                while (std::isspace(static_cast<unsigned char>(*s)))
+                    ++s;
+                if (*s == '\0')
+                    break;
+                if (!obj_parse_corner(s, *mesh, corner))
+                {
+                    valid = false;
+                    break;
+                }
+
+                if (corners == 0)
+                    first = corner;
+                else if (corners >= 2)
+                    obj_add_triangle(*mesh, first, previous, corner);
+                previous = corner;
+                ++corners;
+            }
+
+            if (!valid || corners < 3)
+            {
+                // Drop the triangles of the face added before the bad corner.
+                mesh->position_indices.resize(face_start);
+                if (mesh->normal_indices.size() > face_start)
+                    mesh->normal_indices.resize(face_start);
+                if (mesh->uv_indices.size() > face_start)
+                    mesh->uv_indices.resize(face_start);
+                if (skipped_faces++ == 0)
+                    std::cerr << "OBJ file '" << path << "', line " << line_number << ": invalid face skipped.\n";
+            }
+        }
+    }
+
+    if (skipped_faces > 1)
+        std::cerr << "OBJ file '" << path << "': " << skipped_faces << " invalid faces skipped.\n";
+
+    return mesh;
+}
@@ -3,24 +3,63 @@
 #include "vec3.h"
 
 
-class ray
+// Ray origin + t * direction of the scalar type T. The renderer uses ray, i.e. ray_t<real>.
+// The reciprocal direction and its signs are computed once here, for all the box tests of a traversal.
+template <typename T>
+class ray_t
 {
     public:
-        ray() {}
-        ray(const vec3& origin, const vec3& direction)
-            : orig(origin), dir(direction), tm(0)
+        ray_t() {}
+        ray_t(const vec3_t<T>& origin, const vec3_t<T>& direction)
+            : ray_t(origin, direction, 0)
         {}
 
-        ray(const vec3& origin, const vec3& direction, double time)
-            : orig(origin), dir(direction), tm(time)
-        {}
+        ray_t(const vec3_t<T>& origin, const vec3_t<T>& direction, T time)
+            : orig(origin), dir(direction), tm(time),
+              inv_dir(T(1) / direction.x(), T(1) / direction.y(), T(1) / direction.z())
+        {
+            // 1 / -0 is -inf, so a negative zero direction counts as negative like in the old slab test.
+            for (int a = 0; a < 3; ++a)
+                sign[a] = inv_dir[a] < 0;
+        }
+
+        vec3_t<T> origin() const { return orig; }
+        vec3_t<T> direction() const { return dir; }
+        T time() const { return tm; }
+        vec3_t<T> at(T t) const { return orig + t*dir; }
+
+        // Width of the ray cone at t.
+        T cone_width_at(T t) const { return cone_spread == 0 ? cone_width : cone_width + t * dir.length() * cone_spread; }
 
-        vec3 origin() const { return orig; }
-        vec3 direction() const { return dir; }
-        double time() const { return tm; }
-        vec3 at(double t) const { return orig + t*dir; }
+        // Set through the constructors only, so that inv_dir and sign always match dir.
+        vec3_t<T> orig;
+        vec3_t<T> dir;
+        T tm; // time the ray exists at
+        vec3_t<T> inv_dir; // 1 / dir per component, +-inf for a zero component
+        int sign[3];       // 1 where the direction is negative: the slab is entered through its max plane
 
-        vec3 orig;
-        vec3 dir;
-        double tm; // time the ray exists at
+        // Ray cone, the ray differentials reduced to one isotropic width for texture filtering: the width
+        // of the pixel footprint at the origin and its growth per unit of distance (an angle in radians).
+        // Both are 0 for rays that carry no footprint.
+        T cone_width = 0;
+        T cone_spread = 0;
 };
+
+using ray = ray_t<real>;
+
+/* Smallest t accepted for a hit, so a ray that leaves a surface does not hit that surface again.
+   In double precision the fixed epsilon is far above the rounding error of a hit point. A float
+   hit point is only good to a few ulps of its largest coordinate, so in the float mode the
+   epsilon grows with the distance of the origin from the scene origin (32 ulps), measured in
+   units of the ray direction. */
+inline double ray_epsilon([[maybe_unused]] const ray& r)
+{
+#ifdef RTW_FLOAT32
+    const vec3 o = r.origin();
+    const double extent = std::max({ std::fabs(o.x()), std::fabs(o.y()), std::fabs(o.z()) });
+    const double error = extent * std::ldexp(1.0, -18) / r.direction().length();
+    return error > epsilon ? error : epsilon;
+#else
+    return epsilon;
+#endif
+}
@@ -0,0 +1,134 @@
+#pragma once
+
+#include "rtweekend.h"
+#include "hittable.h"
+#include "flat_bvh.h"
+
+#include <vector>
+
+
+// N coherent rays (e.g. primary rays of neighbouring pixels) traced together through a flat_bvh.
+// Lanes that are not set in `active` are ignored.
+template <int N>
+struct ray_packet
+{
+    ray rays[N];
+    rng_stream rng[N]; // random stream of each lane, current while that lane's primitives are tested
+    int active = 0;
+};
+
+/* Traces all active lanes of the packet through the BVH with one shared node stack. Every stack entry
+   carries the mask of lanes that reached it; a node is only descended if at least one of them hits
+   its box. Children are visited in the order that suits the first active lane.
+   Each lane accepts hits beyond ray_epsilon of its ray, as a single traced ray does.
+   Returns the mask of lanes that hit something, rec[k] holds the closest hit of lane k. */
+template <int N>
+int packet_hit(const flat_bvh& bvh, ray_packet<N>& packet, double t_max, hit_record (&rec)[N])
+{
+    static_assert(N <= 31, "lane masks are stored in an int");
+
+    double origin[3][N];
+    double inv_dir[3][N];
+    double t_min[N];
+    double closest[N];
+    for (int k = 0; k < N; ++k)
+    {
+        for (int a = 0; a < 3; ++a)
+        {
+            origin[a][k] = packet.rays[k].origin()[a];
+            inv_dir[a][k] = packet.rays[k].inv_dir[a];
+        }
+        t_min[k] = ray_epsilon(packet.rays[k]);
+        closest[k] = t_max;
+    }
+
+    int lead = 0;
+    while (lead < N - 1 && ((packet.active >> lead) & 1) == 0)
+        ++lead;
+    const bool dir_neg[3] = { inv_dir[0][lead] < 0, inv_dir[1][lead] < 0, inv_dir[2][lead] < 0 };
+
+    struct entry
+    {
+        uint32_t index;
+        int mask;
+    };
+
+    // Both children are pushed, so every level adds at most one entry. Deep trees get a heap stack, as in flat_bvh.
+    entry local_stack[flat_bvh::stack_size];
+    std::vector<entry> deep_stack;
+    entry* stack = local_stack;
+    if (bvh.depth + 1 > flat_bvh::stack_size)
+    {
+        deep_stack.resize(bvh.depth + 1);
+        stack = deep_stack.data();
+    }
+    int stack_top = 0;
+    stack[stack_top++] = entry{ 0, packet.active };
+
+    int hit_mask = 0;
+    const rng_stream saved = rng_current;
+
+    while (stack_top > 0)
+    {
+        const entry current = stack[--stack_top];
+        const flat_bvh_node& node = bvh.nodes[current.index];
+
+        // Slab test of all lanes against one box; the loop has no lane dependent branches.
+        int box_mask = 0;
+        for (int k = 0; k < N; ++k)
+        {
+            double t0 = t_min[k];
+            double t1 = closest[k];
+            for (int a = 0; a < 3; ++a)
+            {
+                const double ta = (node.bmin[a] - origin[a][k]) * inv_dir[a][k];
+                const double tb = (node.bmax[a] - origin[a][k]) * inv_dir[a][k];
+                const double near = ta < tb ? ta : tb;
+                const double far = ta < tb ? tb : ta;
+                t0 = near > t0 ? near : t0;
+                t1 = far < t1 ? far : t1;
+            }
+            box_mask |= (t0 <= t1) << k;
+        }
+        box_mask &= current.mask;
+
+        if (box_mask == 0)
+            continue;
+
+        if (node.count > 0)
+        {
+            for (int k = 0; k < N; ++k)
+            {
+                if (((box_mask >> k) & 1) == 0)
+                    continue;
+
+                rng_current = packet.rng[k];
+                for (uint32_t p = node.offset; p < node.offset + node.count; ++p)
+                {
+                    if (bvh.primitives[p]->hit(packet.rays[k], t_min[k], closest[k], rec[k]))
+                    {
+                        hit_mask |= 1 << k;
+                        closest[k] = rec[k].t;
+                    }
+                }
+                packet.rng[k] = rng_current;
+            }
+            continue;
+        }
+
+        // Near child on top of the stack.
+        if (dir_neg[node.axis])
+        {
+            stack[stack_top++] = entry{ current.index + 1, box_mask };
+            stack[stack_top++] = entry{ node.offset, box_mask };
+        }
+        else
+        {
+            stack[stack_top++] = entry{ node.offset, box_mask };
+            stack[stack_top++] = entry{ current.index + 1, box_mask };
+        }
+    }
+
+    rng_current = saved;
+    return hit_mask;
+}
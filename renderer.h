@@ -0,0 +1,215 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+// Rectangular block of pixels [x0, x1) x [y0, y1). Unit of work handed out to the render threads.
+struct tile
+{
+    int x0;
+    int y0;
+    int x1;
+    int y1;
+};
+
+// Image size and sampling parameters shared by the tile kernels.
+struct render_settings
+{
+    int image_width;
+    int image_height;
+    int samples_per_pixel;
+    int max_depth;
+    int rr_min_depth;     // bounces before Russian roulette may end a path (iterative integrator)
+    int first_sample = 0; // a progressive pass renders samples [first_sample, first_sample + samples_per_pixel)
+};
+
+// Per-thread counters. Padded to a full cache line so that two workers never write to the same line.
+struct alignas(64) worker_stats
+{
+    long long tiles = 0;
+    long long stolen = 0;
+    long long samples = 0;
+    long long rays = 0; // only counted by integrators that report path lengths
+    double busy_seconds = 0.0;
+};
+
+// Double-ended tile queue owned by one worker. The owner takes work from the back,
+// idle workers steal from the front, so owner and thieves rarely contend for the same end.
+class alignas(64) work_deque
+{
+    public:
+        void push(const tile& t)
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            tiles.push_back(t);
+        }
+
+        bool pop(tile& t)
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if (tiles.empty())
+                return false;
+            t = tiles.back();
+            tiles.pop_back();
+            return true;
+        }
+
+        bool steal(tile& t)
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if (tiles.empty())
+                return false;
+            t = tiles.front();
+            tiles.pop_front();
+            return true;
+        }
+
+    private:
+        std::mutex lock;
+        std::deque<tile> tiles;
+};
+
+
+// Splits the image into tiles and renders them on a fixed set of std::threads.
+// Every thread starts with its own deque of tiles and steals from the others once it runs dry.
+class tile_renderer
+{
+    public:
+        tile_renderer(int width, int height, int tile_size, int thread_count);
+
+        // Calls kernel(const tile&, worker_stats&) once for every tile of the image.
+        // Tiles never overlap, so the kernel may write its pixels into a shared buffer without locking.
+        template <typename Kernel>
+        void run(Kernel kernel);
+
+        void print_stats(std::ostream& out) const;
+
+        int thread_count() const { return static_cast<int>(stats.size()); }
+
+    public:
+        std::vector<tile> tiles;
+        std::vector<worker_stats> stats;
+        double wall_seconds = 0.0;
+
+    private:
+        bool next_tile(int id, tile& t, worker_stats& s);
+
+        std::vector<work_deque> queues;
+        std::atomic<long long> tiles_done{ 0 };
+        std::mutex print_lock;
+};
+
+tile_renderer::tile_renderer(int width, int height, int tile_size, int thread_count)
+    : stats(std::max(thread_count, 1)), queues(std::max(thread_count, 1))
+{
+    tile_size = std::max(tile_size, 1);
+
+    // Tiles are generated top row first, which is the order in which the image is written.
+    for (int y1 = height; y1 > 0; y1 -= tile_size)
+    {
+        for (int x0 = 0; x0 < width; x0 += tile_size)
+        {
+            tiles.push_back(tile{ x0, std::max(y1 - tile_size, 0), std::min(x0 + tile_size, width), y1 });
+        }
+    }
+}
+
+// Own queue first, then walk around the other workers and steal from the first non-empty one.
+// Tiles are only added before the threads start, so once every queue is empty the work is done.
+bool tile_renderer::next_tile(int id, tile& t, worker_stats& s)
+{
+    if (queues[id].pop(t))
+        return true;
+
+    const int n = thread_count();
+    for (int k = 1; k < n; ++k)
+    {
+        if (queues[(id + k) % n].steal(t))
+        {
+            ++s.stolen;
+            return true;
+        }
+    }
+    return false;
+}
+
+template <typename Kernel>
+void tile_renderer::run(Kernel kernel)
+{
+    using clock = std::chrono::steady_clock;
+
+    const int n = thread_count();
+    const long long total = static_cast<long long>(tiles.size());
+
+    // Deal the tiles out round robin so every worker starts with work spread over the whole image.
+    for (size_t k = 0; k < tiles.size(); ++k)
+        queues[k % n].push(tiles[k]);
+
+    tiles_done = 0;
+    auto start = clock::now();
+
+    auto worker = [&](int id)
+    {
+        worker_stats& s = stats[id];
+        tile t;
+        while (next_tile(id, t, s))
+        {
+            auto tile_start = clock::now();
+            kernel(t, s);
+            std::chrono::duration<double> busy = clock::now() - tile_start;
+            s.busy_seconds += busy.count();
+            ++s.tiles;
+
+            long long done = ++tiles_done;
+            if (done * 10 / total != (done - 1) * 10 / total)
+            {
+                std::lock_guard<std::mutex> guard(print_lock);
+                std::cout << done * 100 / total << "% done. \n";
+            }
+        }
+    };
+
+    // The calling thread works as worker 0.
+    std::vector<std::thread> threads;
+    for (int id = 1; id < n; ++id)
+        threads.emplace_back(worker, id);
+    worker(0);
+    for (auto& thread : threads)
+        thread.join();
+
+    std::chrono::duration<double> wall = clock::now() - start;
+    wall_seconds += wall.count();
+}
+
+void tile_renderer::print_stats(std::ostream& out) const
+{
+    out << "Threads: " << thread_count() << ", tiles: " << tiles.size() << ", wall: " << wall_seconds << " s\n";
+
+    long long samples = 0;
+    long long rays = 0;
+    for (const auto& s : stats)
+    {
+        samples += s.samples;
+        rays += s.rays;
+    }
+    if (rays > 0 && samples > 0)
+        out << "Average path length: " << double(rays) / samples << " rays per sample\n";
+
+    for (int id = 0; id < thread_count(); ++id)
+    {
+        const auto& s = stats[id];
+        const double utilization = wall_seconds > 0.0 ? 100.0 * s.busy_seconds / wall_seconds : 0.0;
+        out << "  thread " << id
+            << ": tiles " << s.tiles
+            << " (stolen " << s.stolen << ")"
+            << ", samples " << s.samples
+            << ", utilization " << utilization << "%\n";
+    }
+}
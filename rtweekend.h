@@ -1,17 +1,36 @@
 #pragma once
 
 #include <cmath>
+#include <cstdint>
 #include <cstdlib>
 #include <limits>
 #include <memory>
 #include <algorithm>
 
+// SIMD instruction sets available to the intersection kernels, detected from the compiler flags.
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define RTW_SSE 1
+#include <immintrin.h>
+#endif
+
+#if defined(__AVX2__)
+#define RTW_AVX2 1
+#endif
+
 
 // Usings
 
 using std::shared_ptr;
 using std::make_shared;
 
+// Scalar type of vectors, rays, boxes and hit records. Building with RTW_FLOAT32 defined renders in
+// single precision, which halves the size of every vector and doubles the SIMD width.
+#ifdef RTW_FLOAT32
+using real = float;
+#else
+using real = double;
+#endif
+
 
 // Constants
 
@@ -27,10 +46,77 @@ inline double degrees_to_radians(double degrees)
 	return degrees * pi / 180.0;
 }
 
+// Random Numbers
+
+/* Counter-based generator: every number is a pure function of (key, counter). The key names a stream,
+   e.g. one camera sample of one pixel, and the counter is the dimension within that stream. There is no
+   shared state, so threads never contend and the image does not depend on which thread renders a sample.
+   The mixing function is the SplitMix64 finalizer applied to a Weyl sequence. */
+struct rng_stream
+{
+	uint64_t key = 0;
+	uint64_t counter = 0;
+};
+
+inline uint64_t rng_mix(uint64_t z)
+{
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+	return z ^ (z >> 31);
+}
+
+inline uint64_t rng_hash(uint64_t key, uint64_t counter)
+{
+	return rng_mix(key + counter * 0x9e3779b97f4a7c15ull);
+}
+
+// Stream used by random_double() on the calling thread.
+inline thread_local rng_stream rng_current;
+
+// Starts the stream of one camera sample. All dimensions of that sample are drawn from it.
+inline void rng_seed(uint64_t pixel, uint64_t sample)
+{
+	rng_current.key = rng_mix((pixel << 32) ^ sample ^ 0x2545f4914f6cdd1dull);
+	rng_current.counter = 0;
+}
+
+inline uint64_t rng_next()
+{
+	return rng_hash(rng_current.key, rng_current.counter++);
+}
+
+// Maps the upper 53 bits onto [0,1).
+inline double rng_to_double(uint64_t bits)
+{
+	return (bits >> 11) * (1.0 / 9007199254740992.0);
+}
+
 // Returns a random real in [0,1).
 inline double random_double()
 {
-	return std::rand() / (RAND_MAX + 1.0);
+	return rng_to_double(rng_next());
+}
+
+// Fills N lanes (4 or 8 for SSE / AVX consumers) with consecutive dimensions of the current stream.
+// The lanes are independent, so the loop vectorizes.
+template <int N>
+inline void random_doubles(double (&out)[N])
+{
+	const uint64_t key = rng_current.key;
+	const uint64_t base = rng_current.counter;
+	for (int lane = 0; lane < N; ++lane)
+		out[lane] = rng_to_double(rng_hash(key, base + lane));
+	rng_current.counter += N;
+}
+
+template <int N>
+inline void random_floats(float (&out)[N])
+{
+	const uint64_t key = rng_current.key;
+	const uint64_t base = rng_current.counter;
+	for (int lane = 0; lane < N; ++lane)
+		out[lane] = (rng_hash(key, base + lane) >> 40) * (1.0f / 16777216.0f);
+	rng_current.counter += N;
 }
 
 inline double random_double(double min, double max)
@@ -61,6 +147,7 @@ inline double clamp(double x, double min, double max) {
 	return x;
 }
 
+#include "arena.h"
 #include "ray.h"
 #include "vec3.h"
 
@@ -0,0 +1,193 @@
+#pragma once
+
+#include "rtweekend.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "aarect.h"
+#include "bvh.h"
+#include "constant_medium.h"
+#include "instance.h"
+
+#include <unordered_map>
+
+
+// What compile_scene changed.
+struct scene_compile_stats
+{
+    int transform_chains = 0;  // chains of translate / rotate_y / instance replaced by one instance
+    int transforms_folded = 0; // wrappers in those chains
+    int flips_folded = 0;      // flip_face wrappers replaced by the flipped flag of a rect
+};
+
+/* Scene compilation: rewrites a scene into one that renders the same, with fewer hit() calls per ray.
+     - A chain like translate(rotate_y(x)) becomes one instance with the product of the transforms, so
+       the ray is transformed once instead of once per level. Rotations about other axes are instances
+       already and are folded the same way.
+     - flip_face around a rect becomes the flipped flag of a copy of the rect; around an instance it moves
+       inside, next to the object; two flip_faces cancel.
+   The pass recurses into lists, bvh_nodes and constant_medium boundaries. It never modifies the
+   input: changed nodes are copies, unchanged subtrees are shared, and an object referenced from several
+   places is compiled once and stays shared.
+   Like translate and rotate_y, the folded instance keeps the front_face of the object. */
+class scene_compiler
+{
+    public:
+        shared_ptr<hittable> compile(const shared_ptr<hittable>& object)
+        {
+            auto it = compiled.find(object.get());
+            if (it != compiled.end())
+                return it->second;
+            auto result = compile_uncached(object);
+            compiled[object.get()] = result;
+            return result;
+        }
+
+        scene_compile_stats stats;
+
+    private:
+        shared_ptr<hittable> compile_uncached(const shared_ptr<hittable>& object);
+        shared_ptr<hittable> flip(const shared_ptr<hittable>& object);
+
+        // Object to world transform and inner object of a transform wrapper; false for anything else.
+        static bool unwrap_transform(const hittable* object, affine_transform& transform, shared_ptr<hittable>& inner);
+
+        template <typename Rect>
+        static shared_ptr<hittable> flipped_rect(const shared_ptr<hittable>& object)
+        {
+            auto rect = std::dynamic_pointer_cast<Rect>(object);
+            if (rect == nullptr)
+                return nullptr;
+            auto copy = scene_make<Rect>(*rect);
+            copy->flipped = !copy->flipped;
+            return copy;
+        }
+
+        std::unordered_map<const hittable*, shared_ptr<hittable>> compiled;
+};
+
+bool scene_compiler::unwrap_transform(const hittable* object, affine_transform& transform, shared_ptr<hittable>& inner)
+{
+    if (auto t = dynamic_cast<const translate*>(object))
+    {
+        transform = t->transform();
+        inner = t->object();
+        return true;
+    }
+    if (auto t = dynamic_cast<const rotate_y*>(object))
+    {
+        transform = t->transform();
+        inner = t->object();
+        return true;
+    }
+    if (auto t = dynamic_cast<const instance*>(object))
+    {
+        transform = t->transform();
+        inner = t->object();
+        return true;
+    }
+    return false;
+}
+
+// Flips the faces of an already compiled object.
+shared_ptr<hittable> scene_compiler::flip(const shared_ptr<hittable>& object)
+{
+    ++stats.flips_folded;
+    if (auto rect = flipped_rect<xy_rect>(object))
+        return rect;
+    if (auto rect = flipped_rect<xz_rect>(object))
+        return rect;
+    if (auto rect = flipped_rect<yz_rect>(object))
+        return rect;
+    if (auto f = dynamic_cast<const flip_face*>(object.get()))
+        return f->object();
+    if (auto inst = dynamic_cast<const instance*>(object.get()))
+        return scene_make<instance>(flip(inst->object()), inst->transform());
+
+    --stats.flips_folded;
+    return scene_make<flip_face>(object);
+}
+
+shared_ptr<hittable> scene_compiler::compile_uncached(const shared_ptr<hittable>& object)
+{
+    affine_transform transform;
+    shared_ptr<hittable> inner;
+    if (unwrap_transform(object.get(), transform, inner))
+    {
+        int levels = 1;
+        affine_transform level;
+        while (unwrap_transform(inner.get(), level, inner))
+        {
+            transform = transform * level;
+            ++levels;
+        }
+
+        ++stats.transform_chains;
+        stats.transforms_folded += levels;
+        return scene_make<instance>(compile(inner), transform);
+    }
+
+    if (auto f = dynamic_cast<const flip_face*>(object.get()))
+        return flip(compile(f->object()));
+
+    if (auto list = dynamic_cast<const hittable_list*>(object.get()))
+    {
+        if (list->objects.size() == 1)
+            return compile(list->objects[0]);
+
+        std::vector<shared_ptr<hittable>> children;
+        bool changed = false;
+        for (const auto& child : list->objects)
+        {
+            children.push_back(compile(child));
+            changed = changed || children.back() != child;
+        }
+        if (!changed)
+            return object;
+
+        auto copy = scene_make<hittable_list>();
+        for (const auto& child : children)
+            copy->add(child);
+        return copy;
+    }
+
+    if (auto node = dynamic_cast<const bvh_node*>(object.get()))
+    {
+        auto left = compile(node->left);
+        auto right = node->right == node->left ? left : compile(node->right);
+        if (left == node->left && right == node->right)
+            return object;
+
+        // The children's boxes may differ from the originals by rounding, so the box is recomputed.
+        auto copy = scene_make<bvh_node>(*node);
+        copy->left = left;
+        copy->right = right;
+        aabb left_box, right_box;
+        copy->left->bounding_box(0, 1, left_box);
+        copy->right->bounding_box(0, 1, right_box);
+        copy->box = surrounding_box(left_box, right_box);
+        return copy;
+    }
+
+    if (auto medium = dynamic_cast<const constant_medium*>(object.get()))
+    {
+        auto boundary = compile(medium->boundary_object());
+        if (boundary == medium->boundary_object())
+            return object;
+
+        auto copy = scene_make<constant_medium>(*medium);
+        copy->set_boundary(boundary);
+        return copy;
+    }
+
+    return object;
+}
+
+hittable_list compile_scene(const hittable_list& world, scene_compile_stats& stats)
+{
+    scene_compiler compiler;
+    hittable_list result;
+    for (const auto& object : world.objects)
+        result.add(compiler.compile(object));
+    stats = compiler.stats;
+    return result;
+}
@@ -8,53 +8,51 @@ class sphere : public hittable
 {
     public:
         sphere() {}
-        sphere(vec3 cen, double r, shared_ptr<material> m) 
+        sphere(vec3 cen, real r, shared_ptr<material> m) 
             :   center(cen), radius(r), mat_ptr(m) {}
 
-        virtual bool hit(const ray& r, double tmin, double tmax, hit_record& rec) const;
+        virtual bool hit(const ray& r, real tmin, real tmax, hit_record& rec) const;
         virtual bool bounding_box(double time0, double time01, aabb& output_box) const;
 
         vec3 center;
-        double radius;
+        real radius;
         shared_ptr<material> mat_ptr;
 };
 
 // Sphere hit function derived from sphere equation + solving a quadratic equation with known formulas...
-bool sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) const 
+bool sphere::hit(const ray& r, real t_min, real t_max, hit_record& rec) const 
 {
+    RTW_COUNT_HIT();
     vec3 oc = r.origin() - center;
-    double a = r.direction().length_squared();
-    double half_b = dot(oc, r.direction());
-    double c = oc.length_squared() - radius*radius;
-    double discriminant = half_b * half_b - a*c;
+    real t_near, t_far;
 
-    if (discriminant > 0) 
+    if (sphere_roots(oc, r.direction(), radius, t_near, t_far)) 
     {
-        double root = sqrt(discriminant);
-
-        double temp = (-half_b - root) / a;
+        real temp = t_near;
         if (temp < t_max && temp > t_min) 
         {
             rec.t = temp;
             rec.p = r.at(rec.t);
             vec3 outward_normal = (rec.p - center) / radius;
             rec.set_face_normal(r, outward_normal);
-            rec.mat_ptr = mat_ptr;
+            rec.mat_ptr = mat_ptr.get();
 
             // get uv coordinates (expects things on the unit sphere (divided by radius) centered at the origin (minus center))
             get_sphere_uv((rec.p - center) / radius, rec.u, rec.v);
+            rec.uv_scale = sphere_uv_scale(outward_normal, radius);
             return true;
         }
 
-        temp = (-half_b + root) / a;
+        temp = t_far;
         if (temp < t_max && temp > t_min) 
         {
             rec.t = temp;
             rec.p = r.at(rec.t);
             vec3 outward_normal = (rec.p - center) / radius;
             rec.set_face_normal(r, outward_normal);
-            rec.mat_ptr = mat_ptr;
+            rec.mat_ptr = mat_ptr.get();
             get_sphere_uv((rec.p - center) / radius, rec.u, rec.v);
+            rec.uv_scale = sphere_uv_scale(outward_normal, radius);
             return true;
         }
     }
@@ -0,0 +1,347 @@
+#pragma once
+
+#include "rtweekend.h"
+#include "hittable.h"
+#include "sphere.h"
+#include "moving_sphere.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+
+// Whether bvh_node replaces the spheres of a build by sphere_runs (--sphere-batch 1). Off by default:
+// with the SIMD box tests of wide_bvh, small scattered spheres are culled more cheaply one by one.
+bool sphere_batching = false;
+
+/* Spheres and moving spheres stored as one array per component (SoA), so that the intersection
+   kernel tests several spheres per instruction. The center of sphere k at time t is
+     center[k] + ((t - time0[k]) / duration[k]) * motion[k],
+   which is exactly moving_sphere::center; static spheres have zero motion and simply return center[k].
+   Runs start at multiples of lanes and are padded with NaN spheres that never hit. */
+class sphere_batch
+{
+    public:
+        // Spheres tested per kernel step: 4 doubles in an AVX2 register.
+        static const int lanes = 4;
+        // Largest run; one BVH leaf references a whole run. One kernel step: runs of 8 were about 5%
+        // faster on random_scene and 5% slower on final_scene.
+        static const int max_run = 4;
+
+        // Appends the spheres (sphere or moving_sphere objects) of one run and returns its first index.
+        size_t add_run(const std::vector<const hittable*>& spheres);
+
+        // Closest sphere of the run [begin, begin + count) hit in (t_min, t_max), or -1.
+        int closest(const ray& r, size_t begin, size_t count, bool moving, double t_min, double t_max, double& t_hit) const;
+
+        vec3 center(size_t k, double time) const
+        {
+            return vec3(cx[k], cy[k], cz[k]) + ((time - time0[k]) / duration[k]) * vec3(mx[k], my[k], mz[k]);
+        }
+
+    public:
+        std::vector<double> cx, cy, cz;
+        std::vector<double> mx, my, mz;
+        std::vector<double> time0, duration;
+        std::vector<double> radius;
+        std::vector<uint32_t> material_id;
+
+        // Indexed by material_id. The batch keeps the materials alive.
+        std::vector<shared_ptr<material>> materials;
+        std::vector<const material*> material_ptrs;
+};
+
+size_t sphere_batch::add_run(const std::vector<const hittable*>& spheres)
+{
+    const size_t begin = cx.size();
+    const size_t padded = (spheres.size() + lanes - 1) / lanes * lanes;
+    const double nan = std::numeric_limits<double>::quiet_NaN();
+
+    auto push = [&](vec3 c, vec3 m, double t0, double d, double r, uint32_t id)
+    {
+        cx.push_back(c.x()); cy.push_back(c.y()); cz.push_back(c.z());
+        mx.push_back(m.x()); my.push_back(m.y()); mz.push_back(m.z());
+        time0.push_back(t0);
+        duration.push_back(d);
+        radius.push_back(r);
+        material_id.push_back(id);
+    };
+
+    auto material_index = [&](const shared_ptr<material>& m)
+    {
+        auto found = std::find(material_ptrs.begin(), material_ptrs.end(), m.get());
+        if (found != material_ptrs.end())
+            return static_cast<uint32_t>(found - material_ptrs.begin());
+        materials.push_back(m);
+        material_ptrs.push_back(m.get());
+        return static_cast<uint32_t>(material_ptrs.size() - 1);
+    };
+
+    for (const hittable* object : spheres)
+    {
+        if (auto s = dynamic_cast<const sphere*>(object))
+            push(s->center, vec3(0, 0, 0), 0.0, 1.0, s->radius, material_index(s->mat_ptr));
+        else if (auto m = dynamic_cast<const moving_sphere*>(object))
+            push(m->center0, m->center1 - m->center0, m->time0, m->time1 - m->time0, m->radius, material_index(m->mat_ptr));
+    }
+    for (size_t k = spheres.size(); k < padded; ++k)
+        push(vec3(nan, nan, nan), vec3(0, 0, 0), 0.0, 1.0, nan, 0);
+
+    return begin;
+}
+
+/* Per lane this is the arithmetic of sphere::hit in the double build, operation for operation, so a batched sphere
+   returns the same t as the sphere object. The near root is taken if it lies in (t_min, t_max),
+   otherwise the far root; the smallest t over all lanes wins, ties go to the lower index. */
+int sphere_batch::closest(const ray& r, size_t begin, size_t count, bool moving, double t_min, double t_max, double& t_hit) const
+{
+    const double ox = r.origin().x(), oy = r.origin().y(), oz = r.origin().z();
+    const double dx = r.direction().x(), dy = r.direction().y(), dz = r.direction().z();
+    const double a = dx * dx + dy * dy + dz * dz;
+    const double time = r.time();
+
+    int best = -1;
+    for (size_t k0 = begin; k0 < begin + count; k0 += lanes)
+    {
+        alignas(32) double t[lanes];
+
+#ifdef RTW_AVX2
+        __m256d px = _mm256_loadu_pd(&cx[k0]);
+        __m256d py = _mm256_loadu_pd(&cy[k0]);
+        __m256d pz = _mm256_loadu_pd(&cz[k0]);
+        if (moving)
+        {
+            const __m256d s = _mm256_div_pd(_mm256_sub_pd(_mm256_set1_pd(time), _mm256_loadu_pd(&time0[k0])), _mm256_loadu_pd(&duration[k0]));
+            px = _mm256_add_pd(px, _mm256_mul_pd(s, _mm256_loadu_pd(&mx[k0])));
+            py = _mm256_add_pd(py, _mm256_mul_pd(s, _mm256_loadu_pd(&my[k0])));
+            pz = _mm256_add_pd(pz, _mm256_mul_pd(s, _mm256_loadu_pd(&mz[k0])));
+        }
+        const __m256d vdx = _mm256_set1_pd(dx), vdy = _mm256_set1_pd(dy), vdz = _mm256_set1_pd(dz);
+        const __m256d ocx = _mm256_sub_pd(_mm256_set1_pd(ox), px);
+        const __m256d ocy = _mm256_sub_pd(_mm256_set1_pd(oy), py);
+        const __m256d ocz = _mm256_sub_pd(_mm256_set1_pd(oz), pz);
+        const __m256d half_b = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(ocx, vdx), _mm256_mul_pd(ocy, vdy)), _mm256_mul_pd(ocz, vdz));
+        const __m256d rad = _mm256_loadu_pd(&radius[k0]);
+        const __m256d oc2 = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(ocx, ocx), _mm256_mul_pd(ocy, ocy)), _mm256_mul_pd(ocz, ocz));
+        const __m256d c = _mm256_sub_pd(oc2, _mm256_mul_pd(rad, rad));
+        const __m256d va = _mm256_set1_pd(a);
+        const __m256d discriminant = _mm256_sub_pd(_mm256_mul_pd(half_b, half_b), _mm256_mul_pd(va, c));
+        const __m256d hit = _mm256_cmp_pd(discriminant, _mm256_setzero_pd(), _CMP_GT_OQ);
+        // Most runs are missed by most rays; skip the square root and divisions then.
+        if (_mm256_movemask_pd(hit) == 0)
+            continue;
+        const __m256d root = _mm256_sqrt_pd(discriminant);
+        const __m256d neg_half_b = _mm256_sub_pd(_mm256_setzero_pd(), half_b);
+        const __m256d t_near = _mm256_div_pd(_mm256_sub_pd(neg_half_b, root), va);
+        const __m256d t_far = _mm256_div_pd(_mm256_add_pd(neg_half_b, root), va);
+
+        const __m256d lo = _mm256_set1_pd(t_min), hi = _mm256_set1_pd(t_max);
+        auto inside = [&](__m256d x)
+        {
+            return _mm256_and_pd(_mm256_cmp_pd(x, hi, _CMP_LT_OQ), _mm256_cmp_pd(x, lo, _CMP_GT_OQ));
+        };
+        __m256d result = _mm256_blendv_pd(_mm256_set1_pd(infinity), t_far, _mm256_and_pd(hit, inside(t_far)));
+        result = _mm256_blendv_pd(result, t_near, _mm256_and_pd(hit, inside(t_near)));
+        _mm256_store_pd(t, result);
+#else
+        for (int i = 0; i < lanes; ++i)
+        {
+            const size_t k = k0 + i;
+            double px = cx[k], py = cy[k], pz = cz[k];
+            if (moving)
+            {
+                const double s = (time - time0[k]) / duration[k];
+                px = px + s * mx[k];
+                py = py + s * my[k];
+                pz = pz + s * mz[k];
+            }
+            const double ocx = ox - px, ocy = oy - py, ocz = oz - pz;
+            const double half_b = ocx * dx + ocy * dy + ocz * dz;
+            const double c = (ocx * ocx + ocy * ocy + ocz * ocz) - radius[k] * radius[k];
+            const double discriminant = half_b * half_b - a * c;
+
+            t[i] = infinity;
+            if (discriminant > 0)
+            {
+                const double root = sqrt(discriminant);
+                const double t_near = (-half_b - root) / a;
+                const double t_far = (-half_b + root) / a;
+                if (t_near < t_max && t_near > t_min)
+                    t[i] = t_near;
+                else if (t_far < t_max && t_far > t_min)
+                    t[i] = t_far;
+            }
+        }
+#endif
+
+        for (int i = 0; i < lanes; ++i)
+        {
+            if (t[i] < t_max)
+            {
+                t_max = t[i];
+                best = static_cast<int>(k0 + i);
+            }
+        }
+    }
+
+    t_hit = t_max;
+    return best;
+}
+
+
+// BVH leaf that stands for a run of up to sphere_batch::max_run neighbouring spheres of a batch.
+class sphere_run : public hittable
+{
+    public:
+        sphere_run(shared_ptr<const sphere_batch> b, size_t first, size_t n, bool is_moving, const aabb& bounds)
+            : batch(b), begin(first), count(n), moving(is_moving), box(bounds)
+        {}
+
+        virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const;
+
+        virtual bool bounding_box(double time0, double time1, aabb& output_box) const
+        {
+            output_box = box;
+            return true;
+        }
+
+    public:
+        shared_ptr<const sphere_batch> batch;
+        size_t begin;
+        size_t count;
+        bool moving; // any sphere of the run moves
+        aabb box;
+};
+
+// The hit record of the closest sphere is filled in exactly like sphere::hit does it.
+bool sphere_run::hit(const ray& r, real t_min, real t_max, hit_record& rec) const
+{
+    RTW_COUNT_HIT();
+    double t;
+    const int k = batch->closest(r, begin, count, moving, t_min, t_max, t);
+    if (k < 0)
+        return false;
+
+    const vec3 center = moving ? batch->center(k, r.time()) : vec3(batch->cx[k], batch->cy[k], batch->cz[k]);
+    const double radius = batch->radius[k];
+    rec.t = t;
+    rec.p = r.at(rec.t);
+    vec3 outward_normal = (rec.p - center) / radius;
+    rec.set_face_normal(r, outward_normal);
+    rec.mat_ptr = batch->material_ptrs[batch->material_id[k]];
+    get_sphere_uv((rec.p - center) / radius, rec.u, rec.v);
+    rec.uv_scale = sphere_uv_scale(outward_normal, radius);
+    return true;
+}
+
+/* Groups entries[start, end) into runs of at most max_run close entries: recursive median splits of
+   the centroids along the widest axis, until a group fits, which is passed to emit(start, end).
+   Entries need a centroid and their scene order. */
+template <typename Entry, typename Emit>
+void median_runs(std::vector<Entry>& entries, size_t start, size_t end, size_t max_run, Emit emit)
+{
+    if (end - start <= max_run)
+    {
+        emit(start, end);
+        return;
+    }
+
+    vec3 lo = entries[start].centroid;
+    vec3 hi = lo;
+    for (size_t i = start + 1; i < end; ++i)
+    {
+        for (int a = 0; a < 3; ++a)
+        {
+            lo.e[a] = std::min(lo.e[a], entries[i].centroid.e[a]);
+            hi.e[a] = std::max(hi.e[a], entries[i].centroid.e[a]);
+        }
+    }
+    const vec3 extent = hi - lo;
+    const int axis = extent.x() > extent.y() ? (extent.x() > extent.z() ? 0 : 2) : (extent.y() > extent.z() ? 1 : 2);
+
+    const size_t mid = start + (end - start) / 2;
+    std::nth_element(entries.begin() + start, entries.begin() + mid, entries.begin() + end,
+        [axis](const Entry& a, const Entry& b)
+        {
+            // Ties keep the scene order, so overlapping objects end up in a fixed order.
+            return a.centroid.e[axis] != b.centroid.e[axis] ? a.centroid.e[axis] < b.centroid.e[axis] : a.order < b.order;
+        });
+    median_runs(entries, start, mid, max_run, emit);
+    median_runs(entries, mid, end, max_run, emit);
+}
+
+// Moves entries whose box has more than 16 times the median surface area to result, as objects of their own.
+template <typename Entry>
+void keep_large_entries(std::vector<Entry>& entries, std::vector<shared_ptr<hittable>>& result)
+{
+    std::vector<double> areas;
+    for (const auto& e : entries)
+        areas.push_back(surface_area(e.box));
+    std::nth_element(areas.begin(), areas.begin() + areas.size() / 2, areas.end());
+    const double area_limit = 16.0 * (areas.empty() ? 0.0 : areas[areas.size() / 2]);
+
+    auto large = std::partition(entries.begin(), entries.end(),
+        [area_limit](const Entry& e) { return surface_area(e.box) <= area_limit; });
+    for (auto e = large; e != entries.end(); ++e)
+        result.push_back(e->object);
+    entries.erase(large, entries.end());
+}
+
+/* Returns objects with every sphere and moving_sphere replaced by sphere_runs over one shared batch.
+   Spheres are grouped by recursive median splits of their centers along the widest axis until a
+   group fits into one run, so the spheres of a run are close together. With fewer than two spheres
+   to batch the objects are returned unchanged. */
+std::vector<shared_ptr<hittable>> batch_spheres(const std::vector<shared_ptr<hittable>>& objects, double time0, double time1)
+{
+    struct entry
+    {
+        shared_ptr<hittable> object;
+        aabb box;
+        vec3 centroid;
+        bool moving;
+        size_t order;
+    };
+
+    std::vector<shared_ptr<hittable>> result;
+    std::vector<entry> spheres;
+    for (const auto& object : objects)
+    {
+        const bool is_sphere = dynamic_cast<const sphere*>(object.get()) != nullptr;
+        const bool is_moving = dynamic_cast<const moving_sphere*>(object.get()) != nullptr;
+        if (!is_sphere && !is_moving)
+        {
+            result.push_back(object);
+            continue;
+        }
+        entry e{ object, aabb(), vec3(), is_moving, spheres.size() };
+        object->bounding_box(time0, time1, e.box);
+        e.centroid = 0.5 * (e.box.min() + e.box.max());
+        spheres.push_back(e);
+    }
+
+    // Spheres much larger than the typical one (e.g. a ground sphere) would blow up the box of
+    // whatever run they land in, so they stay objects of their own.
+    keep_large_entries(spheres, result);
+
+    if (spheres.size() < 2)
+        return objects;
+
+    auto batch = scene_make<sphere_batch>();
+
+    median_runs(spheres, 0, spheres.size(), sphere_batch::max_run, [&](size_t start, size_t end)
+    {
+        std::vector<const hittable*> members;
+        aabb bounds = spheres[start].box;
+        bool moving = false;
+        for (size_t i = start; i < end; ++i)
+        {
+            members.push_back(spheres[i].object.get());
+            bounds = surrounding_box(bounds, spheres[i].box);
+            moving = moving || spheres[i].moving;
+        }
+        const size_t first = batch->add_run(members);
+        result.push_back(scene_make<sphere_run>(batch, first, members.size(), moving, bounds));
+    });
+
+    return result;
+}
@@ -0,0 +1,463 @@
+#pragma once
+
+#include "rtweekend.h"
+#include "block_compression.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <vector>
+
+// Every AVX2 processor has the F16C conversions; GCC and Clang only enable them with -mf16c (or -march).
+#if defined(__F16C__) || (defined(_MSC_VER) && defined(__AVX2__))
+#define RTW_F16C 1
+#include <immintrin.h>
+#endif
+
+
+/* How texels are stored. The first three keep RGB plus one unused channel so a texel never straddles a
+   cache line:
+   unorm8  four bytes, the 8-bit values of the file (divided by 255 when looked up);
+   half    four halves (11 significant bits), 8 bytes;
+   float32 four floats, 16 bytes;
+   r8      one byte, the first channel only, for grey images such as masks (looked up as grey);
+   bc1     BC1 blocks, half a byte per texel (RGB565 endpoints, four colours per 4x4 block);
+   bc7     BC7 mode 6 blocks, one byte per texel (RGBA endpoints, sixteen colours per 4x4 block).
+   unorm8, r8, bc1 and bc7 clamp to [0, 1]; see block_compression.h for the blocks. */
+enum class texel_format { unorm8, half, float32, r8, bc1, bc7 };
+
+enum class texture_filter { nearest, bilinear };
+
+// Format new colour images with 8-bit channels are converted to, whether images get mipmaps, and the filter
+// new image textures use (--texels, --mipmap, --texture-filter).
+texel_format default_texel_format = texel_format::unorm8;
+bool default_mipmaps = true;
+texture_filter default_texture_filter = texture_filter::nearest;
+
+
+inline uint32_t float_bits(float f) { uint32_t u; std::memcpy(&u, &f, sizeof u); return u; }
+inline float bits_float(uint32_t u) { float f; std::memcpy(&f, &u, sizeof f); return f; }
+
+// IEEE half conversions, rounding to nearest even; infinities and NaNs are kept.
+inline uint16_t float_to_half(float value)
+{
+#if defined(RTW_F16C)
+    return static_cast<uint16_t>(_cvtss_sh(value, 0));
+#else
+    uint32_t f = float_bits(value);
+    const uint32_t sign = (f >> 16) & 0x8000u;
+    f &= 0x7fffffffu;
+
+    uint16_t h;
+    if (f >= 0x47800000u) // too large for a half: infinity, or a quiet NaN
+    {
+        h = f > 0x7f800000u ? 0x7e00 : 0x7c00;
+    }
+    else if (f < 0x38800000u) // denormal or zero: let the float adder do the rounding
+    {
+        h = static_cast<uint16_t>(float_bits(bits_float(f) + 0.5f) - float_bits(0.5f));
+    }
+    else
+    {
+        const uint32_t odd = (f >> 13) & 1;
+        f += (static_cast<uint32_t>(15 - 127) << 23) + 0xfff + odd;
+        h = static_cast<uint16_t>(f >> 13);
+    }
+    return static_cast<uint16_t>(h | sign);
+#endif
+}
+
+inline float half_to_float(uint16_t h)
+{
+#if defined(RTW_F16C)
+    return _cvtsh_ss(h);
+#else
+    const uint32_t shifted = static_cast<uint32_t>(h & 0x7fff) << 13;
+    const uint32_t exponent = shifted & 0x0f800000u;
+    uint32_t f = shifted + (static_cast<uint32_t>(127 - 15) << 23);
+    if (exponent == 0x0f800000u)
+        f += static_cast<uint32_t>(128 - 16) << 23;
+    else if (exponent == 0)
+        f = float_bits(bits_float(f + (1u << 23)) - bits_float(113u << 23));
+    return bits_float(f | static_cast<uint32_t>(h & 0x8000) << 16);
+#endif
+}
+
+
+/* Format for an image of this many channels: grey images (one channel, or grey and alpha) are stored as r8
+   and high dynamic range ones as half, unless float32 (or half for grey) is asked for. */
+inline texel_format texel_format_for(texel_format requested, int channels, bool high_dynamic_range)
+{
+    if (high_dynamic_range)
+        return requested == texel_format::float32 ? texel_format::float32 : texel_format::half;
+    if (channels <= 2 && requested != texel_format::half && requested != texel_format::float32)
+        return texel_format::r8;
+    return requested;
+}
+
+
+/* Texels of an image, laid out for lookups at scattered uv rather than for row-by-row reads.
+   The image is cut into 8x8 tiles stored one after the other; inside a tile the texels are in Morton
+   order, so every aligned 4x4 block of unorm8 texels, 4x2 block of half texels or 2x2 block of float
+   texels is one 64-byte line, and a whole tile is a few neighbouring lines in any direction. Bilinear
+   lookups of unorm8 texels read a single line unless their 2x2 footprint crosses a block edge.
+   Block compressed formats tile their 4x4 blocks the same way, so a line holds 4x2 BC1 or 2x2 BC7 blocks,
+   and an r8 tile is a single line. Edge tiles and blocks are padded with repeated edge texels.
+   With mipmaps, level k + 1 averages 2x2 texels of level k, down to 1x1; the levels add a third to the
+   memory. A lookup with a footprint reads the two levels whose texels are closest to the footprint in
+   size and blends them (trilinear with the bilinear filter). */
+class texel_image
+{
+    public:
+        static const int tile_size = 8;
+
+        // Texels per side of the blocks of a format (1 if texels are stored one by one), and bytes per block.
+        static constexpr int block_size(texel_format f)
+        {
+            return f == texel_format::bc1 || f == texel_format::bc7 ? 4 : 1;
+        }
+
+        static constexpr int block_bytes(texel_format f)
+        {
+            return f == texel_format::unorm8 ? 4 : f == texel_format::half ? 8 : f == texel_format::float32 ? 16
+                : f == texel_format::r8 ? 1 : f == texel_format::bc1 ? 8 : 16;
+        }
+
+        texel_image() {}
+
+        // pixels holds height rows of width pixels of channels bytes, top row first. One channel is grey, two
+        // are grey and alpha, three RGB and four RGBA; alpha is kept only by bc7.
+        texel_image(const unsigned char* pixels, int image_width, int image_height, int channels, texel_format texels,
+            bool mipmaps = false)
+            : width(image_width), height(image_height), format(texels)
+        {
+            if (pixels == nullptr || width <= 0 || height <= 0)
+            {
+                width = height = 0;
+                return;
+            }
+            build(to_rgba(pixels, channels, 255.0f), mipmaps);
+        }
+
+        // The same from linear float pixels, as read from a high dynamic range file.
+        texel_image(const float* pixels, int image_width, int image_height, int channels, texel_format texels,
+            bool mipmaps = false)
+            : width(image_width), height(image_height), format(texels)
+        {
+            if (pixels == nullptr || width <= 0 || height <= 0)
+            {
+                width = height = 0;
+                return;
+            }
+            build(to_rgba(pixels, channels, 1.0f), mipmaps);
+        }
+
+        bool empty() const { return levels.empty(); }
+        int level_count() const { return static_cast<int>(levels.size()); }
+
+        size_t memory_bytes() const
+        {
+            size_t bytes = 0;
+            for (const auto& l : levels)
+                bytes += l.lines.size() * sizeof(cache_line);
+            return bytes;
+        }
+
+        // Texel in column x of row y (row 0 at the top) of a level; both must be inside that level.
+        vec3 texel(int x, int y, int level = 0) const
+        {
+            const texel_level& l = levels[level];
+            return with_format([&](auto f) { return scale<decltype(f)::value>(load<decltype(f)::value>(l, x, y)); });
+        }
+
+        // Texel containing (u, v), v = 0 at the bottom row; outside [0, 1] the edge texels repeat.
+        vec3 nearest(double u, double v, int level = 0) const
+        {
+            const texel_level& l = levels[level];
+            return with_format([&](auto f) { return nearest<decltype(f)::value>(l, u, v); });
+        }
+
+        // Blend of the four texels whose centers surround (u, v); edges clamp like nearest().
+        vec3 bilinear(double u, double v, int level = 0) const
+        {
+            const texel_level& l = levels[level];
+            return with_format([&](auto f) { return bilinear<decltype(f)::value>(l, u, v); });
+        }
+
+        vec3 sample(double u, double v, texture_filter filter, int level = 0) const
+        {
+            return filter == texture_filter::bilinear ? bilinear(u, v, level) : nearest(u, v, level);
+        }
+
+        // Lookup over a footprint this many uv units wide. Footprints up to a texel of level 0 read level 0
+        // alone, so magnified textures look as without mipmaps.
+        vec3 sample_footprint(double u, double v, texture_filter filter, real footprint) const
+        {
+            const real texels = footprint * texels_per_uv;
+            if (!(texels > 1) || levels.size() == 1)
+                return sample(u, v, filter, 0);
+
+            const real lod = std::log2(texels);
+            const int level = static_cast<int>(lod);
+            if (level >= level_count() - 1)
+                return sample(u, v, filter, level_count() - 1);
+
+            const real blend = lod - level;
+            return (1 - blend) * sample(u, v, filter, level) + blend * sample(u, v, filter, level + 1);
+        }
+
+        int width = 0;
+        int height = 0;
+        texel_format format = texel_format::unorm8;
+
+    private:
+        struct alignas(64) cache_line
+        {
+            unsigned char bytes[64];
+        };
+
+        // One level: its texels and the tables that give the position of a texel in them. The column
+        // and the row contribute independent bits of the position, so each is one table lookup.
+        struct texel_level
+        {
+            int width = 0;
+            int height = 0;
+            std::vector<uint32_t> column_offsets;
+            std::vector<uint32_t> row_offsets;
+            std::vector<cache_line> lines;
+
+            // Position of texel (x, y) in the texel array, or of block (x, y) for the block compressed
+            // formats: tile, then Morton index inside the tile.
+            size_t texel_index(int x, int y) const
+            {
+                return static_cast<size_t>(column_offsets[x]) + row_offsets[y];
+            }
+        };
+
+        // Bits 0, 1, 2 of v moved to bits 0, 2, 4.
+        static unsigned spread_bits(unsigned v)
+        {
+            return (v & 1) | (v & 2) << 1 | (v & 4) << 2;
+        }
+
+        // Pixels of any channel count as RGBA floats, divided by range.
+        template <typename T>
+        std::vector<float> to_rgba(const T* pixels, int channels, float range) const
+        {
+            std::vector<float> rgba(static_cast<size_t>(width) * height * 4);
+            for (size_t k = 0; k < static_cast<size_t>(width) * height; ++k)
+            {
+                const T* pixel = pixels + k * channels;
+                for (int c = 0; c < 3; ++c)
+                    rgba[4 * k + c] = pixel[channels >= 3 ? c : 0] / range;
+                rgba[4 * k + 3] = channels == 2 || channels == 4 ? pixel[channels - 1] / range : 1;
+            }
+            return rgba;
+        }
+
+        // Adds level 0 and, with mipmaps, the levels below it.
+        void build(std::vector<float> rgba, bool mipmaps)
+        {
+            int w = width, h = height;
+            add_level(rgba, w, h);
+            while (mipmaps && (w > 1 || h > 1))
+            {
+                const int nw = (w + 1) / 2, nh = (h + 1) / 2;
+                std::vector<float> next(static_cast<size_t>(nw) * nh * 4);
+                for (int y = 0; y < nh; ++y)
+                {
+                    const int y0 = 2 * y, y1 = std::min(2 * y + 1, h - 1);
+                    for (int x = 0; x < nw; ++x)
+                    {
+                        const int x0 = 2 * x, x1 = std::min(2 * x + 1, w - 1);
+                        for (int c = 0; c < 4; ++c)
+                        {
+                            next[(static_cast<size_t>(y) * nw + x) * 4 + c] = 0.25f * (
+                                rgba[(static_cast<size_t>(y0) * w + x0) * 4 + c] + rgba[(static_cast<size_t>(y0) * w + x1) * 4 + c] +
+                                rgba[(static_cast<size_t>(y1) * w + x0) * 4 + c] + rgba[(static_cast<size_t>(y1) * w + x1) * 4 + c]);
+                        }
+                    }
+                }
+                rgba.swap(next);
+                w = nw;
+                h = nh;
+                add_level(rgba, w, h);
+            }
+            texels_per_uv = std::sqrt(real(width) * height);
+        }
+
+        // Adds a level of w x h texels given as RGBA floats, rows top to bottom.
+        void add_level(const std::vector<float>& rgba, int w, int h)
+        {
+            texel_level l;
+            l.width = w;
+            l.height = h;
+            const int block = block_size(format);
+            const int blocks_x = (w + block - 1) / block;
+            const int blocks_y = (h + block - 1) / block;
+            const int tiles_x = (blocks_x + tile_size - 1) / tile_size;
+            const int tiles_y = (blocks_y + tile_size - 1) / tile_size;
+            l.column_offsets.resize(tiles_x * tile_size);
+            for (unsigned x = 0; x < l.column_offsets.size(); ++x)
+                l.column_offsets[x] = x / tile_size * (tile_size * tile_size) + spread_bits(x % tile_size);
+            l.row_offsets.resize(tiles_y * tile_size);
+            for (unsigned y = 0; y < l.row_offsets.size(); ++y)
+                l.row_offsets[y] = y / tile_size * (tile_size * tile_size) * tiles_x + (spread_bits(y % tile_size) << 1);
+
+            const size_t bytes = static_cast<size_t>(tiles_x) * tiles_y * tile_size * tile_size * block_bytes(format);
+            l.lines.resize((bytes + sizeof(cache_line) - 1) / sizeof(cache_line));
+
+            unsigned char* base = reinterpret_cast<unsigned char*>(l.lines.data());
+            for (int y = 0; y < tiles_y * tile_size; ++y)
+            {
+                for (int x = 0; x < tiles_x * tile_size; ++x)
+                {
+                    unsigned char* p = base + l.texel_index(x, y) * block_bytes(format);
+                    if (block == 1)
+                    {
+                        store(p, &rgba[(static_cast<size_t>(std::min(y, h - 1)) * w + std::min(x, w - 1)) * 4]);
+                        continue;
+                    }
+
+                    block_texels texels;
+                    for (int i = 0; i < 16; ++i)
+                    {
+                        const int tx = std::min(x * block + i % 4, w - 1);
+                        const int ty = std::min(y * block + i / 4, h - 1);
+                        for (int c = 0; c < 4; ++c)
+                            texels[i][c] = std::clamp(rgba[(static_cast<size_t>(ty) * w + tx) * 4 + c], 0.0f, 1.0f) * 255.0f;
+                    }
+                    if (format == texel_format::bc1)
+                        bc1_encode(texels, p);
+                    else
+                        bc7_encode(texels, p);
+                }
+            }
+            levels.push_back(std::move(l));
+        }
+
+        void store(unsigned char* p, const float rgba[4]) const
+        {
+            if (format == texel_format::unorm8 || format == texel_format::r8)
+            {
+                for (int c = 0; c < block_bytes(format); ++c)
+                    p[c] = static_cast<unsigned char>(std::clamp(rgba[c], 0.0f, 1.0f) * 255.0f + 0.5f);
+            }
+            else if (format == texel_format::float32)
+            {
+                std::memcpy(p, rgba, 4 * sizeof(float));
+            }
+            else
+            {
+                uint16_t h[4];
+                for (int c = 0; c < 4; ++c)
+                    h[c] = float_to_half(rgba[c]);
+                std::memcpy(p, h, sizeof h);
+            }
+        }
+
+        // Calls fn with the format as a compile time constant, so lookups are compiled once per format.
+        template <typename Fn>
+        vec3 with_format(Fn fn) const
+        {
+            switch (format)
+            {
+                case texel_format::unorm8: return fn(std::integral_constant<texel_format, texel_format::unorm8>());
+                case texel_format::half: return fn(std::integral_constant<texel_format, texel_format::half>());
+                case texel_format::r8: return fn(std::integral_constant<texel_format, texel_format::r8>());
+                case texel_format::bc1: return fn(std::integral_constant<texel_format, texel_format::bc1>());
+                case texel_format::bc7: return fn(std::integral_constant<texel_format, texel_format::bc7>());
+                default: return fn(std::integral_constant<texel_format, texel_format::float32>());
+            }
+        }
+
+        // Texel (x, y) as stored: texels of the 8-bit formats still range over 0..255. Block compressed
+        // texels are decoded from their block alone.
+        template <texel_format F>
+        static vec3 load(const texel_level& l, int x, int y)
+        {
+            constexpr unsigned block = block_size(F);
+            const unsigned bx = static_cast<unsigned>(x), by = static_cast<unsigned>(y);
+            const unsigned char* p = reinterpret_cast<const unsigned char*>(l.lines.data())
+                + l.texel_index(bx / block, by / block) * block_bytes(F);
+            if constexpr (F == texel_format::unorm8)
+            {
+                return vec3(p[0], p[1], p[2]);
+            }
+            else if constexpr (F == texel_format::r8)
+            {
+                return vec3(p[0], p[0], p[0]);
+            }
+            else if constexpr (F == texel_format::bc1)
+            {
+                int rgb[3];
+                bc1_decode(p, by % block * 4 + bx % block, rgb);
+                return vec3(rgb[0], rgb[1], rgb[2]);
+            }
+            else if constexpr (F == texel_format::bc7)
+            {
+                int rgba[4];
+                bc7_decode(p, by % block * 4 + bx % block, rgba);
+                return vec3(rgba[0], rgba[1], rgba[2]);
+            }
+            else if constexpr (F == texel_format::half)
+            {
+                uint16_t rgb[3];
+                std::memcpy(rgb, p, sizeof rgb);
+                return vec3(half_to_float(rgb[0]), half_to_float(rgb[1]), half_to_float(rgb[2]));
+            }
+            else
+            {
+                float rgb[3];
+                std::memcpy(rgb, p, sizeof rgb);
+                return vec3(rgb[0], rgb[1], rgb[2]);
+            }
+        }
+
+        // Stored values to texture values. Dividing (rather than multiplying by 1/255) keeps nearest lookups
+        // identical to reading the 8-bit file.
+        template <texel_format F>
+        static vec3 scale(const vec3& c)
+        {
+            if constexpr (F == texel_format::half || F == texel_format::float32)
+                return c;
+            else
+                return vec3(c.x() / 255.0, c.y() / 255.0, c.z() / 255.0);
+        }
+
+        template <texel_format F>
+        static vec3 nearest(const texel_level& l, double u, double v)
+        {
+            const int i = std::clamp(static_cast<int>(u * l.width), 0, l.width - 1);
+            const int j = std::clamp(static_cast<int>((1 - v) * l.height - epsilon), 0, l.height - 1);
+            return scale<F>(load<F>(l, i, j));
+        }
+
+        // Weights are applied to the stored values, so 8-bit texels are scaled once rather than four times.
+        template <texel_format F>
+        static vec3 bilinear(const texel_level& l, double u, double v)
+        {
+            const double x = u * l.width - 0.5;
+            const double y = (1 - v) * l.height - 0.5;
+            int xi = static_cast<int>(x);
+            int yi = static_cast<int>(y);
+            xi -= x < xi;
+            yi -= y < yi;
+            const real fx = static_cast<real>(x - xi);
+            const real fy = static_cast<real>(y - yi);
+
+            const int x0 = std::clamp(xi, 0, l.width - 1);
+            const int x1 = std::clamp(xi + 1, 0, l.width - 1);
+            const int y0 = std::clamp(yi, 0, l.height - 1);
+            const int y1 = std::clamp(yi + 1, 0, l.height - 1);
+
+            const vec3 top = (1 - fx) * load<F>(l, x0, y0) + fx * load<F>(l, x1, y0);
+            const vec3 bottom = (1 - fx) * load<F>(l, x0, y1) + fx * load<F>(l, x1, y1);
+            return scale<F>((1 - fy) * top + fy * bottom);
+        }
+
+        real texels_per_uv = 0; // width of a level 0 texel in uv units, inverted (geometric mean of u and v)
+        std::vector<texel_level> levels;
+};
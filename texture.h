@@ -2,11 +2,21 @@
 
 #include "rtweekend.h"
 #include "perlin.h"
+#include "image_cache.h"
+
+#include <string>
 
 class texture
 {
 	public:
 		virtual vec3 value(double u, double v, const vec3& p) const = 0;
+
+		// Lookup averaged over a footprint about this many uv units wide (hit_record::texture_footprint).
+		// Textures without levels of detail ignore it.
+		virtual vec3 value(double u, double v, const vec3& p, real footprint) const
+		{
+			return value(u, v, p);
+		}
 };
 
 class noise_texture : public texture
@@ -74,6 +84,15 @@ class checker_texture : public texture
 				return even->value(u, v, p);
 		}
 
+		virtual vec3 value(double u, double v, const vec3& p, real footprint) const
+		{
+			auto sines = sin(10 * p.x())* sin(10 * p.y())* sin(10 * p.z());
+			if (sines < 0)
+				return odd->value(u, v, p, footprint);
+			else
+				return even->value(u, v, p, footprint);
+		}
+
 
 	private:
 		shared_ptr<texture> even;
@@ -83,37 +102,40 @@ class checker_texture : public texture
 class image_texture : public texture
 {
 	public:
-		image_texture(unsigned char* pixels, int A, int B)
-			: data(pixels), nx(A), ny(B) {}
+		// The image comes from the process-wide cache, which decodes it in the background.
+		explicit image_texture(const std::string& path)
+			: image(image_cache::global().load(path)) {}
 
-		~image_texture()
-		{
-			delete data;
-		}
+		explicit image_texture(shared_ptr<const cached_image> cached)
+			: image(cached) {}
 
 		virtual vec3 value(double u, double v, const vec3& p) const
 		{
+			const texel_image& img = image->get();
+
 			// If we have no texture data, then always emit cyn (as a debugging aid)
-			if (data == nullptr)
+			if (img.empty())
 			{
 				return vec3(0, 1, 1);
 			}
 
-			auto i = static_cast<int>(u * nx);
-			auto j = static_cast<int>((1 - v) * ny - epsilon);
-
-			i = std::clamp(i, 0, nx - 1);
-			j = std::clamp(j, 0, ny - 1);
+			return img.sample(u, v, filter);
+		}
 
-			auto r = static_cast<int>(data[3 * i + 3 * nx * j + 0]) / 255.0;
-			auto g = static_cast<int>(data[3 * i + 3 * nx * j + 1]) / 255.0;
-			auto b = static_cast<int>(data[3 * i + 3 * nx * j + 2]) / 255.0;
+		virtual vec3 value(double u, double v, const vec3& p, real footprint) const
+		{
+			const texel_image& img = image->get();
+			if (img.empty())
+			{
+				return vec3(0, 1, 1);
+			}
 
-			return vec3(r, g, b);
+			return img.sample_footprint(u, v, filter, footprint);
 		}
 
+		texture_filter filter = default_texture_filter;
+
 	private:
-		unsigned char* data; // image data is stored as array of unsigned char
-		int nx;
-		int ny;
+		// Shared with every other texture of the same file; freed with the last one.
+		shared_ptr<const cached_image> image;
 };
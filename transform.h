@@ -0,0 +1,164 @@
+#pragma once
+
+#include "rtweekend.h"
+#include "aabb.h"
+
+
+/* Affine transform p -> A p + t, stored as the 3x4 matrix [A | t] in row-major order.
+   Transforms compose like matrices: (a * b).point(p) == a.point(b.point(p)). */
+class affine_transform
+{
+    public:
+        affine_transform()
+            : affine_transform(identity())
+        {}
+
+        static affine_transform identity()
+        {
+            return affine_transform(1, 0, 0, 0,
+                                    0, 1, 0, 0,
+                                    0, 0, 1, 0);
+        }
+
+        static affine_transform translation(const vec3& offset)
+        {
+            return affine_transform(1, 0, 0, offset.x(),
+                                    0, 1, 0, offset.y(),
+                                    0, 0, 1, offset.z());
+        }
+
+        static affine_transform scaling(const vec3& s)
+        {
+            return affine_transform(s.x(), 0, 0, 0,
+                                    0, s.y(), 0, 0,
+                                    0, 0, s.z(), 0);
+        }
+
+        // Counter-clockwise rotation by angle degrees about axis (Rodrigues' formula).
+        // About the y axis this is the rotation of rotate_y.
+        static affine_transform rotation(const vec3& axis, double angle)
+        {
+            const vec3 a = unit_vector(axis);
+            const double radians = degrees_to_radians(angle);
+            const double s = sin(radians);
+            const double c = cos(radians);
+            const double k = 1 - c;
+            const double x = a.x(), y = a.y(), z = a.z();
+            return affine_transform(
+                c + x * x * k,     x * y * k - z * s, x * z * k + y * s, 0,
+                y * x * k + z * s, c + y * y * k,     y * z * k - x * s, 0,
+                z * x * k - y * s, z * y * k + x * s, c + z * z * k,     0);
+        }
+
+        affine_transform(double m00, double m01, double m02, double m03,
+                         double m10, double m11, double m12, double m13,
+                         double m20, double m21, double m22, double m23)
+            : m{ { real(m00), real(m01), real(m02), real(m03) },
+                 { real(m10), real(m11), real(m12), real(m13) },
+                 { real(m20), real(m21), real(m22), real(m23) } }
+        {}
+
+        vec3 point(const vec3& p) const
+        {
+            return vec3(m[0][0] * p.x() + m[0][1] * p.y() + m[0][2] * p.z() + m[0][3],
+                        m[1][0] * p.x() + m[1][1] * p.y() + m[1][2] * p.z() + m[1][3],
+                        m[2][0] * p.x() + m[2][1] * p.y() + m[2][2] * p.z() + m[2][3]);
+        }
+
+        vec3 vector(const vec3& v) const
+        {
+            return vec3(m[0][0] * v.x() + m[0][1] * v.y() + m[0][2] * v.z(),
+                        m[1][0] * v.x() + m[1][1] * v.y() + m[1][2] * v.z(),
+                        m[2][0] * v.x() + m[2][1] * v.y() + m[2][2] * v.z());
+        }
+
+        // A^T v. Called on the inverse transform, this maps normals: normals transform with the inverse transpose.
+        vec3 transpose_vector(const vec3& v) const
+        {
+            return vec3(m[0][0] * v.x() + m[1][0] * v.y() + m[2][0] * v.z(),
+                        m[0][1] * v.x() + m[1][1] * v.y() + m[2][1] * v.z(),
+                        m[0][2] * v.x() + m[1][2] * v.y() + m[2][2] * v.z());
+        }
+
+        affine_transform operator*(const affine_transform& b) const
+        {
+            affine_transform r;
+            for (int i = 0; i < 3; ++i)
+            {
+                for (int j = 0; j < 4; ++j)
+                {
+                    r.m[i][j] = m[i][0] * b.m[0][j] + m[i][1] * b.m[1][j] + m[i][2] * b.m[2][j];
+                    if (j == 3)
+                        r.m[i][j] += m[i][3];
+                }
+            }
+            return r;
+        }
+
+        // Inverse by the adjugate of A; t' = -A^-1 t. A must not be singular.
+        affine_transform inverse() const
+        {
+            const double a00 = m[0][0], a01 = m[0][1], a02 = m[0][2];
+            const double a10 = m[1][0], a11 = m[1][1], a12 = m[1][2];
+            const double a20 = m[2][0], a21 = m[2][1], a22 = m[2][2];
+
+            const double c00 = a11 * a22 - a12 * a21;
+            const double c01 = a12 * a20 - a10 * a22;
+            const double c02 = a10 * a21 - a11 * a20;
+            const double inv_det = 1 / (a00 * c00 + a01 * c01 + a02 * c02);
+
+            affine_transform r(
+                c00 * inv_det, (a02 * a21 - a01 * a22) * inv_det, (a01 * a12 - a02 * a11) * inv_det, 0,
+                c01 * inv_det, (a00 * a22 - a02 * a20) * inv_det, (a02 * a10 - a00 * a12) * inv_det, 0,
+                c02 * inv_det, (a01 * a20 - a00 * a21) * inv_det, (a00 * a11 - a01 * a10) * inv_det, 0);
+
+            const vec3 t = r.vector(vec3(m[0][3], m[1][3], m[2][3]));
+            for (int i = 0; i < 3; ++i)
+                r.m[i][3] = -t[i];
+            return r;
+        }
+
+        double determinant() const
+        {
+            return m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1])
+                 - m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0])
+                 + m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+        }
+
+        // True if A is a rotation (or reflection): its columns are orthonormal up to rounding.
+        bool is_rigid() const
+        {
+            const real tolerance = sizeof(real) == sizeof(float) ? real(1e-5) : real(1e-12);
+            for (int i = 0; i < 3; ++i)
+            {
+                for (int j = 0; j < 3; ++j)
+                {
+                    const real d = m[0][i] * m[0][j] + m[1][i] * m[1][j] + m[2][i] * m[2][j];
+                    if (std::fabs(d - (i == j ? 1 : 0)) > tolerance)
+                        return false;
+                }
+            }
+            return true;
+        }
+
+        // Bounds of the transformed box (Arvo): per output axis, the smaller and larger of every
+        // matrix element times the box extent along the input axis are summed up.
+        aabb box(const aabb& b) const
+        {
+            vec3 lo(m[0][3], m[1][3], m[2][3]);
+            vec3 hi = lo;
+            for (int i = 0; i < 3; ++i)
+            {
+                for (int j = 0; j < 3; ++j)
+                {
+                    const real e = m[i][j] * b.min()[j];
+                    const real f = m[i][j] * b.max()[j];
+                    lo[i] += std::min(e, f);
+                    hi[i] += std::max(e, f);
+                }
+            }
+            return aabb(lo, hi);
+        }
+
+        real m[3][4];
+};
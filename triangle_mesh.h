@@ -0,0 +1,486 @@
+#pragma once
+
+#include "rtweekend.h"
+#include "hittable.h"
+#include "flat_bvh.h"
+
+#include <cstdint>
+#include <vector>
+
+
+// Texture coordinate of a mesh vertex.
+struct mesh_uv
+{
+    real u;
+    real v;
+};
+
+/* Vertex attributes and triangles of a mesh. Every attribute has its own buffer and its own index
+   buffer, three entries per triangle, like in an OBJ file. normal_indices and uv_indices are either
+   empty (the mesh has no such attribute) or as long as position_indices; no_index marks a triangle
+   without that attribute. The data is immutable once built and can be shared by several meshes. */
+struct mesh_data
+{
+    static constexpr uint32_t no_index = ~uint32_t(0);
+
+    std::vector<vec3> positions;
+    std::vector<vec3> normals;
+    std::vector<mesh_uv> uvs;
+
+    std::vector<uint32_t> position_indices;
+    std::vector<uint32_t> normal_indices;
+    std::vector<uint32_t> uv_indices;
+
+    size_t triangle_count() const { return position_indices.size() / 3; }
+
+    size_t memory_bytes() const
+    {
+        return positions.capacity() * sizeof(vec3) + normals.capacity() * sizeof(vec3) + uvs.capacity() * sizeof(mesh_uv)
+            + (position_indices.capacity() + normal_indices.capacity() + uv_indices.capacity()) * sizeof(uint32_t);
+    }
+};
+
+
+/* Ray prepared for the watertight ray/triangle test of Woop, Benthin and Wald (2013). The triangle is
+   translated to the ray origin and sheared so that the ray points along +z; the hit test is then a 2D
+   test of the origin against the three edges. Edges shared by two triangles are evaluated with the same
+   operands in both, so a ray never slips through between them. kz is the dominant axis of the direction,
+   kx and ky are swapped for a negative kz to keep the winding of the triangles. */
+struct watertight_ray
+{
+    vec3 origin;
+    int kx;
+    int ky;
+    int kz;
+    real sx;
+    real sy;
+    real sz;
+
+    explicit watertight_ray(const ray& r)
+        : origin(r.origin())
+    {
+        const vec3 d = r.direction();
+        kz = 0;
+        for (int a = 1; a < 3; ++a)
+        {
+            if (std::fabs(d[a]) > std::fabs(d[kz]))
+                kz = a;
+        }
+        kx = kz == 2 ? 0 : kz + 1;
+        ky = kx == 2 ? 0 : kx + 1;
+        if (d[kz] < 0)
+            std::swap(kx, ky);
+
+        sx = d[kx] / d[kz];
+        sy = d[ky] / d[kz];
+        sz = 1 / d[kz];
+    }
+};
+
+/* Returns true if the ray hits triangle p0 p1 p2 at a t in (t_min, t_max), and then the barycentric
+   coordinates b1, b2 of p1 and p2. Both sides of the triangle are hit. */
+inline bool watertight_hit(const watertight_ray& w, const vec3& p0, const vec3& p1, const vec3& p2,
+    real t_min, real t_max, real& t, real& b1, real& b2)
+{
+    const vec3 a = p0 - w.origin;
+    const vec3 b = p1 - w.origin;
+    const vec3 c = p2 - w.origin;
+
+    const real ax = a[w.kx] - w.sx * a[w.kz];
+    const real ay = a[w.ky] - w.sy * a[w.kz];
+    const real bx = b[w.kx] - w.sx * b[w.kz];
+    const real by = b[w.ky] - w.sy * b[w.kz];
+    const real cx = c[w.kx] - w.sx * c[w.kz];
+    const real cy = c[w.ky] - w.sy * c[w.kz];
+
+    // Edge functions; e0 is the weight of p0.
+    real e0 = cx * by - cy * bx;
+    real e1 = ax * cy - ay * cx;
+    real e2 = bx * ay - by * ax;
+
+#ifdef RTW_FLOAT32
+    // An edge function of exactly 0 may have the wrong sign after float rounding: the ray passes through
+    // an edge or a vertex, and only the exact sign decides which of the adjacent triangles it hits.
+    if (e0 == 0 || e1 == 0 || e2 == 0)
+    {
+        e0 = static_cast<real>(double(cx) * double(by) - double(cy) * double(bx));
+        e1 = static_cast<real>(double(ax) * double(cy) - double(ay) * double(cx));
+        e2 = static_cast<real>(double(bx) * double(ay) - double(by) * double(ax));
+    }
+#endif
+
+    if ((e0 < 0 || e1 < 0 || e2 < 0) && (e0 > 0 || e1 > 0 || e2 > 0))
+        return false;
+
+    const real det = e0 + e1 + e2;
+    if (det == 0)
+        return false;
+
+    const real az = w.sz * a[w.kz];
+    const real bz = w.sz * b[w.kz];
+    const real cz = w.sz * c[w.kz];
+    const real t_hit = (e0 * az + e1 * bz + e2 * cz) / det;
+    if (!(t_hit > t_min && t_hit < t_max))
+        return false;
+
+    t = t_hit;
+    b1 = e1 / det;
+    b2 = e2 / det;
+    return true;
+}
+
+
+/* Triangle mesh with its own BVH over triangle indices, stored in the flat_bvh_node layout: one hittable
+   for the whole mesh instead of one heap object per triangle. The BVH is built with the binned surface
+   area heuristic and keeps up to max_leaf_size triangles per leaf. Triangles are tested without
+   touching normals or uvs; those are read once for the closest hit. */
+class triangle_mesh : public hittable
+{
+    public:
+        triangle_mesh(shared_ptr<const mesh_data> mesh, shared_ptr<material> m);
+
+        virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const;
+
+        virtual bool bounding_box(double time0, double time1, aabb& output_box) const
+        {
+            output_box = box;
+            return true;
+        }
+
+        size_t memory_bytes() const
+        {
+            return nodes.capacity() * sizeof(flat_bvh_node) + triangles.capacity() * sizeof(uint32_t);
+        }
+
+    public:
+        static const int stack_size = 64;
+        static const int max_leaf_size = 4;
+        static const int max_sah_leaf_size = 64;
+
+        shared_ptr<const mesh_data> data;
+        std::vector<flat_bvh_node> nodes;
+        std::vector<uint32_t> triangles; // triangle indices in leaf order
+        shared_ptr<material> mat_ptr;
+
+    private:
+        struct build_triangle
+        {
+            aabb box;
+            vec3 centroid;
+            uint32_t index;
+        };
+
+        void build(std::vector<build_triangle>& tris, size_t start, size_t end, int level);
+        void make_leaf(uint32_t node, std::vector<build_triangle>& tris, size_t start, size_t end);
+        void fill_record(const ray& r, uint32_t tri, real t, real b1, real b2, hit_record& rec) const;
+
+        aabb box;
+};
+
+triangle_mesh::triangle_mesh(shared_ptr<const mesh_data> mesh, shared_ptr<material> m)
+    : data(mesh), mat_ptr(m)
+{
+    std::vector<build_triangle> tris;
+    tris.reserve(data->triangle_count());
+    for (uint32_t k = 0; k < data->triangle_count(); ++k)
+    {
+        const vec3& p0 = data->positions[data->position_indices[3 * k]];
+        const vec3& p1 = data->positions[data->position_indices[3 * k + 1]];
+        const vec3& p2 = data->positions[data->position_indices[3 * k + 2]];
+
+        build_triangle t;
+        t.box = aabb(p0, p0);
+        t.box = surrounding_box(t.box, aabb(p1, p1));
+        t.box = surrounding_box(t.box, aabb(p2, p2));
+        t.centroid = 0.5 * (t.box.min() + t.box.max());
+        t.index = k;
+        tris.push_back(t);
+    }
+
+    if (tris.empty())
+    {
+        // Empty leaf with inverted bounds: never hit.
+        flat_bvh_node node{};
+        for (int a = 0; a < 3; ++a)
+        {
+            node.bmin[a] = std::numeric_limits<float>::infinity();
+            node.bmax[a] = -std::numeric_limits<float>::infinity();
+        }
+        nodes.push_back(node);
+        box = aabb(vec3(0, 0, 0), vec3(0, 0, 0));
+        return;
+    }
+
+    nodes.reserve(2 * tris.size() / max_leaf_size + 1);
+    triangles.reserve(tris.size());
+    build(tris, 0, tris.size(), 1);
+
+    box = tris[0].box;
+    for (const auto& t : tris)
+        box = surrounding_box(box, t.box);
+}
+
+void triangle_mesh::make_leaf(uint32_t node, std::vector<build_triangle>& tris, size_t start, size_t end)
+{
+    nodes[node].offset = static_cast<uint32_t>(triangles.size());
+    nodes[node].count = static_cast<uint16_t>(end - start);
+    for (size_t i = start; i < end; ++i)
+        triangles.push_back(tris[i].index);
+}
+
+// Depth first like flat_bvh: the left child follows its parent, offset is the right child.
+void triangle_mesh::build(std::vector<build_triangle>& tris, size_t start, size_t end, int level)
+{
+    const int bin_count = 16;
+
+    struct bin
+    {
+        aabb box;
+        size_t count = 0;
+    };
+
+    const auto index = static_cast<uint32_t>(nodes.size());
+    nodes.push_back(flat_bvh_node{});
+
+    aabb bounds = tris[start].box;
+    vec3 cmin = tris[start].centroid;
+    vec3 cmax = tris[start].centroid;
+    for (size_t i = start + 1; i < end; ++i)
+    {
+        bounds = surrounding_box(bounds, tris[i].box);
+        for (int a = 0; a < 3; ++a)
+        {
+            cmin[a] = std::min(cmin[a], tris[i].centroid[a]);
+            cmax[a] = std::max(cmax[a], tris[i].centroid[a]);
+        }
+    }
+    for (int a = 0; a < 3; ++a)
+    {
+        nodes[index].bmin[a] = float_round_down(bounds.min()[a]);
+        nodes[index].bmax[a] = float_round_up(bounds.max()[a]);
+    }
+
+    const size_t count = end - start;
+    if (count <= max_leaf_size || level >= stack_size)
+    {
+        make_leaf(index, tris, start, end);
+        return;
+    }
+
+    // Binned SAH, as in bvh_node::split_sah. The cost of a leaf is its triangle count, the cost of
+    // a split one traversal step plus the area weighted triangle counts of both children.
+    double best_cost = infinity;
+    int best_axis = -1;
+    int best_bin = 0;
+
+    for (int a = 0; a < 3; ++a)
+    {
+        const double extent = cmax[a] - cmin[a];
+        if (extent <= 0)
+            continue;
+
+        bin bins[bin_count];
+        const double scale = bin_count / extent;
+        for (size_t i = start; i < end; ++i)
+        {
+            int b = std::min(static_cast<int>((tris[i].centroid[a] - cmin[a]) * scale), bin_count - 1);
+            bins[b].box = bins[b].count == 0 ? tris[i].box : surrounding_box(bins[b].box, tris[i].box);
+            ++bins[b].count;
+        }
+
+        double right_area[bin_count];
+        size_t right_count[bin_count];
+        aabb acc;
+        size_t n = 0;
+        for (int b = bin_count - 1; b > 0; --b)
+        {
+            if (bins[b].count > 0)
+                acc = n == 0 ? bins[b].box : surrounding_box(acc, bins[b].box);
+            n += bins[b].count;
+            right_area[b] = n > 0 ? surface_area(acc) : 0.0;
+            right_count[b] = n;
+        }
+
+        n = 0;
+        for (int b = 0; b < bin_count - 1; ++b)
+        {
+            if (bins[b].count > 0)
+                acc = n == 0 ? bins[b].box : surrounding_box(acc, bins[b].box);
+            n += bins[b].count;
+            if (n == 0 || right_count[b + 1] == 0)
+                continue;
+
+            const double cost = surface_area(acc) * n + right_area[b + 1] * right_count[b + 1];
+            if (cost < best_cost)
+            {
+                best_cost = cost;
+                best_axis = a;
+                best_bin = b;
+            }
+        }
+    }
+
+    // Ranges larger than max_sah_leaf_size are split even where the SAH prefers a leaf, so a cluster of
+    // overlapping triangles does not end up as one long list.
+    const double parent_area = surface_area(bounds);
+    const bool leaf_is_cheaper = best_axis < 0 || (parent_area > 0 && 1 + best_cost / parent_area >= count);
+    if (leaf_is_cheaper && count <= max_sah_leaf_size)
+    {
+        make_leaf(index, tris, start, end);
+        return;
+    }
+
+    size_t mid = start + count / 2;
+    int axis = 0;
+    if (best_axis >= 0)
+    {
+        axis = best_axis;
+        const double scale = bin_count / (cmax[axis] - cmin[axis]);
+        auto it = std::partition(tris.begin() + start, tris.begin() + end,
+            [&](const build_triangle& t)
+            {
+                int b = std::min(static_cast<int>((t.centroid[axis] - cmin[axis]) * scale), bin_count - 1);
+                return b <= best_bin;
+            });
+        mid = static_cast<size_t>(it - tris.begin());
+    }
+    else
+    {
+        // All centroids coincide, any split is as good as another.
+        std::nth_element(tris.begin() + start, tris.begin() + mid, tris.begin() + end,
+            [](const build_triangle& a, const build_triangle& b) { return a.index < b.index; });
+    }
+
+    nodes[index].axis = static_cast<uint16_t>(axis);
+    build(tris, start, mid, level + 1);
+    nodes[index].offset = static_cast<uint32_t>(nodes.size());
+    build(tris, mid, end, level + 1);
+}
+
+void triangle_mesh::fill_record(const ray& r, uint32_t tri, real t, real b1, real b2, hit_record& rec) const
+{
+    const mesh_data& mesh = *data;
+    const uint32_t* pi = &mesh.position_indices[3 * tri];
+    const vec3& p0 = mesh.positions[pi[0]];
+    const vec3& p1 = mesh.positions[pi[1]];
+    const vec3& p2 = mesh.positions[pi[2]];
+    const real b0 = 1 - b1 - b2;
+
+    const vec3 area_normal = cross(p1 - p0, p2 - p0);
+    rec.t = t;
+    rec.p = r.at(t);
+    rec.set_face_normal(r, unit_vector(area_normal));
+    rec.mat_ptr = mat_ptr.get();
+
+    // Interpolated vertex normals only shade. Which side was hit is decided by the counter-clockwise
+    // winding of the triangle, and the shading normal is turned to that side.
+    if (!mesh.normal_indices.empty() && mesh.normal_indices[3 * tri] != mesh_data::no_index)
+    {
+        const uint32_t* ni = &mesh.normal_indices[3 * tri];
+        const vec3 n = unit_vector(b0 * mesh.normals[ni[0]] + b1 * mesh.normals[ni[1]] + b2 * mesh.normals[ni[2]]);
+        rec.normal = dot(n, rec.normal) < 0 ? -n : n;
+    }
+
+    if (!mesh.uv_indices.empty() && mesh.uv_indices[3 * tri] != mesh_data::no_index)
+    {
+        const uint32_t* ti = &mesh.uv_indices[3 * tri];
+        const auto& uv0 = mesh.uvs[ti[0]];
+        const auto& uv1 = mesh.uvs[ti[1]];
+        const auto& uv2 = mesh.uvs[ti[2]];
+        rec.u = b0 * uv0.u + b1 * uv1.u + b2 * uv2.u;
+        rec.v = b0 * uv0.v + b1 * uv1.v + b2 * uv2.v;
+        // Square root of the ratio of the triangle's area in uv to its area in space.
+        const real uv_area = std::fabs((uv1.u - uv0.u) * (uv2.v - uv0.v) - (uv2.u - uv0.u) * (uv1.v - uv0.v));
+        rec.uv_scale = std::sqrt(uv_area / area_normal.length());
+    }
+    else
+    {
+        rec.u = b1;
+        rec.v = b2;
+        rec.uv_scale = 1 / std::sqrt(area_normal.length());
+    }
+}
+
+bool triangle_mesh::hit(const ray& r, real t_min, real t_max, hit_record& rec) const
+{
+    RTW_COUNT_HIT();
+    const watertight_ray w(r);
+    const vec3 origin = r.origin();
+    const vec3& inv_dir = r.inv_dir;
+    const int* dir_neg = r.sign;
+    const mesh_data& mesh = *data;
+
+    uint32_t stack[stack_size];
+    int stack_top = 0;
+    uint32_t index = 0;
+
+    uint32_t closest_tri = mesh_data::no_index;
+    real closest_so_far = t_max;
+    real closest_b1 = 0;
+    real closest_b2 = 0;
+
+    while (true)
+    {
+        const flat_bvh_node& node = nodes[index];
+
+        real t0 = t_min;
+        real t1 = closest_so_far;
+        for (int a = 0; a < 3; ++a)
+        {
+            const real near_plane = dir_neg[a] ? node.bmax[a] : node.bmin[a];
+            const real far_plane = dir_neg[a] ? node.bmin[a] : node.bmax[a];
+            const real tn = (near_plane - origin[a]) * inv_dir[a];
+            const real tf = (far_plane - origin[a]) * inv_dir[a];
+            t0 = tn > t0 ? tn : t0;
+            t1 = tf < t1 ? tf : t1;
+        }
+
+        // Widened like wide_slab_test: a ray through a vertex passes through a corner of its leaf box,
+        // where rounding may put t0 just above t1, and the watertight test would never be reached.
+        if (t0 <= t1 * real(1.000001))
+        {
+            if (node.count > 0)
+            {
+                for (uint32_t k = node.offset; k < node.offset + node.count; ++k)
+                {
+                    const uint32_t tri = triangles[k];
+                    const uint32_t* pi = &mesh.position_indices[3 * tri];
+                    real t, b1, b2;
+                    if (watertight_hit(w, mesh.positions[pi[0]], mesh.positions[pi[1]], mesh.positions[pi[2]],
+                            t_min, closest_so_far, t, b1, b2))
+                    {
+                        closest_tri = tri;
+                        closest_so_far = t;
+                        closest_b1 = b1;
+                        closest_b2 = b2;
+                    }
+                }
+            }
+            else
+            {
+                // Descend into the child closer to the ray origin, remember the other one.
+                if (dir_neg[node.axis])
+                {
+                    stack[stack_top++] = index + 1;
+                    index = node.offset;
+                }
+                else
+                {
+                    stack[stack_top++] = node.offset;
+                    index = index + 1;
+                }
+                continue;
+            }
+        }
+
+        if (stack_top == 0)
+            break;
+        index = stack[--stack_top];
+    }
+
+    if (closest_tri == mesh_data::no_index)
+        return false;
+
+    fill_record(r, closest_tri, closest_so_far, closest_b1, closest_b2, rec);
+    return true;
+}
@@ -3,26 +3,34 @@
 #include <iostream>
 
 
-class vec3
+// Three component vector of the scalar type T. The renderer uses vec3, i.e. vec3_t<real>.
+template <typename T>
+class vec3_t
 {
   public:
+    using value_type = T;
+    static constexpr bool simd = false;
 
-    vec3() :e{ 0,0,0 } {}
+    vec3_t() :e{ 0,0,0 } {}
 
-    vec3(double e0, double e1, double e2) : e{e0, e1, e2} {}
+    vec3_t(T e0, T e1, T e2) : e{e0, e1, e2} {}
 
-    double x() const { return e[0]; }
-    double y() const { return e[1]; }
-    double z() const { return e[2]; }
-    double r() const { return e[0]; }
-    double g() const { return e[1]; }
-    double b() const { return e[2]; }
+    // Conversion between precisions, e.g. from a double reference to the float render mode.
+    template <typename U>
+    explicit vec3_t(const vec3_t<U>& v) : e{ T(v.e[0]), T(v.e[1]), T(v.e[2]) } {}
 
-    vec3 operator-() const { return vec3(-e[0], -e[1], -e[2]); }
-    double operator[](int i) const { return e[i]; }
-    double &operator[](int i) { return e[i]; };
+    T x() const { return e[0]; }
+    T y() const { return e[1]; }
+    T z() const { return e[2]; }
+    T r() const { return e[0]; }
+    T g() const { return e[1]; }
+    T b() const { return e[2]; }
 
-    vec3& operator+=(const vec3& v)
+    vec3_t operator-() const { return vec3_t(-e[0], -e[1], -e[2]); }
+    T operator[](int i) const { return e[i]; }
+    T &operator[](int i) { return e[i]; };
+
+    vec3_t& operator+=(const vec3_t& v)
     {
         e[0] += v.e[0];
         e[1] += v.e[1];
@@ -30,7 +38,7 @@ class vec3
         return *this;
     }
 
-    vec3& operator*=(const double t)
+    vec3_t& operator*=(const T t)
     {
         e[0] *= t;
         e[1] *= t;
@@ -38,17 +46,17 @@ class vec3
         return *this;
     }
 
-    inline vec3& operator/=(const double t)
+    inline vec3_t& operator/=(const T t)
     {
         return *this *= 1/t;
     }
 
-    double length() const 
+    T length() const 
     { 
-        return sqrt(length_squared()); 
+        return std::sqrt(length_squared()); 
     }
 
-    double length_squared() const
+    T length_squared() const
     {
         return e[0] * e[0] + e[1] * e[1] + e[2] * e[2];
     }
@@ -74,75 +82,93 @@ class vec3
             << static_cast<int>(256 * std::clamp(b, 0.0, 0.999)) << '\n';
     }
 
-    inline static vec3 random()
+    inline static vec3_t random()
     {
-        return vec3(random_double(), random_double(), random_double());
+        return vec3_t(random_double(), random_double(), random_double());
     }
 
-    inline static vec3 random(double min, double max)
+    inline static vec3_t random(double min, double max)
     {
-        return vec3(random_double(min, max), random_double(min, max), random_double(min, max));
+        return vec3_t(random_double(min, max), random_double(min, max), random_double(min, max));
     }
 
-    double e[3];
+    T e[3];
 };
 
+#ifdef RTW_SIMD_VEC3
+#include "vec3_simd.h"
+#endif
+
+using vec3 = vec3_t<real>;
+
 
 // vec3 Utility Functions
+// Scalars are taken as vec3_t<T>::value_type, so that e.g. 2.0 * v also works for vec3_t<float>.
 
-inline std::ostream& operator<<(std::ostream& out, const vec3& v)
+template <typename T>
+inline std::ostream& operator<<(std::ostream& out, const vec3_t<T>& v)
 {
     return out << v.e[0] << " " << v.e[1] << " " << v.e[2];
 }
 
-inline vec3 operator+(const vec3 &u, const vec3 &v)
+template <typename T>
+inline vec3_t<T> operator+(const vec3_t<T> &u, const vec3_t<T> &v)
 {
-    return vec3(u.e[0] + v.e[0], u.e[1] + v.e[1], u.e[2] + v.e[2]);
+    return vec3_t<T>(u.e[0] + v.e[0], u.e[1] + v.e[1], u.e[2] + v.e[2]);
 }
 
-inline vec3 operator-(const vec3 &u, const vec3 &v)
+template <typename T>
+inline vec3_t<T> operator-(const vec3_t<T> &u, const vec3_t<T> &v)
 {
-    return vec3(u.e[0] - v.e[0], u.e[1] - v.e[1], u.e[2] - v.e[2]);
+    return vec3_t<T>(u.e[0] - v.e[0], u.e[1] - v.e[1], u.e[2] - v.e[2]);
 }
 
-inline vec3 operator*(const vec3 &u, const vec3 &v)
+template <typename T>
+inline vec3_t<T> operator*(const vec3_t<T> &u, const vec3_t<T> &v)
 {
-    return vec3(u.e[0] * v.e[0], u.e[1] * v.e[1], u.e[2] * v.e[2]);
+    return vec3_t<T>(u.e[0] * v.e[0], u.e[1] * v.e[1], u.e[2] * v.e[2]);
 }
 
-inline vec3 operator/(const vec3 &u, const vec3 &v)
+template <typename T>
+inline vec3_t<T> operator/(const vec3_t<T> &u, const vec3_t<T> &v)
 {
-    return vec3(u.e[0] / v.e[0], u.e[1] / v.e[1], u.e[2] / v.e[2]);
+    return vec3_t<T>(u.e[0] / v.e[0], u.e[1] / v.e[1], u.e[2] / v.e[2]);
 }
 
-inline vec3 operator*(double t, const vec3 &v)
+template <typename T>
+inline vec3_t<T> operator*(typename vec3_t<T>::value_type t, const vec3_t<T> &v)
 {
-    return vec3(t * v.e[0], t * v.e[1], t * v.e[2]);
+    return vec3_t<T>(t * v.e[0], t * v.e[1], t * v.e[2]);
 }
 
-inline vec3 operator*(const vec3& v, double t)
+template <typename T>
+inline vec3_t<T> operator*(const vec3_t<T>& v, typename vec3_t<T>::value_type t)
 {
     return t * v;
 }
 
-inline vec3 operator/(vec3 v, double t)
+template <typename T>
+inline vec3_t<T> operator/(vec3_t<T> v, typename vec3_t<T>::value_type t)
 {
     return (1/t) * v;
 }
 
-inline double dot(const vec3 &u, const vec3 &v)
+template <typename T>
+inline T dot(const vec3_t<T> &u, const vec3_t<T> &v)
 {
     return (u.e[0] * v.e[0] + u.e[1] * v.e[1] + u.e[2] * v.e[2]);
 }
 
-inline vec3 cross(const vec3 &u, const vec3 &v)
+template <typename T>
+inline vec3_t<T> cross(const vec3_t<T> &u, const vec3_t<T> &v)
 {
-    return vec3(u.e[1] * v.e[2] - u.e[2] * v.e[1],
-                u.e[2] * v.e[0] - u.e[0] * v.e[2],
-                u.e[0] * v.e[1] - u.e[1] * v.e[0]);
+    return vec3_t<T>(u.e[1] * v.e[2] - u.e[2] * v.e[1],
+                     u.e[2] * v.e[0] - u.e[0] * v.e[2],
+                     u.e[0] * v.e[1] - u.e[1] * v.e[0]);
 }
 
-inline vec3 unit_vector(vec3 v)
+template <typename T>
+inline vec3_t<T> unit_vector(vec3_t<T> v)
 {
     return v / v.length();
 }
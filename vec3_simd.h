@@ -0,0 +1,310 @@
+#pragma once
+
+// SIMD versions of vec3_t, used instead of the scalar class when RTW_SIMD_VEC3 is defined:
+// vec3_t<double> on AVX2 (__m256d) and vec3_t<float> on SSE (__m128). The fourth lane is padding
+// and kept at zero. Without the instruction set the scalar class is used.
+// Every operation rounds exactly like the scalar one, including the summation order of dot,
+// so both versions render the same image and can be A/B tested against each other.
+
+#include <immintrin.h>
+
+
+#ifdef RTW_AVX2
+
+template <>
+class alignas(32) vec3_t<double>
+{
+  public:
+    using value_type = double;
+    static constexpr bool simd = true;
+
+    vec3_t() : m(_mm256_setzero_pd()) {}
+
+    vec3_t(double e0, double e1, double e2) : m(_mm256_setr_pd(e0, e1, e2, 0.0)) {}
+
+    explicit vec3_t(__m256d v) : m(v) {}
+
+    template <typename U>
+    explicit vec3_t(const vec3_t<U>& v) : m(_mm256_setr_pd(double(v.e[0]), double(v.e[1]), double(v.e[2]), 0.0)) {}
+
+    double x() const { return e[0]; }
+    double y() const { return e[1]; }
+    double z() const { return e[2]; }
+    double r() const { return e[0]; }
+    double g() const { return e[1]; }
+    double b() const { return e[2]; }
+
+    // Flipping the sign bit gives -0 for 0 like scalar negation (0 - x would give +0).
+    vec3_t operator-() const { return vec3_t(_mm256_xor_pd(m, _mm256_set1_pd(-0.0))); }
+    double operator[](int i) const { return e[i]; }
+    double &operator[](int i) { return e[i]; };
+
+    vec3_t& operator+=(const vec3_t& v)
+    {
+        m = _mm256_add_pd(m, v.m);
+        return *this;
+    }
+
+    vec3_t& operator*=(const double t)
+    {
+        m = _mm256_mul_pd(m, _mm256_set1_pd(t));
+        return *this;
+    }
+
+    inline vec3_t& operator/=(const double t)
+    {
+        return *this *= 1/t;
+    }
+
+    double length() const
+    {
+        return std::sqrt(length_squared());
+    }
+
+    // (x*x + y*y) + z*z, the order of the scalar version. The padding lane is never added.
+    double length_squared() const
+    {
+        const __m256d p = _mm256_mul_pd(m, m);
+        const __m128d lo = _mm256_castpd256_pd128(p);
+        const __m128d sum = _mm_add_sd(lo, _mm_unpackhi_pd(lo, lo));
+        return _mm_cvtsd_f64(_mm_add_sd(sum, _mm256_extractf128_pd(p, 1)));
+    }
+
+    void write_color(std::ostream& out, int samples_per_pixel)
+    {
+        // Replace NaN component values with zero.
+        if (e[0] != e[0]) e[0] = 0.0;
+        if (e[1] != e[1]) e[1] = 0.0;
+        if (e[2] != e[2]) e[2] = 0.0;
+
+        // Divide the color total by the number of samples and gamma-correct for a gamma value of 2.0.
+        auto scale = 1.0 / samples_per_pixel;
+        auto r = sqrt(scale * e[0]);
+        auto g = sqrt(scale * e[1]);
+        auto b = sqrt(scale * e[2]);
+
+        out << static_cast<int>(256 * std::clamp(r, 0.0, 0.999)) << ' '
+            << static_cast<int>(256 * std::clamp(g, 0.0, 0.999)) << ' '
+            << static_cast<int>(256 * std::clamp(b, 0.0, 0.999)) << '\n';
+    }
+
+    inline static vec3_t random()
+    {
+        // Same expression as the scalar version, so the random numbers are drawn in the same order.
+        return vec3_t(random_double(), random_double(), random_double());
+    }
+
+    inline static vec3_t random(double min, double max)
+    {
+        return vec3_t(random_double(min, max), random_double(min, max), random_double(min, max));
+    }
+
+    union
+    {
+        __m256d m;
+        double e[4];
+    };
+};
+
+inline vec3_t<double> operator+(const vec3_t<double> &u, const vec3_t<double> &v)
+{
+    return vec3_t<double>(_mm256_add_pd(u.m, v.m));
+}
+
+inline vec3_t<double> operator-(const vec3_t<double> &u, const vec3_t<double> &v)
+{
+    return vec3_t<double>(_mm256_sub_pd(u.m, v.m));
+}
+
+inline vec3_t<double> operator*(const vec3_t<double> &u, const vec3_t<double> &v)
+{
+    return vec3_t<double>(_mm256_mul_pd(u.m, v.m));
+}
+
+// The padding lane becomes 0 / 0; it is never read.
+inline vec3_t<double> operator/(const vec3_t<double> &u, const vec3_t<double> &v)
+{
+    return vec3_t<double>(_mm256_div_pd(u.m, v.m));
+}
+
+inline vec3_t<double> operator*(double t, const vec3_t<double> &v)
+{
+    return vec3_t<double>(_mm256_mul_pd(_mm256_set1_pd(t), v.m));
+}
+
+inline vec3_t<double> operator*(const vec3_t<double>& v, double t)
+{
+    return t * v;
+}
+
+inline vec3_t<double> operator/(vec3_t<double> v, double t)
+{
+    return (1/t) * v;
+}
+
+inline double dot(const vec3_t<double> &u, const vec3_t<double> &v)
+{
+    const __m256d p = _mm256_mul_pd(u.m, v.m);
+    const __m128d lo = _mm256_castpd256_pd128(p);
+    const __m128d sum = _mm_add_sd(lo, _mm_unpackhi_pd(lo, lo));
+    return _mm_cvtsd_f64(_mm_add_sd(sum, _mm256_extractf128_pd(p, 1)));
+}
+
+// u.yzx * v.zxy - u.zxy * v.yzx
+inline vec3_t<double> cross(const vec3_t<double> &u, const vec3_t<double> &v)
+{
+    const __m256d u_yzx = _mm256_permute4x64_pd(u.m, _MM_SHUFFLE(3, 0, 2, 1));
+    const __m256d u_zxy = _mm256_permute4x64_pd(u.m, _MM_SHUFFLE(3, 1, 0, 2));
+    const __m256d v_yzx = _mm256_permute4x64_pd(v.m, _MM_SHUFFLE(3, 0, 2, 1));
+    const __m256d v_zxy = _mm256_permute4x64_pd(v.m, _MM_SHUFFLE(3, 1, 0, 2));
+    return vec3_t<double>(_mm256_sub_pd(_mm256_mul_pd(u_yzx, v_zxy), _mm256_mul_pd(u_zxy, v_yzx)));
+}
+
+#endif // RTW_AVX2
+
+
+#ifdef RTW_SSE
+
+template <>
+class alignas(16) vec3_t<float>
+{
+  public:
+    using value_type = float;
+    static constexpr bool simd = true;
+
+    vec3_t() : m(_mm_setzero_ps()) {}
+
+    vec3_t(float e0, float e1, float e2) : m(_mm_setr_ps(e0, e1, e2, 0.0f)) {}
+
+    explicit vec3_t(__m128 v) : m(v) {}
+
+    template <typename U>
+    explicit vec3_t(const vec3_t<U>& v) : m(_mm_setr_ps(float(v.e[0]), float(v.e[1]), float(v.e[2]), 0.0f)) {}
+
+    float x() const { return e[0]; }
+    float y() const { return e[1]; }
+    float z() const { return e[2]; }
+    float r() const { return e[0]; }
+    float g() const { return e[1]; }
+    float b() const { return e[2]; }
+
+    vec3_t operator-() const { return vec3_t(_mm_xor_ps(m, _mm_set1_ps(-0.0f))); }
+    float operator[](int i) const { return e[i]; }
+    float &operator[](int i) { return e[i]; };
+
+    vec3_t& operator+=(const vec3_t& v)
+    {
+        m = _mm_add_ps(m, v.m);
+        return *this;
+    }
+
+    vec3_t& operator*=(const float t)
+    {
+        m = _mm_mul_ps(m, _mm_set1_ps(t));
+        return *this;
+    }
+
+    inline vec3_t& operator/=(const float t)
+    {
+        return *this *= 1/t;
+    }
+
+    float length() const
+    {
+        return std::sqrt(length_squared());
+    }
+
+    float length_squared() const
+    {
+        const __m128 p = _mm_mul_ps(m, m);
+        const __m128 sum = _mm_add_ss(p, _mm_shuffle_ps(p, p, _MM_SHUFFLE(1, 1, 1, 1)));
+        return _mm_cvtss_f32(_mm_add_ss(sum, _mm_movehl_ps(p, p)));
+    }
+
+    void write_color(std::ostream& out, int samples_per_pixel)
+    {
+        // Replace NaN component values with zero.
+        if (e[0] != e[0]) e[0] = 0.0f;
+        if (e[1] != e[1]) e[1] = 0.0f;
+        if (e[2] != e[2]) e[2] = 0.0f;
+
+        // Divide the color total by the number of samples and gamma-correct for a gamma value of 2.0.
+        auto scale = 1.0 / samples_per_pixel;
+        auto r = sqrt(scale * e[0]);
+        auto g = sqrt(scale * e[1]);
+        auto b = sqrt(scale * e[2]);
+
+        out << static_cast<int>(256 * std::clamp(r, 0.0, 0.999)) << ' '
+            << static_cast<int>(256 * std::clamp(g, 0.0, 0.999)) << ' '
+            << static_cast<int>(256 * std::clamp(b, 0.0, 0.999)) << '\n';
+    }
+
+    inline static vec3_t random()
+    {
+        return vec3_t(random_double(), random_double(), random_double());
+    }
+
+    inline static vec3_t random(double min, double max)
+    {
+        return vec3_t(random_double(min, max), random_double(min, max), random_double(min, max));
+    }
+
+    union
+    {
+        __m128 m;
+        float e[4];
+    };
+};
+
+inline vec3_t<float> operator+(const vec3_t<float> &u, const vec3_t<float> &v)
+{
+    return vec3_t<float>(_mm_add_ps(u.m, v.m));
+}
+
+inline vec3_t<float> operator-(const vec3_t<float> &u, const vec3_t<float> &v)
+{
+    return vec3_t<float>(_mm_sub_ps(u.m, v.m));
+}
+
+inline vec3_t<float> operator*(const vec3_t<float> &u, const vec3_t<float> &v)
+{
+    return vec3_t<float>(_mm_mul_ps(u.m, v.m));
+}
+
+inline vec3_t<float> operator/(const vec3_t<float> &u, const vec3_t<float> &v)
+{
+    return vec3_t<float>(_mm_div_ps(u.m, v.m));
+}
+
+inline vec3_t<float> operator*(float t, const vec3_t<float> &v)
+{
+    return vec3_t<float>(_mm_mul_ps(_mm_set1_ps(t), v.m));
+}
+
+inline vec3_t<float> operator*(const vec3_t<float>& v, float t)
+{
+    return t * v;
+}
+
+inline vec3_t<float> operator/(vec3_t<float> v, float t)
+{
+    return (1/t) * v;
+}
+
+inline float dot(const vec3_t<float> &u, const vec3_t<float> &v)
+{
+    const __m128 p = _mm_mul_ps(u.m, v.m);
+    const __m128 sum = _mm_add_ss(p, _mm_shuffle_ps(p, p, _MM_SHUFFLE(1, 1, 1, 1)));
+    return _mm_cvtss_f32(_mm_add_ss(sum, _mm_movehl_ps(p, p)));
+}
+
+inline vec3_t<float> cross(const vec3_t<float> &u, const vec3_t<float> &v)
+{
+    const __m128 u_yzx = _mm_shuffle_ps(u.m, u.m, _MM_SHUFFLE(3, 0, 2, 1));
+    const __m128 u_zxy = _mm_shuffle_ps(u.m, u.m, _MM_SHUFFLE(3, 1, 0, 2));
+    const __m128 v_yzx = _mm_shuffle_ps(v.m, v.m, _MM_SHUFFLE(3, 0, 2, 1));
+    const __m128 v_zxy = _mm_shuffle_ps(v.m, v.m, _MM_SHUFFLE(3, 1, 0, 2));
+    return vec3_t<float>(_mm_sub_ps(_mm_mul_ps(u_yzx, v_zxy), _mm_mul_ps(u_zxy, v_yzx)));
+}
+
+#endif // RTW_SSE
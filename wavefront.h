@@ -0,0 +1,196 @@
+#pragma once
+
+#include "rtweekend.h"
+#include "camera.h"
+#include "framebuffer.h"
+#include "hittable.h"
+#include "material.h"
+#include "renderer.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <typeinfo>
+#include <vector>
+
+
+/* Wavefront path tracing: instead of following one path to the end (ray_color), all camera samples
+   of a tile advance one bounce at a time through four stages, each a tight loop over many paths:
+     generate    - one camera ray per path
+     extend      - intersect every live ray with the world
+     shade       - hit points sorted by material, then emission and scattering
+     accumulate  - finished paths add their radiance to their pixel
+   Each path keeps its own random stream, so it draws exactly the numbers the recursive path would. */
+
+// Rays of all live paths, one array per component.
+struct wavefront_rays
+{
+    std::vector<real> ox, oy, oz;
+    std::vector<real> dx, dy, dz;
+    std::vector<real> time;
+    std::vector<real> cone_width, cone_spread;
+
+    void resize(size_t n)
+    {
+        for (auto* v : { &ox, &oy, &oz, &dx, &dy, &dz, &time, &cone_width, &cone_spread })
+            v->resize(n);
+    }
+
+    ray get(size_t k) const
+    {
+        ray r(vec3(ox[k], oy[k], oz[k]), vec3(dx[k], dy[k], dz[k]), time[k]);
+        r.cone_width = cone_width[k];
+        r.cone_spread = cone_spread[k];
+        return r;
+    }
+
+    void set(size_t k, const ray& r)
+    {
+        ox[k] = r.origin().x(); oy[k] = r.origin().y(); oz[k] = r.origin().z();
+        dx[k] = r.direction().x(); dy[k] = r.direction().y(); dz[k] = r.direction().z();
+        time[k] = r.time();
+        cone_width[k] = r.cone_width;
+        cone_spread[k] = r.cone_spread;
+    }
+};
+
+// Per-thread path state, reused from tile to tile.
+struct wavefront_state
+{
+    wavefront_rays rays;
+    std::vector<hit_record> hits;
+    std::vector<vec3> throughput;
+    std::vector<vec3> radiance;
+    std::vector<rng_stream> rng;
+    std::vector<uint32_t> pixel;
+
+    std::vector<uint32_t> active; // paths with a ray to trace
+    std::vector<uint32_t> shade;  // paths whose ray hit something
+
+    void resize(size_t n)
+    {
+        rays.resize(n);
+        hits.resize(n);
+        throughput.resize(n);
+        radiance.resize(n);
+        rng.resize(n);
+        pixel.resize(n);
+        active.reserve(n);
+        shade.reserve(n);
+    }
+};
+
+// Upper bound for the paths in flight per thread; larger tiles are processed in several waves of samples.
+const size_t wavefront_max_paths = 1 << 16;
+
+void wavefront_generate(wavefront_state& w, const tile& t, const render_settings& settings, const camera& cam,
+    int first_sample, int sample_count)
+{
+    w.active.clear();
+    size_t k = 0;
+    for (int j = t.y0; j < t.y1; ++j)
+    {
+        for (int i = t.x0; i < t.x1; ++i)
+        {
+            const uint32_t pixel = static_cast<uint32_t>(j) * settings.image_width + i;
+            for (int s = first_sample; s < first_sample + sample_count; ++s, ++k)
+            {
+                rng_seed(pixel, s);
+                auto u = (i + random_double()) / settings.image_width;
+                auto v = (j + random_double()) / settings.image_height;
+                w.rays.set(k, cam.get_ray(u, v));
+                w.rng[k] = rng_current;
+                w.pixel[k] = pixel;
+                w.throughput[k] = vec3(1, 1, 1);
+                w.radiance[k] = Color::black;
+                w.active.push_back(static_cast<uint32_t>(k));
+            }
+        }
+    }
+}
+
+// Misses pick up the background and leave the wave, hits are queued for shading.
+void wavefront_extend(wavefront_state& w, const hittable& world, const vec3& background)
+{
+    w.shade.clear();
+    for (uint32_t k : w.active)
+    {
+        rng_current = w.rng[k];
+        const ray r = w.rays.get(k);
+        if (world.hit(r, ray_epsilon(r), infinity, w.hits[k]))
+            w.shade.push_back(k);
+        else
+            w.radiance[k] += w.throughput[k] * background;
+        w.rng[k] = rng_current;
+    }
+}
+
+// Paths are shaded grouped by material type and instance, so each group runs the same scatter code
+// on the same material data back to back. Paths that scatter stay active for the next bounce.
+void wavefront_shade(wavefront_state& w)
+{
+    std::sort(w.shade.begin(), w.shade.end(), [&](uint32_t a, uint32_t b)
+    {
+        const material* ma = w.hits[a].mat_ptr;
+        const material* mb = w.hits[b].mat_ptr;
+        const size_t ta = typeid(*ma).hash_code();
+        const size_t tb = typeid(*mb).hash_code();
+        return ta != tb ? ta < tb : ma < mb;
+    });
+
+    w.active.clear();
+    for (uint32_t k : w.shade)
+    {
+        const hit_record& rec = w.hits[k];
+        rng_current = w.rng[k];
+
+        w.radiance[k] += w.throughput[k] * rec.mat_ptr->emitted(rec.u, rec.v, rec.p);
+
+        ray scattered;
+        vec3 attenuation;
+        const ray r = w.rays.get(k);
+        if (rec.mat_ptr->scatter(r, rec, attenuation, scattered))
+        {
+            rec.continue_cone(r, scattered);
+            w.throughput[k] = w.throughput[k] * attenuation;
+            w.rays.set(k, scattered);
+            w.active.push_back(k);
+        }
+        w.rng[k] = rng_current;
+    }
+}
+
+void wavefront_accumulate(const wavefront_state& w, size_t path_count, framebuffer& fb)
+{
+    for (size_t k = 0; k < path_count; ++k)
+        fb.add_sample(w.pixel[k], w.radiance[k]);
+}
+
+// Renders one tile with the wavefront integrator, adding its samples to fb.
+void render_tile_wavefront(const tile& t, const render_settings& settings, const camera& cam, const hittable& world,
+    const vec3& background, framebuffer& fb)
+{
+    thread_local wavefront_state w;
+
+    const size_t tile_pixels = static_cast<size_t>(t.x1 - t.x0) * (t.y1 - t.y0);
+    const int samples_per_wave = static_cast<int>(std::max<size_t>(1, wavefront_max_paths / tile_pixels));
+
+    const int end = settings.first_sample + settings.samples_per_pixel;
+    for (int first = settings.first_sample; first < end; first += samples_per_wave)
+    {
+        const int count = std::min(samples_per_wave, end - first);
+        const size_t path_count = tile_pixels * count;
+        if (w.pixel.size() < path_count)
+            w.resize(path_count);
+
+        wavefront_generate(w, t, settings, cam, first, count);
+
+        // Same bounce limit as ray_color: at most max_depth rays per path.
+        for (int depth = settings.max_depth; depth > 0 && !w.active.empty(); --depth)
+        {
+            wavefront_extend(w, world, background);
+            wavefront_shade(w);
+        }
+
+        wavefront_accumulate(w, path_count, fb);
+    }
+}
@@ -0,0 +1,317 @@
+#pragma once
+
+#include "rtweekend.h"
+#include "hittable.h"
+#include "bvh.h"
+#include "flat_bvh.h"
+
+#include <cstdint>
+#include <vector>
+
+
+/* Node of a 4-wide or 8-wide BVH. The bounds of all N children are stored per axis (SoA),
+   so one SIMD slab test checks every child at once. Child slot i is
+     - an interior node if count[i] == 0 and child[i] >= 0 (index into the node array),
+     - a leaf with count[i] primitives starting at child[i] in the primitive array,
+     - empty if child[i] < 0. Empty slots have inverted bounds and never hit. */
+template <int N>
+struct alignas(64) wide_bvh_node
+{
+    float bmin[3][N];
+    float bmax[3][N];
+    int32_t child[N];
+    uint8_t count[N];
+};
+
+// Ray in the single precision form used by the SIMD box tests.
+struct wide_bvh_ray
+{
+    float origin[3];
+    float inv_dir[3];
+    int dir_neg[3];
+};
+
+/* Slab test of all N children. Writes the entry distances to tnear and returns a bit mask of the
+   children that are hit within [tmin, tmax]. The min/max operands are ordered so that NaNs from
+   0 * inf (ray in the plane of a slab) are dropped instead of propagated.
+   Float rounding of the ray may lose hits that graze a box, so the interval is widened slightly. */
+template <int N>
+inline int wide_slab_test(const wide_bvh_node<N>& node, const wide_bvh_ray& r, float tmin, float tmax, float* tnear)
+{
+    int mask = 0;
+    for (int i = 0; i < N; ++i)
+    {
+        float t0 = tmin;
+        float t1 = tmax;
+        for (int a = 0; a < 3; ++a)
+        {
+            const float* near_plane = r.dir_neg[a] ? node.bmax[a] : node.bmin[a];
+            const float* far_plane = r.dir_neg[a] ? node.bmin[a] : node.bmax[a];
+            const float tn = (near_plane[i] - r.origin[a]) * r.inv_dir[a];
+            const float tf = (far_plane[i] - r.origin[a]) * r.inv_dir[a];
+            t0 = tn > t0 ? tn : t0;
+            t1 = tf < t1 ? tf : t1;
+        }
+        tnear[i] = t0;
+        if (t0 <= t1 * 1.000001f)
+            mask |= 1 << i;
+    }
+    return mask;
+}
+
+#ifdef RTW_SSE
+template <>
+inline int wide_slab_test<4>(const wide_bvh_node<4>& node, const wide_bvh_ray& r, float tmin, float tmax, float* tnear)
+{
+    __m128 t0 = _mm_set1_ps(tmin);
+    __m128 t1 = _mm_set1_ps(tmax);
+    for (int a = 0; a < 3; ++a)
+    {
+        const __m128 o = _mm_set1_ps(r.origin[a]);
+        const __m128 inv = _mm_set1_ps(r.inv_dir[a]);
+        const __m128 near_plane = _mm_load_ps(r.dir_neg[a] ? node.bmax[a] : node.bmin[a]);
+        const __m128 far_plane = _mm_load_ps(r.dir_neg[a] ? node.bmin[a] : node.bmax[a]);
+        // _mm_max_ps / _mm_min_ps return the second operand if either is NaN.
+        t0 = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(near_plane, o), inv), t0);
+        t1 = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(far_plane, o), inv), t1);
+    }
+    _mm_storeu_ps(tnear, t0);
+    t1 = _mm_mul_ps(t1, _mm_set1_ps(1.000001f));
+    return _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+}
+#endif
+
+#ifdef RTW_AVX2
+template <>
+inline int wide_slab_test<8>(const wide_bvh_node<8>& node, const wide_bvh_ray& r, float tmin, float tmax, float* tnear)
+{
+    __m256 t0 = _mm256_set1_ps(tmin);
+    __m256 t1 = _mm256_set1_ps(tmax);
+    for (int a = 0; a < 3; ++a)
+    {
+        const __m256 o = _mm256_set1_ps(r.origin[a]);
+        const __m256 inv = _mm256_set1_ps(r.inv_dir[a]);
+        const __m256 near_plane = _mm256_load_ps(r.dir_neg[a] ? node.bmax[a] : node.bmin[a]);
+        const __m256 far_plane = _mm256_load_ps(r.dir_neg[a] ? node.bmin[a] : node.bmax[a]);
+        t0 = _mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(near_plane, o), inv), t0);
+        t1 = _mm256_min_ps(_mm256_mul_ps(_mm256_sub_ps(far_plane, o), inv), t1);
+    }
+    _mm256_storeu_ps(tnear, t0);
+    t1 = _mm256_mul_ps(t1, _mm256_set1_ps(1.000001f));
+    return _mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ));
+}
+#endif
+
+
+// N-ary BVH collapsed from a finished binary bvh_node tree: every node takes over the children of
+// its largest interior children until it has N of them. Children are visited nearest first.
+template <int N>
+class wide_bvh : public hittable
+{
+    public:
+        wide_bvh(shared_ptr<bvh_node> root);
+
+        wide_bvh(hittable_list& list, double time0, double time1, bvh_split split = bvh_default_split)
+            : wide_bvh(scene_make<bvh_node>(list, time0, time1, split))
+        {}
+
+        virtual bool hit(const ray& r, real t_min, real t_max, hit_record& rec) const;
+
+        virtual bool bounding_box(double time0, double time1, aabb& output_box) const
+        {
+            output_box = box;
+            return true;
+        }
+
+        size_t memory_bytes() const
+        {
+            return nodes.capacity() * sizeof(wide_bvh_node<N>) + primitives.capacity() * sizeof(const hittable*);
+        }
+
+    public:
+        // Every level above the visited node leaves at most N - 1 entries on the stack, so a traversal
+        // holds at most (N - 1) * depth + 1. Deeper trees use a heap stack of that size.
+        static const int stack_size = 64 * N;
+
+        std::vector<wide_bvh_node<N>> nodes;
+        std::vector<const hittable*> primitives;
+        int depth = 0; // levels of wide nodes
+
+    private:
+        int32_t collapse(const bvh_node* node, int level);
+
+        // The primitives are still owned by the original tree.
+        shared_ptr<bvh_node> source;
+        aabb box;
+};
+
+inline aabb bvh_child_box(const hittable* object)
+{
+    aabb bounds;
+    if (auto node = dynamic_cast<const bvh_node*>(object))
+        return node->box;
+    object->bounding_box(0, 1, bounds);
+    return bounds;
+}
+
+template <int N>
+wide_bvh<N>::wide_bvh(shared_ptr<bvh_node> root)
+    : source(root), box(root->box)
+{
+    collapse(root.get(), 1);
+}
+
+template <int N>
+int32_t wide_bvh<N>::collapse(const bvh_node* node, int level)
+{
+    depth = std::max(depth, level);
+
+    // Open up the interior child with the largest surface area until there are N children.
+    std::vector<const hittable*> children;
+    children.push_back(node->left.get());
+    if (node->right != node->left)
+        children.push_back(node->right.get());
+
+    while (static_cast<int>(children.size()) < N)
+    {
+        int largest = -1;
+        double largest_area = -1.0;
+        for (int i = 0; i < static_cast<int>(children.size()); ++i)
+        {
+            auto inner = dynamic_cast<const bvh_node*>(children[i]);
+            if (inner != nullptr && surface_area(inner->box) > largest_area)
+            {
+                largest = i;
+                largest_area = surface_area(inner->box);
+            }
+        }
+        if (largest < 0)
+            break;
+
+        auto inner = static_cast<const bvh_node*>(children[largest]);
+        children[largest] = inner->left.get();
+        if (inner->right != inner->left)
+            children.push_back(inner->right.get());
+    }
+
+    const auto index = static_cast<int32_t>(nodes.size());
+    nodes.emplace_back();
+
+    for (int i = 0; i < N; ++i)
+    {
+        auto& slot = nodes[index];
+        if (i >= static_cast<int>(children.size()))
+        {
+            for (int a = 0; a < 3; ++a)
+            {
+                slot.bmin[a][i] = std::numeric_limits<float>::infinity();
+                slot.bmax[a][i] = -std::numeric_limits<float>::infinity();
+            }
+            slot.child[i] = -1;
+            slot.count[i] = 0;
+            continue;
+        }
+
+        const aabb bounds = bvh_child_box(children[i]);
+        for (int a = 0; a < 3; ++a)
+        {
+            slot.bmin[a][i] = float_round_down(bounds.min()[a]);
+            slot.bmax[a][i] = float_round_up(bounds.max()[a]);
+        }
+
+        if (auto inner = dynamic_cast<const bvh_node*>(children[i]))
+        {
+            // The recursion may reallocate the node array, so don't hold on to slot.
+            const int32_t child = collapse(inner, level + 1);
+            nodes[index].child[i] = child;
+            nodes[index].count[i] = 0;
+        }
+        else
+        {
+            slot.child[i] = static_cast<int32_t>(primitives.size());
+            slot.count[i] = 1;
+            primitives.push_back(children[i]);
+        }
+    }
+
+    return index;
+}
+
+template <int N>
+bool wide_bvh<N>::hit(const ray& r, real t_min, real t_max, hit_record& rec) const
+{
+    RTW_COUNT_HIT();
+    wide_bvh_ray wr;
+    for (int a = 0; a < 3; ++a)
+    {
+        wr.origin[a] = static_cast<float>(r.origin()[a]);
+        wr.inv_dir[a] = static_cast<float>(r.inv_dir[a]);
+        wr.dir_neg[a] = r.sign[a];
+    }
+
+    struct entry
+    {
+        int32_t child;
+        int32_t count;
+        float tnear;
+    };
+
+    entry local_stack[stack_size];
+    std::vector<entry> deep_stack;
+    entry* stack = local_stack;
+    if ((N - 1) * depth + 1 > stack_size)
+    {
+        deep_stack.resize((N - 1) * depth + 1);
+        stack = deep_stack.data();
+    }
+    int stack_top = 0;
+    stack[stack_top++] = entry{ 0, 0, static_cast<float>(t_min) };
+
+    bool hit_anything = false;
+    double closest_so_far = t_max;
+
+    while (stack_top > 0)
+    {
+        const entry current = stack[--stack_top];
+        if (current.tnear > closest_so_far)
+            continue;
+
+        if (current.count > 0)
+        {
+            for (int32_t k = current.child; k < current.child + current.count; ++k)
+            {
+                if (primitives[k]->hit(r, t_min, closest_so_far, rec))
+                {
+                    hit_anything = true;
+                    closest_so_far = rec.t;
+                }
+            }
+            continue;
+        }
+
+        const wide_bvh_node<N>& node = nodes[current.child];
+        alignas(32) float tnear[N];
+        int mask = wide_slab_test<N>(node, wr, static_cast<float>(t_min), static_cast<float>(closest_so_far), tnear);
+
+        // Push the hit children far to near, so the nearest one is popped first.
+        const int first = stack_top;
+        while (mask != 0)
+        {
+            int i = 0;
+            while (((mask >> i) & 1) == 0)
+                ++i;
+            mask &= mask - 1;
+
+            entry e{ node.child[i], node.count[i], tnear[i] };
+            int k = stack_top++;
+            while (k > first && stack[k - 1].tnear < e.tnear)
+            {
+                stack[k] = stack[k - 1];
+                --k;
+            }
+            stack[k] = e;
+        }
+    }
+
+    return hit_anything;
+}